@@ -1,6 +1,3 @@
-/* TODO:
-   WriteSEQRES needs to deal with chain labels for MODRES
-*/
 /************************************************************************/
 /**
 
@@ -46,11 +43,24 @@
 *************************************************************************/
 /* Includes
 */
+#define _POSIX_C_SOURCE 200809L   /* For mmap(), readlink(), strdup()   */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <math.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_X86_SIMD 1
+#  include <immintrin.h>
+#endif
 #ifdef __linux__
 #  include <linux/limits.h>
 #else
@@ -63,6 +73,8 @@
 #include "bioplib/seq.h"
 #include "bioplib/sequtil.h"
 #include "bioplib/array.h"
+#include "bioplib/general.h"
+#include "bioplib/port.h"
 
 #include "absplit.h"
 
@@ -78,8 +90,6 @@
 #define GAPOPENPENALTY  5
 #define GAPEXTPENALTY   2
 #define SCOREMATRIX     "BLOSUM62"
-#define MAXINTERFACE    20
-#define MAXCDRRES       160
 #define MAXRESID        16
 #define MINSEQLEN       50
 #define COFGDISTCUTSQ   1225.0 /* 35^2 - for possible VH/VL pairs       */
@@ -92,53 +102,590 @@
 #define MINAGCONTOK     30     /* If we have this many we always count as
                                   antigen                               */
 #define MINHETATOMS     8
-#define MAXANTIGEN      16
+#define MAXANTIGEN      16     /* Initial antigen chains per domain     */
 #define MAXCHAINS       80     /* Max number of chains in a PDB         */
 #define MAXCHAINLABEL   blMAXCHAINLABEL
-#define MAXHETANTIGEN   160
+#define MAXHETANTIGEN   160    /* Initial HET antigens per domain       */
+#define ARENABLOCKSIZE  65536  /* Default arena block size              */
+#define MAXGRIDCELLS    2097152 /* Cells in the antigen contact grid    */
+#define BOUNDSSLACK     0.001  /* Rounding allowance for bounding spheres*/
 #define CHAINTYPE_PROT  (APTR)1
 #define CHAINTYPE_NUCL  (APTR)2
 #define CHAINTYPE_HET   (APTR)3
-#define RES_WRITTEN_NO  (APTR)0
-#define RES_WRITTEN_YES (APTR)1
+#define RES_HASATOM     1      /* Residue classes (bit flags)           */
+#define RES_ALLHET      2      /* Only HETATM records                   */
+#define RES_BACKBONE    4      /* At least 3 HETATM backbone atoms      */
+#define RES_STANDARD    8      /* Part of the chain sequence            */
+#define RES_NUCLEOTIDE  16
+#define RES_WATER       32
+#define HETHASHSIZE     64     /* Buckets in the HET group table        */
+#define SEQRESCHAINCOL  11     /* Chain label columns (from 0)          */
+#define MODRESCHAINCOL  16
+#define HET_ION         1      /* HET group classes (bit flags); a HET  */
+                               /* group with none of these is a ligand  */
 #define SAMESEQ_CUTOFF  0.94   /* Was 0.98                              */
+#define AACODES         "ARNDCQEGHILKMFPSTWYVBZX"
+#define NAACODES        24     /* AACODES plus one for anything else    */
+#define AACODE_X        22     /* Code for X (masked residues)          */
+#define AACODE_UNKNOWN  23     /* Scores zero against everything        */
+#define KMERLEN         3      /* k-mer length for the prefilter        */
+#define NKMERS          (NAACODES*NAACODES*NAACODES)
+#define DEFSHORTLIST    16     /* Default templates aligned per query   */
+#define INDEXMAGIC      "ABSPLIX"
+#define INDEXVERSION    2
+#define CACHEMAGIC      "ABSPLCA"
+#define CACHEVERSION    1
+#define CACHESLOTS      262144 /* Hash slots in a new alignment cache   */
+#define CACHEGROW       1048576 /* Minimum growth of the cache file     */
+#define NEGSCORE        (-100000000) /* Effectively minus infinity      */
+#define NWORKROWS       16     /* Column arrays in an ALIGNWORK         */
+#define ALIGN_AUTO      (-1)   /* Alignment engines                     */
+#define ALIGN_BIOPLIB   0
+#define ALIGN_SCALAR    1
+#define ALIGN_SSE4      2
+#define ALIGN_AVX2      3
+#define ALIGN_BATCH     4      /* AVX2 with templates in the lanes      */
+#define CONTACT_SCALAR  1      /* Contact distance kernels              */
+#define CONTACT_AVX2    2
+#define CONTACT_AVX512  3
+#define CONTACTSLACKSQ  0.1    /* Margin on CONTACTDISTSQ for the float
+                                  kernels; candidates are rechecked in
+                                  double precision                      */
+#define DIR_DIAG        0      /* Traceback choices                     */
+#define DIR_RIGHT       1
+#define DIR_DOWN        2
+#define DIR_CHOICE      3
+#define DIR_ROPEN       4      /* R opened a gap here                   */
+#define DIR_DOPEN       8      /* D opened a gap here                   */
+#define COUNT_ALIGNED   65536  /* Packed aligned/identical pair counts   */
+#define COUNT_MATCHED   1
+#define BATCHLANES      16     /* Templates per batch (16-bit lanes)    */
+#define BATCHMAXLEN     255    /* Longest template that can be batched  */
+#define NEGSCORE16      (-32768)
+#define BATCH_COUNT_ALIGNED 256
+#define BATCH_COUNT_MATCHED 1
+
+/* Bit sets stored as arrays of bytes                                   */
+#define BITSETBYTES(n)  (((n) + 7) / 8)
+#define BITSET(b, i)    ((b)[(i) >> 3] |= (UBYTE)(1 << ((i) & 7)))
+#define BITTEST(b, i)   ((b)[(i) >> 3] & (1 << ((i) & 7)))
+
+/* Is residue i of a domain (numbered as for CDRRes and interface) a CDR
+   or interface residue?
+*/
+#define ISDOMAINKEY(bits, d, i)                      \
+   (((i) >= (d)->keyBase) &&                         \
+    ((i) <  (d)->keyBase + (d)->nKeyBits) &&         \
+    BITTEST((bits), (i) - (d)->keyBase))
+#define ISCDRRES(d, i)       ISDOMAINKEY((d)->CDRBits, d, i)
+#define ISINTERFACERES(d, i) ISDOMAINKEY((d)->IFBits,  d, i)
+
+/* Atom, residue and record names packed into integers so they can be
+   compared in one go (and used as case labels)
+*/
+#define PACKNAME4(a, b, c, d)                                     \
+   (((ULONG)(UBYTE)(a) << 24) | ((ULONG)(UBYTE)(b) << 16) |       \
+    ((ULONG)(UBYTE)(c) << 8)  |  (ULONG)(UBYTE)(d))
+#define PACKNAME3(a, b, c) PACKNAME4(a, b, c, 0)
+#define PACKSTR4(s)        PACKNAME4((s)[0], (s)[1], (s)[2], (s)[3])
+#define PACKSTR3(s)        PACKNAME3((s)[0], (s)[1], (s)[2])
+
+/* Classification of a residue from ClassifyResidues()                  */
+#define RESCLASS(r)     ((RESINFO *)((r)->extras))
+
+/* Position of query residue i in a striped profile or column          */
+#define STRIPEDPOS(i, segLen, nLanes) \
+   ((((i) % (segLen)) * (nLanes)) + ((i) / (segLen)))
+
+/* A block of memory in an arena                                        */
+typedef struct _arenablock
+{
+   size_t size,
+          used;
+   struct _arenablock *next;
+}  ARENABLOCK;
+
+/* Memory that is all freed together                                    */
+typedef struct
+{
+   ARENABLOCK *blocks;       /* Current block first                     */
+   size_t     blockSize;
+}  ARENA;
+
+/* Classification of a residue, made once when the entry is loaded and
+   kept in the residue's extras field
+*/
+typedef struct
+{
+   PDB   *CA;                /* First CA atom (or NULL)                 */
+   int   nAtoms,
+         flags;              /* RES_xxx flags                           */
+   char  aa;                 /* One-letter code                         */
+   BOOL  written;            /* Written out as a HET antigen            */
+}  RESINFO;
+
+/* A bounding sphere round a set of atoms                              */
+typedef struct
+{
+   VEC3F centre;
+   REAL  radius;
+   int   nAtoms;
+}  BOUNDS;
 
+/* The residues of a chain indexed by their position in the sequence
+   from GetSequenceForChain()
+*/
+typedef struct
+{
+   PDBCHAIN   *chain;
+   PDBRESIDUE **residues;
+   PDB        **CA;          /* CA of each residue (NULL if none)       */
+   BOUNDS     *bounds;       /* Bounding sphere of each residue         */
+   int        *nAtoms,
+              nRes;
+}  RESINDEX;
+
+/* All the atoms binned into cubic cells no smaller than the antigen 
+   contact distance, so that only the neighbouring cells need to be 
+   searched for contacts
+*/
+typedef struct
+{
+   PDB        **atoms;       /* Atoms sorted by cell                    */
+   float      *x, *y, *z;    /* Their coordinates relative to minX etc. */
+   PDBCHAIN   **resChain;    /* Chain of each residue                   */
+   PDBRESIDUE **residues;    /* Each residue, in chain order            */
+   BOOL       *resStandard;  /* Is each residue a standard residue?     */
+   int      *atomRes,        /* Residue number of each atom             */
+            *chainStart,     /* First residue of each chain (nChains+1) */
+            *hits,           /* Workspace for the contact kernels       */
+            nChains,
+            *cellStart,      /* First atom in each cell (nCells+1)      */
+            *resStamp,       /* Last query in which each residue was 
+                                counted                                 */
+            nx, ny, nz,
+            nRes,
+            stamp;
+   REAL     minX, minY, minZ,
+            cellSize;
+}  ATOMGRID;
+
+/* An antibody domain. The arrays are allocated from the arena for the
+   PDB entry and the antigen arrays grow as needed
+*/
 typedef struct _domain
 {
    int   domainNumber,
          startSeqRes,
          lastSeqRes,
-         interface[MAXINTERFACE],
+         *interface,
          nInterface,
          nAntigenChains,
+         maxAntigenChains,
          nHetAntigen,
+         maxHetAntigen,
          nCDRRes,
-         CDRRes[MAXCDRRES];
-   char  domSeq[MAXSEQ],
+         *CDRRes;
+   char  *domSeq,
          newAbChainLabel[8],
-         newAgChainLabels[MAXANTIGEN][8],
+         (*newAgChainLabels)[8],
          chainType;
    PDB   *startRes,
          *lastRes,
          *stopRes;
+   BOUNDS bounds;            /* Bounding sphere of the domain           */
    VEC3F CofG,
          IntCofG;
    REAL  pairIntDistSq,
          pairCofGDistSq;
    BOOL  used;
-   PDBRESIDUE *hetAntigen[MAXHETANTIGEN];
+   int   keyBase,            /* First residue number in the bit sets    */
+         nKeyBits;
+   UBYTE *CDRBits,           /* CDRRes and interface as bit sets        */
+         *IFBits;
+   PDBRESIDUE **hetAntigen;
    PDBCHAIN   *chain,
-              *antigenChains[MAXANTIGEN];
+              **antigenChains;
+   RESINDEX   *resIndex;     /* Residues of the chain                   */
+   ARENA      *arena;
    struct _domain *pairedDomain;
    struct _domain *next;
 }  DOMAIN;
 
+/* A contact between an antibody domain residue and a residue of another
+   chain (or a non-standard residue of the same chain)
+*/
+typedef struct
+{
+   DOMAIN *domain;
+   int    resnum;            /* Residue in the domain (from 0)          */
+   BOOL   isCDR;
+}  CONTACT;
+
+/* A CDR atom in the KD-tree                                            */
+typedef struct
+{
+   PDB    *atom;
+   DOMAIN *domain;
+   int    resnum,            /* Residue in the domain (from 0)          */
+          resId;             /* Number of the CDR residue               */
+}  KDATOM;
+
+/* KD-tree over the CDR atoms of all the domains. Each range of atoms is
+   split by the atom at its middle, which is the median along axis[]
+*/
+typedef struct
+{
+   KDATOM *atoms;
+   UBYTE  *axis;             /* Split axis of each node (0=x, 1=y, 2=z) */
+   int    *resStamp,         /* Last query that found each CDR residue  */
+          nAtoms,
+          nRes,
+          stamp;
+   VEC3F  min, max;          /* Bounding box of the atoms               */
+}  KDTREE;
+
+/* A crystal packing check that has been done                           */
+typedef struct _seqmatch
+{
+   char   *domSeq,
+          *chainSeq;
+   BOOL   match;
+   struct _seqmatch *next;
+}  SEQMATCH;
+
+/* Chain sequences and the results of the crystal packing checks for an
+   entry. Chains with the same sequence share one copy, so a check is
+   only done once for each pair of sequences.
+*/
+typedef struct
+{
+   char     **chainSeqs;     /* Sequence of each chain (NULL until used)*/
+   int      nChains;
+   SEQMATCH *matches;
+   ARENA    *arena;
+}  SEQCHECKS;
+
+/* Classification of a HET group from the header                        */
+typedef struct _hetentry
+{
+   char  resnam[8];
+   int   flags;              /* HET_xxx flags                           */
+   struct _hetentry *next;
+}  HETENTRY;
+
+/* The SEQRES and MODRES records for a chain label                     */
+typedef struct
+{
+   STRINGLIST **seqres,
+              **modres;
+   int        nSeqres,
+              nModres;
+}  HEADERCHAIN;
+
+/* SEQRES and MODRES records of an entry, indexed by chain label        */
+typedef struct
+{
+   HEADERCHAIN chains[256];
+}  HEADERINDEX;
+
+/* HET groups of an entry by residue name, with its MODRES records      */
+typedef struct
+{
+   HETENTRY *buckets[HETHASHSIZE];
+   MODRES   *modres;
+}  HETTABLE;
+
+/* The contacts made by all the antibody domains, grouped by the residue
+   that they contact. Residues and chains are numbered in the order of
+   the PDB structure.
+*/
+typedef struct
+{
+   CONTACT    *contacts;
+   PDBRESIDUE **residues;
+   int        *resStart,     /* First contact of each residue (nRes+1)  */
+              *chainStart,   /* First residue of each chain (nChains+1) */
+              nRes,
+              nChains,
+              nContacts;
+}  CONTACTMAP;
+
+typedef struct
+{
+   char  *header,            /* FASTA header                            */
+         *seq,               /* Template sequence                       */
+         chainType;          /* 'H', 'L' or '?'                         */
+   UBYTE *codes;             /* Integer-encoded sequence                */
+   int   seqLen,
+         nIFRes,
+         nCDRRes,
+         *IFRes,             /* -1 terminated interface positions       */
+         *CDRRes;            /* -1 terminated CDR positions             */
+   UBYTE *IFBits,            /* Interface and CDR positions as bit sets */
+         *CDRBits;           /* over 0..seqLen+1                        */
+}  TEMPLATE;
+
+typedef struct
+{
+   TEMPLATE *templates;      /* Array of nTemplates entries             */
+   int      nTemplates,
+            nChars,          /* Sizes of the character and code pools   */
+            nInts,           /* Size of the integer pool                */
+            maxSeqLen;       /* Longest template sequence               */
+   char     *charPool;       /* Storage for all headers and sequences   */
+   UBYTE    *codePool;       /* Integer-encoded sequences               */
+   int      *intPool,        /* Storage for all IF and CDR positions    */
+            *scoreMatrix;    /* NAACODES x NAACODES score matrix        */
+   void     *mapping;        /* mmap()ed binary index (or NULL)         */
+   size_t   mapSize;
+   int      *kmerStart,      /* NKMERS+1 offsets into kmerTemplates     */
+            *kmerTemplates;  /* Templates containing each k-mer         */
+   UBYTE    *bitPool;        /* Storage for the IF and CDR bit sets     */
+}  TEMPLATELIB;
+
+/* A domain found in a chain, kept so that it can be reused for other
+   chains in the same entry that have the same sequence
+*/
+typedef struct _domainhit
+{
+   TEMPLATE *template;       /* Best matching template                  */
+   REAL     score;
+   char     *alignSeqres,    /* Alignment with the template             */
+            *alignRef,
+            *domSeq;
+   int      startSeqRes,
+            lastSeqRes,
+            nInterface,
+            nCDRRes,
+            *interface,
+            *CDRRes;
+   struct _domainhit *next;
+}  DOMAINHIT;
+
+/* The domains found in a chain sequence                                */
+typedef struct _chainhit
+{
+   ULONG     hash;           /* FNV-1a hash of the sequence             */
+   char      *seq;
+   PDBCHAIN  *chain;         /* First chain with this sequence          */
+   DOMAINHIT *hits;
+   struct _chainhit *next;
+}  CHAINHIT;
+
+/* Coordinate maps for an alignment of a chain with a template         */
+typedef struct
+{
+   int   alignLen,
+         seqLen,             /* Residues in the chain sequence          */
+         refLen,             /* Residues in the template                */
+         *seqPos,            /* Chain residue in each column (or -1)    */
+         *refPos,            /* Template residue in each column (or -1) */
+         *seqCol,            /* Column of each chain residue            */
+         *refCol,            /* Column of each template residue         */
+         *refCount;          /* Template residues up to and including
+                                each column (alignLen+1 entries)        */
+}  ALIGNMAP;
+
+/* An open persistent alignment cache                                  */
+typedef struct
+{
+   int    fd;
+   char   *mapping;          /* mmap()ed cache file                     */
+   size_t mapSize;
+   ULONG  libVersion,        /* Hash of the template library            */
+          hits,              /* Lookups in this run                     */
+          misses,
+          reclaimed,         /* Stale slots reclaimed in this run       */
+          notStored;         /* Results not stored as the cache is full */
+}  ALIGNCACHE;
+
+/* An archive holding all the output files one after another, with an
+   index giving the name, offset and length of each
+*/
+typedef struct
+{
+   FILE *fp,
+        *index;
+}  ARCHIVE;
+
+/* Persistent alignment cache file - a header, a hash table of slots and
+   then the records. Offsets are in bytes from the start of the file.
+*/
+typedef struct
+{
+   char  magic[8];
+   int   version,
+         headerSize,
+         slotSize,
+         nSlots;
+   ULONG nUsed,              /* Slots in use                            */
+         dataEnd,            /* End of the last record                  */
+         hits,               /* Totals over all runs                    */
+         misses;
+}  CACHEHEADER;
+
+typedef struct
+{
+   ULONG seqHash,            /* HashSequence() of the chain sequence    */
+         libVersion,
+         offset;             /* Record offset (0 if the slot is empty)  */
+   int   domainNum,          /* Domains already found in the chain      */
+         recordSize;
+}  CACHESLOT;
+
+/* A cache record is followed by the chain sequence and the two 
+   alignment strings, each '\0' terminated
+*/
+typedef struct
+{
+   REAL  score;
+   int   templateNum,        /* -1 if no domain was found               */
+         seqLen,
+         alignLen;
+}  CACHERECORD;
+
+/* A query sequence prepared for the native aligner                   */
+typedef struct
+{
+   char  *seq;               /* The query sequence                      */
+   UBYTE *codes;             /* Integer-encoded query, reversed         */
+   int   seqLen,
+         maxSeqLen,          /* Longest sequence the query can hold     */
+         nLanes,             /* 32-bit lanes per vector (1 for scalar)  */
+         segLen,             /* Positions per lane in the striped layout*/
+         engine,             /* ALIGN_xxx                               */
+         *profile,           /* NAACODES blocks of segLen*nLanes scores */
+         *matchProfile,      /* and of packed aligned/identical counts  */
+         *scoreMatrix;       /* NAACODES x NAACODES score matrix        */
+}  ALIGNQUERY;
+
+/* Dynamic programming workspace for the native aligner. Column arrays
+   are in the striped layout of the query
+*/
+typedef struct
+{
+   int   maxTemplateLen,
+         maxQueryLen,        /* Longest query the workspace can take    */
+         maxRows,            /* and the most rows in its striped layout */
+         *buffer,            /* Storage for all the int arrays          */
+         *H,                 /* Current column                          */
+         *Hprev,             /* Previous column                         */
+         *S1,                /* Previous column shifted down one row    */
+         *S1prev,            /* S1 for the previous column              */
+         *S2,                /* Previous column shifted down two rows   */
+         *Rc,                /* Best gap to the right                   */
+         *Ropen,             /* Mask: Rc opened a gap                   */
+         *Dc,                /* Best gap down                           */
+         *Rbound,            /* 0 in the first two rows, else NEGSCORE  */
+         *Hcnt,              /* Packed aligned/identical counts for the */
+         *Hprevcnt,          /* paths leading to H, Hprev, etc.         */
+         *S1cnt,
+         *S1prevcnt,
+         *S2cnt,
+         *Rcnt,
+         *Dcnt,
+         *lastCol,           /* Scores in the last column               */
+         *lastRow,           /* Scores in the last row                  */
+         *lastColCnt,        /* and their counts                        */
+         *lastRowCnt;
+   UBYTE *dirs;              /* Traceback choices for every cell - only
+                                allocated when a traceback is needed    */
+   short *batch;             /* Column arrays for the batch engine      */
+}  ALIGNWORK;
+
+/* A template waiting to be packed into a batch                         */
+typedef struct
+{
+   TEMPLATE *template;
+   int      candidate;       /* Position in the candidate list          */
+}  BATCHENTRY;
+
+/* A scan of the candidate templates shared between threads            */
+typedef struct
+{
+   ALIGNQUERY  *query;
+   TEMPLATELIB *templates;
+   int         *candidates,
+               nCandidates,
+               nextCandidate,   /* First candidate not yet handed out    */
+               chunkSize,       /* Candidates handed out at a time       */
+               nActive;         /* Worker threads still on this scan     */
+   REAL        *scores;
+   BOOL        failed;
+}  SCANJOB;
+
+typedef struct
+{
+   pthread_t       *threads;
+   int             nThreads;    /* Worker threads (not counting main)    */
+   pthread_mutex_t lock;
+   pthread_cond_t  workReady,
+                   workDone;
+   SCANJOB         *job;        /* The current scan                      */
+   ULONG           jobNumber;   /* Incremented for each scan             */
+   BOOL            shutdown;
+}  THREADPOOL;
+
+/* Binary template index file - a header, an array of entries and then
+   the character, code, integer and score matrix pools. Pool offsets in
+   the header are in bytes from the start of the file; offsets in the
+   entries are in elements from the start of the relevant pool.
+*/
+typedef struct
+{
+   char  magic[8];
+   int   version,
+         headerSize,
+         entrySize,
+         nTemplates,
+         nChars,
+         nInts,
+         nAACodes;
+   ULONG faaSize,
+         faaMtime,
+         faaChecksum,
+         mdmSize,            /* The mutation matrix the score matrix   */
+         mdmChecksum,        /* was built from                         */
+         entryOffset,
+         charOffset,
+         codeOffset,
+         intOffset,
+         matrixOffset,
+         fileSize;
+}  INDEXHEADER;
+
+typedef struct
+{
+   int  headerOffset,
+        seqOffset,
+        seqLen,
+        IFOffset,
+        nIFRes,
+        CDROffset,
+        nCDRRes;
+   char chainType;
+}  INDEXENTRY;
+
 /************************************************************************/
 /* Globals
 */
 BOOL gVerbose   = FALSE;
 BOOL gQuiet     = FALSE;
 BOOL gNoAntigen = FALSE;
+BOOL gBuildIndex = FALSE;
+char *gEngineTestFile = NULL;
+int  gShortlist  = DEFSHORTLIST;
+int  gAlignEngine = ALIGN_AUTO;
+int  gNThreads    = 1;
+THREADPOOL *gThreadPool = NULL;
+char *gCacheFile  = NULL;
+ALIGNCACHE *gAlignCache = NULL;
+char    *gArchiveFile = NULL;
+ARCHIVE *gArchive     = NULL;
+ULONG gPairsTested = 0;      /* Atom pairs compared for contacts        */
+ULONG gPairsCulled = 0;      /* Atom pairs skipped by bounding spheres  */
+int   gContactEngine = CONTACT_SCALAR;
 
 
 /************************************************************************/
@@ -146,54 +693,207 @@ BOOL gNoAntigen = FALSE;
 */
 BOOL ParseCmdLine(int argc, char **argv, char *infile);
 void UsageDie(void);
-BOOL ProcessFile(WHOLEPDB *wpdb, char *infile, FILE *dataFp);
-DOMAIN *FindVHVLDomains(WHOLEPDB *wpdb, PDBCHAIN *chain, FILE *dataFp,
-                        DOMAIN *domains);
-void GetSequenceForChain(WHOLEPDB *wpdb, PDBCHAIN *chain, char *sequence);
+BOOL AlignSequenceFile(char *templateFile, char *seqFile);
+BOOL ProcessFile(WHOLEPDB *wpdb, char *infile, TEMPLATELIB *templates);
+DOMAIN *FindVHVLDomains(WHOLEPDB *wpdb, PDBCHAIN *chain,
+                        TEMPLATELIB *templates, DOMAIN *domains,
+                        CHAINHIT **pChainCache, ARENA *arena);
+ULONG HashSequence(char *seq);
+ULONG HashBytes(ULONG hash, char *data, int nBytes);
+ULONG TemplateLibraryVersion(TEMPLATELIB *templates);
+ALIGNCACHE *OpenAlignCache(char *cacheFile, TEMPLATELIB *templates);
+CACHERECORD *GetCacheRecord(ALIGNCACHE *cache, CACHESLOT *slot,
+                            TEMPLATELIB *templates);
+void CloseAlignCache(ALIGNCACHE *cache);
+ARCHIVE *OpenArchive(char *archiveFile);
+BOOL LockArchive(ARCHIVE *archive, int lockType);
+void CloseArchive(ARCHIVE *archive);
+BOOL LockAlignCache(ALIGNCACHE *cache, int lockType);
+BOOL LookupAlignCache(ALIGNCACHE *cache, char *chainSeq, int nFound,
+                      TEMPLATELIB *templates, TEMPLATE **pBestMatch,
+                      REAL *pScore, char *alignSeqres, char *alignRef);
+void StoreAlignCache(ALIGNCACHE *cache, char *chainSeq, int nFound,
+                     TEMPLATELIB *templates, TEMPLATE *bestMatch,
+                     REAL score, char *alignSeqres, char *alignRef);
+void PurgeAlignCache(ALIGNCACHE *cache);
+CHAINHIT *FindChainHit(CHAINHIT *chainCache, char *seq, ULONG hash);
+CHAINHIT *AddChainHit(CHAINHIT **pChainCache, char *seq, ULONG hash,
+                      PDBCHAIN *chain);
+void RecordDomainHit(CHAINHIT *chainHit, DOMAIN *domain,
+                     TEMPLATE *template, REAL score,
+                     char *alignSeqres, char *alignRef);
+void ReuseChainHit(CHAINHIT *chainHit, PDBCHAIN *chain,
+                   DOMAIN **pDomains, ARENA *arena);
+void FreeChainCache(CHAINHIT *chainCache);
+DOMAIN *NewDomain(PDBCHAIN *chain, DOMAIN **pDomains, ARENA *arena);
+ARENA *CreateArena(size_t blockSize);
+void *ArenaAlloc(ARENA *arena, size_t size);
+void FreeArena(ARENA *arena);
+void AddAntigenChain(DOMAIN *domain, PDBCHAIN *chain);
+void AddHetAntigen(DOMAIN *domain, PDBRESIDUE *res);
+void GetSequenceForChain(PDBCHAIN *chain, char *sequence);
 void ExePathName(char *str, BOOL pathonly);
-BOOL CheckAndMask(char *sequence, FILE *dataFp, PDBCHAIN *chain,
-                  DOMAIN **pDomains);
+BOOL CheckAndMask(char *sequence, char *chainSeq, int nFound,
+                  TEMPLATELIB *templates, PDBCHAIN *chain,
+                  DOMAIN **pDomains, CHAINHIT *chainHit, ARENA *arena);
+REAL AlignBestTemplate(char *seqresSeq, char *chainSeq,
+                       TEMPLATELIB *templates, TEMPLATE **pBestMatch,
+                       char *alignSeqres, char *alignRef);
+REAL FindBestTemplate(ALIGNQUERY *query, ALIGNWORK *work, 
+                      int *candidates, int *ranking, 
+                      TEMPLATELIB *templates, TEMPLATE **pBestMatch);
+int NextResidualSegment(char *seq, char *chainSeq, int pos, int *segLen);
 FILE *OpenSequenceDataFile(void);
-REAL CompareSeqs(char *theSeq, char *seq, char *align1, char *align2);
-void MaskAndAssignDomain(char *seq, PDBCHAIN *chain, char *bestMatch,
-                         char *aln1, char *aln2, DOMAIN **pDomains);
-void SetChainAsLightOrHeavy(DOMAIN *domain, char *header);
-void SetIFResidues(DOMAIN *domain, char *header, char *seqAln, char *refAln);
-void SetCDRResidues(DOMAIN *domain, char *header, char *seqAln, char *refAln);
+void DataFilePathName(char *pathname, char *datafile);
+TEMPLATELIB *LoadTemplateLibrary(void);
+TEMPLATELIB *MapTemplateIndex(char *idxFile, char *faaFile);
+BOOL WriteTemplateIndex(TEMPLATELIB *templates, char *idxFile,
+                        char *faaFile);
+BOOL BuildTemplateIndex(void);
+ULONG ChecksumStream(FILE *fp, ULONG *pSize);
+BOOL GetMDMChecksum(ULONG *pSize, ULONG *pChecksum);
+BOOL CheckTemplateIndex(INDEXHEADER *header, size_t mapSize);
+BOOL GetFileChecksum(char *filename, ULONG *pSize, ULONG *pMtime,
+                     ULONG *pChecksum, BOOL doChecksum);
+int ResidueCode(char res);
+void SetScoreMatrix(int *scoreMatrix);
+TEMPLATELIB *ReadTemplateLibrary(FILE *fp);
+void FreeTemplateLibrary(TEMPLATELIB *templates);
+int ParseTemplatePositions(char *list, int *positions);
+BOOL BuildKmerIndex(TEMPLATELIB *templates);
+BOOL BuildKeyBitsets(TEMPLATELIB *templates);
+int KmerCode(UBYTE *codes);
+void RankTemplates(char *seq, TEMPLATELIB *templates, int *counts,
+                   int *ranking);
+int ShortlistTemplates(int *ranking, TEMPLATELIB *templates,
+                       int maxCandidates, int *candidates);
+REAL ScanTemplates(ALIGNQUERY *query, ALIGNWORK *work,
+                   TEMPLATELIB *templates, int *candidates,
+                   int nCandidates, TEMPLATE **pBestMatch);
+REAL CompareSeqs(ALIGNQUERY *query, TEMPLATE *template, ALIGNWORK *work,
+                 char *align1, char *align2);
+ALIGNQUERY *PrepareAlignQuery(char *seq, int *scoreMatrix, int engine);
+void ReloadAlignQuery(ALIGNQUERY *query, char *seq);
+void FreeAlignQuery(ALIGNQUERY *query);
+ALIGNWORK *AllocAlignWork(ALIGNQUERY *query, int maxTemplateLen);
+ALIGNWORK *GrowAlignWork(ALIGNWORK *work, ALIGNQUERY *query, 
+                         int maxTemplateLen);
+void FreeAlignWork(ALIGNWORK *work);
+void FillAlignScalar(ALIGNQUERY *query, TEMPLATE *template,
+                     ALIGNWORK *work, BOOL storeDirs);
+REAL ScoreAlignment(ALIGNQUERY *query, TEMPLATE *template, 
+                    ALIGNWORK *work);
+int NativeAffineAlign(ALIGNQUERY *query, TEMPLATE *template,
+                      ALIGNWORK *work, char *align1, char *align2,
+                      int *alignLen);
+int TraceBackAlignment(ALIGNQUERY *query, TEMPLATE *template,
+                       ALIGNWORK *work, char *align1, char *align2,
+                       int *alignLen);
+int SelectAlignEngine(int engine);
+void ScoreTemplatesBatched(ALIGNQUERY *query, ALIGNWORK *work,
+                           TEMPLATELIB *templates, int *candidates,
+                           int nCandidates, REAL *scores);
+void ScoreTemplates(ALIGNQUERY *query, ALIGNWORK *work,
+                    TEMPLATELIB *templates, int *candidates,
+                    int nCandidates, REAL *scores);
+THREADPOOL *CreateThreadPool(int nThreads);
+void FreeThreadPool(THREADPOOL *pool);
+BOOL ScoreTemplatesThreaded(THREADPOOL *pool, ALIGNQUERY *query,
+                            ALIGNWORK *work, TEMPLATELIB *templates,
+                            int *candidates, int nCandidates, 
+                            REAL *scores);
+static void LayoutAlignWork(ALIGNWORK *work, ALIGNQUERY *query);
+static void *ScanWorker(void *arg);
+DOMAIN *MaskAndAssignDomain(char *seq, PDBCHAIN *chain,
+                            TEMPLATE *bestMatch, char *aln1, char *aln2,
+                            DOMAIN **pDomains, ARENA *arena);
+void SetChainAsLightOrHeavy(DOMAIN *domain, TEMPLATE *template);
+void SetIFResidues(DOMAIN *domain, TEMPLATE *template, ALIGNMAP *map);
+void SetCDRResidues(DOMAIN *domain, TEMPLATE *template, ALIGNMAP *map);
+ALIGNMAP *BuildAlignMap(char *seqAln, char *refAln);
+void FreeAlignMap(ALIGNMAP *map);
+int SetKeyResidues(ALIGNMAP *map, UBYTE *refKeyBits, int nRefKeyBits,
+                   int startSeqRes, int *keys);
+void SetDomainKeyBits(DOMAIN *domain);
 void PrintDomains(DOMAIN *domains);
 void SetDomainBoundaries(DOMAIN *domain);
+RESINDEX *BuildResidueIndex(PDBCHAIN *chain, ARENA *arena);
 void PairDomains(DOMAIN *domains);
-void WriteDomains(WHOLEPDB *wpdb, DOMAIN *domains, char *filestem);
-BOOL FlagProteinAntigens(DOMAIN *domains, PDBSTRUCT *pdbs);
-BOOL IsNonPeptideHet(WHOLEPDB *wpdb, PDBRESIDUE *res);
-BOOL CheckAntigenContacts(DOMAIN *domain, PDBSTRUCT *pdbs);
+void WriteDomains(HEADERINDEX *headers, DOMAIN *domains, char *filestem);
+BOOL FlagProteinAntigens(DOMAIN *domains, PDBSTRUCT *pdbs,
+                         CONTACTMAP *map);
+BOOL IsNonPeptideHet(HETTABLE *hets, PDBRESIDUE *res);
+HETTABLE *BuildHetTable(WHOLEPDB *wpdb);
+void FreeHetTable(HETTABLE *hets);
+HETENTRY *FindHetEntry(HETTABLE *hets, char *resnam, BOOL create);
+int HetClass(HETTABLE *hets, char *resnam);
+BOOL CheckAntigenContacts(DOMAIN *domain, PDBSTRUCT *pdbs,
+                          CONTACTMAP *map, SEQCHECKS *checks);
+BOOL IsCrystalPacking(DOMAIN *domain, PDBCHAIN *chain, int chainNum,
+                      SEQCHECKS *checks);
+void CountMappedContacts(CONTACTMAP *map, DOMAIN *domain, int chainNum,
+                         int *nCDRContacts, int *nFWContacts);
+CONTACTMAP *BuildContactMap(DOMAIN *domains, PDBSTRUCT *pdbs,
+                            BOUNDS *chainBounds, ARENA *arena);
+BOOL HasCDRContact(CONTACTMAP *map, int resNum, DOMAIN *domain);
+KDTREE *BuildCDRTree(DOMAIN *domains, ARENA *arena);
+void BuildKDNode(KDTREE *tree, int lo, int hi);
+REAL AtomCoord(PDB *p, int axis);
+int FindCDRContacts(KDTREE *tree, PDBRESIDUE *res, CONTACT *hits);
+void SearchKDNode(KDTREE *tree, int lo, int hi, PDB *p, CONTACT *hits,
+                  int *nHits);
+void GrowContacts(CONTACT **found, int **foundRes, int *maxFound,
+                  int needed);
+void PrintContactMap(FILE *fp, CONTACTMAP *map);
+void SetBounds(PDB *start, PDB *stop, BOUNDS *bounds);
+BOUNDS *BuildChainBounds(PDBSTRUCT *pdbs, ARENA *arena);
+BOOL BoundsApart(BOUNDS *bounds1, BOUNDS *bounds2);
+BOOL CullBounds(BOUNDS *bounds1, BOUNDS *bounds2);
 void SetChainAsAtomOrHetatm(PDBCHAIN *chains);
 BOOL inIntArray(int value, int *array, int arrayLen);
 void GetSequenceForChainSeqres(WHOLEPDB *wpdb, PDBCHAIN *chain,
                                char *sequence);
-BOOL RegionsMakeContact(PDB *start1, PDB *stop1, PDB *start2, PDB *stop2);
-void FlagHetAntigenChains(DOMAIN *domains, PDBSTRUCT *pdbs);
-void FlagHetAntigenResidues(WHOLEPDB *wpd, DOMAIN *domains,
-                            PDBSTRUCT *pdbs);
-PDB *RelabelAntibodyChain(DOMAIN *domain,
+ATOMGRID *BuildAtomGrid(PDBSTRUCT *pdbs, ARENA *arena);
+int GridCoord(REAL coord, REAL min, REAL cellSize, int nCells);
+int SelectContactEngine(void);
+int FindCloseAtoms(ATOMGRID *grid, float px, float py, float pz,
+                   int start, int stop);
+int FindResidueContacts(ATOMGRID *grid, PDBRESIDUE *res, 
+                        PDBCHAIN *chain, BOOL nonStandardOnly,
+                        int *partners);
+void FlagHetAntigenChains(DOMAIN *domains, PDBSTRUCT *pdbs,
+                          CONTACTMAP *map);
+void FlagHetAntigenResidues(HETTABLE *hets, DOMAIN *domains,
+                            PDBSTRUCT *pdbs, CONTACTMAP *map);
+void RelabelAntibodyChain(DOMAIN *domain,
                           BOOL *lowerCaseLight, BOOL *lowerCaseHeavy,
                           char *remark950);
-PDB *RelabelAntigenChains(DOMAIN *domain, char *remark950);
-void WriteSeqres(FILE *fp, WHOLEPDB *wpdb, DOMAIN *d);
+void RelabelAntigenChains(DOMAIN *domain, char *remark950);
+void WriteRelabelledAtoms(FILE *fp, PDB *start, PDB *stop, char *label);
+void WriteSeqres(FILE *fp, HEADERINDEX *headers, DOMAIN *d);
+HEADERINDEX *BuildHeaderIndex(WHOLEPDB *wpdb, ARENA *arena);
+void WriteChainHeaders(FILE *fp, HEADERINDEX *headers, char chain,
+                       char label, BOOL modres);
+void WriteRelabelledLines(FILE *fp, STRINGLIST **lines, int nLines,
+                          int column, char label);
 int CountResidueAtoms(PDBRESIDUE *res);
-char *blFixSequenceWholePDB(WHOLEPDB *wpdb, char **outChains,
+char *blFixSequenceWholePDB(WHOLEPDB *wpdb, MODRES *modres,
+                            char **outChains,
                             BOOL ignoreSeqresForMissingChains,
                             BOOL upper, BOOL quiet, char *label);
-int TransferResnum(int refResnum, char *seqAln, char *refAln);
+int TransferResnum(ALIGNMAP *map, int refResnum);
 int RealSeqLen(char *seq);
 BOOL IsStandardResidue(PDBRESIDUE *res);
+void ClassifyResidues(PDBSTRUCT *pdbs, ARENA *arena);
 int FindLastAlignmentPosition(char *refAln);
-int IsKeyResidue(int seqPos, int *refKeys,
-                 char *seqAln, char *refAln);
 
-BOOL DomainSequenceMatchesChainSequence(DOMAIN *domain, PDBCHAIN *chain);
+BOOL DomainSequenceMatchesChainSequence(DOMAIN *domain, PDBCHAIN *chain,
+                                        int chainNum, SEQCHECKS *checks);
+SEQCHECKS *CreateSeqChecks(PDBSTRUCT *pdbs, ARENA *arena);
+char *GetCheckChainSeq(SEQCHECKS *checks, PDBCHAIN *chain, int chainNum);
+BOOL PrefilterSeqMatch(char *seq1, char *seq2, BOOL *match);
 REAL ScoreAlignedResidues(char *aln1, char *aln2, int alignLen, int minLen);
-BOOL inAntigenArray(char antigenChains[MAXANTIGEN][MAXCHAINLABEL],
+BOOL inAntigenArray(char (*antigenChains)[MAXCHAINLABEL],
                     int numAntigenChains, char *chainLabel);
 
 
@@ -210,31 +910,99 @@ int main(int argc, char **argv)
    if(ParseCmdLine(argc, argv, infile))
    {
       FILE *fp = NULL;
+
+      /* Just build the binary template index                           */
+      if(gBuildIndex)
+      {
+         if(!BuildTemplateIndex())
+         {
+            fprintf(stderr,"Error (%s): Unable to build the template \
+index\n", PROGNAME);
+            exit(1);
+         }
+         return(0);
+      }
+
+      /* Just align a FASTA file against a template FASTA file        */
+      if(gEngineTestFile != NULL)
+      {
+         gAlignEngine = SelectAlignEngine(gAlignEngine);
+         if(!AlignSequenceFile(gEngineTestFile, infile))
+         {
+            fprintf(stderr,"Error (%s): Unable to align sequence file \
+(%s)\n", PROGNAME, infile);
+            exit(1);
+         }
+         return(0);
+      }
       
       if((fp = fopen(infile, "r"))!=NULL)
       {
          WHOLEPDB *wpdb = NULL;
          if((wpdb = blReadWholePDB(fp))!=NULL)
          {
-            FILE *dataFp;
-            if((dataFp=OpenSequenceDataFile())==NULL)
+            TEMPLATELIB *templates;
+            
+            /* Choose the alignment engine. The mutation matrix is only
+               needed here for blAffinealign() - the native aligner uses
+               the score matrix from the template library
+            */
+            gAlignEngine   = SelectAlignEngine(gAlignEngine);
+            gContactEngine = SelectContactEngine();
+            if(gAlignEngine == ALIGN_BIOPLIB)
+               blReadMDM(SCOREMATRIX);
+
+            /* Start the threads for the template scans                 */
+            if((gNThreads > 1) &&
+               ((gThreadPool = CreateThreadPool(gNThreads))==NULL))
+            {
+               fprintf(stderr,"Error (%s): Unable to start %d \
+threads\n", PROGNAME, gNThreads);
+               exit(1);
+            }
+
+            /* Load the template library once - from the binary index
+               if it is up to date, otherwise from the FASTA file
+            */
+            if((templates=LoadTemplateLibrary())==NULL)
             {
                fprintf(stderr,"Error (%s): The antibody sequence \
 datafile was not installed\n", PROGNAME);
                exit(1);
             }
-            
-            /* Read the mutation matrix                                 */
-            blReadMDM(SCOREMATRIX);
+
+            /* Open the persistent alignment cache if requested. We just
+               carry on without it if it can't be used
+            */
+            if((gCacheFile != NULL) &&
+               ((gAlignCache = OpenAlignCache(gCacheFile, 
+                                              templates))==NULL))
+            {
+               fprintf(stderr,"Warning (%s): Unable to use alignment \
+cache (%s)\n", PROGNAME, gCacheFile);
+            }
+
+            /* Open the output archive if requested                     */
+            if((gArchiveFile != NULL) &&
+               ((gArchive = OpenArchive(gArchiveFile))==NULL))
+            {
+               fprintf(stderr,"Error (%s): Unable to open output \
+archive (%s)\n", PROGNAME, gArchiveFile);
+               exit(1);
+            }
             
             /* Do the real work of processing this file                 */
-            if(!ProcessFile(wpdb, infile, dataFp))
+            if(!ProcessFile(wpdb, infile, templates))
             {
                fprintf(stderr,"Error (%s): Unable to split PDB into \
 chains\n", PROGNAME);
                exit(1);
             }
             
+            CloseAlignCache(gAlignCache);
+            CloseArchive(gArchive);
+            FreeThreadPool(gThreadPool);
+            FreeTemplateLibrary(templates);
             blFreeWholePDB(wpdb);
          }
          else
@@ -299,6 +1067,67 @@ BOOL ParseCmdLine(int argc, char **argv, char *infile)
          case 'n':
             gNoAntigen = TRUE;
             break;
+         case 'b':
+            gBuildIndex = TRUE;
+            return(TRUE);
+            break;
+         case 'k':
+            argc--;
+            argv++;
+            if(!argc || !sscanf(argv[0], "%d", &gShortlist))
+               return(FALSE);
+            break;
+         case 'j':
+            argc--;
+            argv++;
+            if(!argc || !sscanf(argv[0], "%d", &gNThreads))
+               return(FALSE);
+            if(gNThreads < 1)
+               gNThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if(gNThreads < 1)
+               gNThreads = 1;
+            break;
+         case 'c':
+            argc--;
+            argv++;
+            if(!argc)
+               return(FALSE);
+            gCacheFile = argv[0];
+            break;
+         case 'a':
+            argc--;
+            argv++;
+            if(!argc)
+               return(FALSE);
+            gArchiveFile = argv[0];
+            break;
+         case 'e':
+            argc--;
+            argv++;
+            if(!argc)
+               return(FALSE);
+            if(!strcmp(argv[0], "auto"))
+               gAlignEngine = ALIGN_AUTO;
+            else if(!strcmp(argv[0], "bioplib"))
+               gAlignEngine = ALIGN_BIOPLIB;
+            else if(!strcmp(argv[0], "scalar"))
+               gAlignEngine = ALIGN_SCALAR;
+            else if(!strcmp(argv[0], "sse4"))
+               gAlignEngine = ALIGN_SSE4;
+            else if(!strcmp(argv[0], "avx2"))
+               gAlignEngine = ALIGN_AVX2;
+            else if(!strcmp(argv[0], "batch"))
+               gAlignEngine = ALIGN_BATCH;
+            else
+               return(FALSE);
+            break;
+         case 'x':
+            argc--;
+            argv++;
+            if(!argc)
+               return(FALSE);
+            gEngineTestFile = argv[0];
+            break;
          case 'h':
             return(FALSE);
             break;
@@ -330,10 +1159,48 @@ void UsageDie(void)
 {
    printf("%s %s (c) UCL, Prof. Andrew C.R. Martin\n", PROGNAME, VERSION);
 
-   printf("\nUsage: abysplit [-v][-q][-n] file.pdb       \n");
+   printf("\nUsage: abysplit [-v][-q][-n][-k n][-e engine][-j n]\
+[-c cache]\n");
+   printf("                [-a archive]\n");
+   printf("                file.pdb\n");
+   printf("       abysplit -b\n");
+   printf("       abysplit [-e engine] -x templates.faa file.faa\n");
    printf("           -v Verbose\n");
    printf("           -q Quiet\n");
    printf("           -n Do not include the antigen in the output\n");
+   printf("           -k Align against only the n templates sharing \
+most k-mers\n");
+   printf("              with the chain [Default: %d]. 0 aligns \
+against all\n", DEFSHORTLIST);
+   printf("           -e Alignment engine: auto, batch, avx2, sse4, \
+scalar or bioplib\n");
+   printf("              [Default: auto - the fastest that the CPU \
+supports]\n");
+   printf("           -j Use n threads for the template alignments \
+[Default: 1]\n");
+   printf("              0 uses all the available processors\n");
+   printf("           -c Keep the template hits for each chain sequence \
+in this\n");
+   printf("              cache file and reuse them in later runs. The \
+file may be\n");
+   printf("              shared by several absplit processes at once\n");
+   printf("           -a Append the output files to this archive instead \
+of writing\n");
+   printf("              separate files. archive.idx lists the name, \
+offset and\n");
+   printf("              length of each. Several absplit processes may \
+append to\n");
+   printf("              the same archive\n");
+   printf("           -b Build the binary template index from the \
+installed\n");
+   printf("              template FASTA file and exit\n");
+   printf("           -x Align each sequence in file.faa against each \
+template in\n");
+   printf("              templates.faa with the chosen engine, print \
+the scores and\n");
+   printf("              alignments and exit. Used to check the engines \
+against\n");
+   printf("              each other (see t/checkengines.sh)\n");
    printf("\nTakes a PDB file containing one or more antibodies and \
 splits it into\n");
    printf("separate antibody files, retaining the antigen in each. \
@@ -368,12 +1235,13 @@ void GetFilestem(char *infile, char *filestem)
 
 
 /************************************************************************/
-BOOL ProcessFile(WHOLEPDB *wpdb, char *infile, FILE *dataFp)
+BOOL ProcessFile(WHOLEPDB *wpdb, char *infile, TEMPLATELIB *templates)
 {
    char      filestem[MAXBUFF],
              *sequence;
    PDBSTRUCT *pdbs;
    PDB       *pdb;
+   HETTABLE  *hets;
    int       nAtoms;
 
    GetFilestem(infile, filestem);
@@ -398,19 +1266,34 @@ BOOL ProcessFile(WHOLEPDB *wpdb, char *infile, FILE *dataFp)
          return(FALSE);
       }
       
-      if((sequence = blFixSequenceWholePDB(wpdb, outChains,
+      /* Classify the HET groups and read the MODRES records once       */
+      hets = BuildHetTable(wpdb);
+      
+      if((sequence = blFixSequenceWholePDB(wpdb, hets->modres, outChains,
                                            TRUE, FALSE,
                                            TRUE, NULL))!=NULL)
       {
          /* NOTE! The output of blFixSequenceWholePDB isn't used        */
          PDBCHAIN *chain;
-         DOMAIN   *domains = NULL;
+         DOMAIN   *domains    = NULL;
+         CHAINHIT *chainCache = NULL;
+         BOUNDS   *chainBounds;
+         ARENA    *arena;
+
+         if((arena = CreateArena(ARENABLOCKSIZE))==NULL)
+         {
+            fprintf(stderr,"Error (%s): No memory for domains\n",
+                    PROGNAME);
+            return(FALSE);
+         }
 
 #ifdef DEBUG
          fprintf(stderr, "Sequence:\n%s\n", sequence);
 #endif
          
+         ClassifyResidues(pdbs, arena);
          SetChainAsAtomOrHetatm(pdbs->chains);
+         chainBounds = BuildChainBounds(pdbs, arena);
          
          for(chain=pdbs->chains; chain!=NULL; NEXT(chain))
          {
@@ -421,26 +1304,46 @@ BOOL ProcessFile(WHOLEPDB *wpdb, char *infile, FILE *dataFp)
             if(chain->extras == CHAINTYPE_PROT)
             {
                printf("***Handling chain: %s\n", chain->chain);
-               domains = FindVHVLDomains(wpdb, chain, dataFp, domains);
+               domains = FindVHVLDomains(wpdb, chain, templates, domains,
+                                         &chainCache, arena);
             }
          }
+         FreeChainCache(chainCache);
          
          if(domains != NULL)
          {
+            CONTACTMAP *contacts;
+            
             PairDomains(domains);
             
-            FlagProteinAntigens(domains, pdbs);
-            FlagHetAntigenChains(domains, pdbs);
-            FlagHetAntigenResidues(wpdb, domains, pdbs);
+            /* Find all the contacts made by the domains in one pass
+               and use them to flag the antigens
+            */
+            contacts = BuildContactMap(domains, pdbs, chainBounds, arena);
+#ifdef DEBUG_CONTACT_MAP
+            PrintContactMap(stderr, contacts);
+#endif
+            FlagProteinAntigens(domains, pdbs, contacts);
+            FlagHetAntigenChains(domains, pdbs, contacts);
+            FlagHetAntigenResidues(hets, domains, pdbs, contacts);
+            if(gVerbose)
+            {
+               fprintf(stderr, "Contacts: %lu atom pairs compared, %lu \
+skipped by bounding spheres\n", gPairsTested, gPairsCulled);
+            }
             
             PrintDomains(domains);
-            WriteDomains(wpdb, domains, filestem);
+            WriteDomains(BuildHeaderIndex(wpdb, arena), domains, 
+                         filestem);
             
-            FREELIST(domains, DOMAIN);
+            FreeArena(arena);
+            FreeHetTable(hets);
             blFreePDBStructure(pdbs);
          }
          else
          {
+            FreeArena(arena);
+            FreeHetTable(hets);
             fprintf(stderr,"Error (abYsplit): no antibody domains \
 found\n");
             return(FALSE);
@@ -448,6 +1351,7 @@ found\n");
       }
       else
       {
+         FreeHetTable(hets);
          return(FALSE);
       }
    }
@@ -461,7 +1365,7 @@ found\n");
 
 
 /************************************************************************/
-void GetSequenceForChain(WHOLEPDB *wpdb, PDBCHAIN *chain, char *sequence)
+void GetSequenceForChain(PDBCHAIN *chain, char *sequence)
 {
    int        i=0;
    PDBRESIDUE *r;
@@ -476,7 +1380,7 @@ void GetSequenceForChain(WHOLEPDB *wpdb, PDBCHAIN *chain, char *sequence)
 #ifdef DEBUG
             fprintf(stderr, "%s\n", r->resnam);
 #endif
-            sequence[i++] = blThrone(r->resnam);
+            sequence[i++] = RESCLASS(r)->aa;
          }
       }
    }
@@ -494,8 +1398,23 @@ void ExePathName(char *str, BOOL pathonly)
   FILE *fp;
   char buf[PATH_MAX+100],
        *p;
+  int  len;
 
   *str    = '\0';
+
+  /* 17.10.26 Try the /proc/self/exe link first   By: agent             */
+  if((len = readlink("/proc/self/exe", str, PATH_MAX-1)) > 0)
+  {
+     str[len] = '\0';
+     if(pathonly)
+     {
+        p=strrchr(str, '/');
+        if(p!=NULL)
+           *p='\0';
+     }
+     return;
+  }
+
   if(!(fp = fopen("/proc/self/maps", "r")))
     return;
 
@@ -522,1082 +1441,6876 @@ FILE *OpenSequenceDataFile(void)
 {
    char pathname[PATH_MAX];
    
-   ExePathName(pathname, TRUE);
-   strcat(pathname,ABSEQFILE);
+   DataFilePathName(pathname, ABSEQFILE);
    
    return(fopen(pathname, "r"));
 }
 
 
 /************************************************************************/
-REAL ScoreAlignedResidues(char *aln1, char *aln2,
-                          int alignLen, int minLen)
-{
-      int nAligned = 0,
-          nMatched = 0,
-          i;
-
-      /* Score the matched residues                                     */
-      for(i=0; i<alignLen; i++)
-      {
-         if((aln1[i] != '-') &&
-            (aln2[i] != '-'))
-         {
-            nAligned++;
-            if(aln1[i] == aln2[i])
-            {
-               nMatched++;
-            }
-         }
-      }
+/*>void DataFilePathName(char *pathname, char *datafile)
+   -----------------------------------------------------
+*//**
+   \param[out]  pathname   Full path to the data file
+   \param[in]   datafile   Data file relative to the executable's
+                           directory
 
-#ifdef DEBUG
-      printf("SEQ1: %s\n", alignDomSeq);
-      printf("SEQ2: %s\n", alignChainSeq);
-      printf("MATCH: %d ALIGN: %d SCORE: %f\n\n",
-             nMatched, nAligned, ((REAL)nMatched/(REAL)nAligned));
-#endif
+   Builds the full path of an installed data file
 
-      if(nAligned < minLen)
-         return((REAL)0.0);
-      
-      return((REAL)nMatched/(REAL)nAligned);
+-  17.10.26 Original   By: agent
+*/
+void DataFilePathName(char *pathname, char *datafile)
+{
+   ExePathName(pathname, TRUE);
+   strncat(pathname, datafile, PATH_MAX-strlen(pathname)-1);
 }
 
 
 /************************************************************************/
-/*>REAL CompareSeqs(char *seqresSeq, char *refSeq, 
-                    char *alignSeqres, char *alignRef)
-   -----------------------------------------------
+/*>TEMPLATELIB *LoadTemplateLibrary(void)
+   --------------------------------------
 *//**
-   \param[in]   seqresSeq     the sequence of interest
-   \param[in]   refSeq        the database sequence
-   \param[out]  alignSeqres   Alignment of our sequence
-   \param[out]  alignRef      Alignment of database sequence
-   \return                    Score for alignment
+   \return     The template library (NULL on failure)
 
-   - 31.03.20 Original   By: ACRM
-   - 20.09.21 Modified to use affine alignment and mutation matrix
+   Loads the template library. The binary index is used if it is present
+   and up to date with respect to the FASTA file, otherwise the FASTA 
+   file is read (with the mutation matrix needed to build the score
+   matrix)
+
+-  17.10.26 Original   By: agent
 */
-REAL CompareSeqs(char *seqresSeq, char *refSeq,
-                 char *alignSeqres, char *alignRef)
+TEMPLATELIB *LoadTemplateLibrary(void)
 {
-   int  alignLen;
-   REAL percMatch;
+   char        faaFile[PATH_MAX],
+               idxFile[PATH_MAX];
+   FILE        *dataFp;
+   TEMPLATELIB *templates;
    
-   blAffinealign(seqresSeq, strlen(seqresSeq),
-                 refSeq, strlen(refSeq),
-                 FALSE,          /* verbose                     */
-                 FALSE,          /* identity                    */
-                 GAPOPENPENALTY, /* penalty                     */
-                 GAPEXTPENALTY,  /* extension                   */
-                 alignSeqres,
-                 alignRef,
-                 &alignLen);
+   DataFilePathName(faaFile, ABSEQFILE);
+   DataFilePathName(idxFile, ABIDXFILE);
+   
+   if((templates = MapTemplateIndex(idxFile, faaFile))==NULL)
+   {
+      if(gVerbose)
+         fprintf(stderr, "Template index missing, invalid or out of \
+date - reading %s\n", faaFile);
+      
+      if((dataFp=fopen(faaFile, "r"))==NULL)
+         return(NULL);
+      blReadMDM(SCOREMATRIX);
+      templates = ReadTemplateLibrary(dataFp);
+      fclose(dataFp);
+   }
 
-   alignSeqres[alignLen]  = alignRef[alignLen] = '\0';
+   if(templates != NULL)
+   {
+      int i;
 
-   percMatch = ScoreAlignedResidues(alignSeqres, alignRef, alignLen, MINSEQLEN);
+      templates->maxSeqLen = 0;
+      for(i=0; i<templates->nTemplates; i++)
+      {
+         if(templates->templates[i].seqLen > templates->maxSeqLen)
+            templates->maxSeqLen = templates->templates[i].seqLen;
+      }
+      
+      if(!BuildKmerIndex(templates) || !BuildKeyBitsets(templates))
+      {
+         FreeTemplateLibrary(templates);
+         templates = NULL;
+      }
+   }
    
-#ifdef DEBUG   
-   fprintf(stderr, "\n>>>%s\n", alignSeqres);
-   fprintf(stderr, ">>>%s\n",   alignRef);
-   fprintf(stderr, ">>>SCORE: %f\n",   percMatch);
-#endif
-
-   return(percMatch);
+   return(templates);
 }
 
 
 /************************************************************************/
-/*>REAL CompareSeqsOLD(char *seqresSeq, char *refSeq, 
-                    char *alignSeqres, char *alignRef)
-   -----------------------------------------------
+/*>BOOL GetFileChecksum(char *filename, ULONG *pSize, ULONG *pMtime,
+                        ULONG *pChecksum, BOOL doChecksum)
+   -----------------------------------------------------------------
 *//**
-   \param[in]   seqresSeq     the sequence of interest
-   \param[in]   refSeq        the database sequence
-   \param[out]  alignSeqres   Alignment of our sequence
-   \param[out]  alignRef      Alignment of database sequence
-   \return                    Score for alignment
+   \param[in]   filename    File of interest
+   \param[out]  pSize       File size
+   \param[out]  pMtime      File modification time
+   \param[out]  pChecksum   32-bit FNV-1a checksum of the file contents
+   \param[in]   doChecksum  Calculate the checksum (otherwise just stat)
+   \return                  Success
 
-   - 31.03.20 Original   By: ACRM
-   - 20.09.21 Modified to use affine alignment and mutation matrix
+   Gets the size and modification time of a file and optionally a 
+   checksum of its contents
+
+-  17.10.26 Original   By: agent
 */
-REAL CompareSeqsOLD(char *seqresSeq, char *refSeq,
-                 char *alignSeqres, char *alignRef)
+BOOL GetFileChecksum(char *filename, ULONG *pSize, ULONG *pMtime,
+                     ULONG *pChecksum, BOOL doChecksum)
 {
-   int  score;
-   int  alignLen;
-   int  bestPossibleScore,
-        bestPossibleScore1 = 100000,
-        bestPossibleScore2 = 100000;
-
-   bestPossibleScore1 = blAffinealign(refSeq, strlen(refSeq),
-                                      refSeq, strlen(refSeq),
-                                      FALSE,          /* verbose        */
-                                      FALSE,          /* identity       */
-                                      GAPOPENPENALTY, /* penalty        */
-                                      GAPEXTPENALTY,  /* extension      */
-                                      alignSeqres,
-                                      alignRef,
-                                      &alignLen);
+   struct stat statBuf;
+   
+   if(stat(filename, &statBuf))
+      return(FALSE);
 
-   if(strlen(seqresSeq) >= MINSEQLEN)
+   *pSize     = (ULONG)statBuf.st_size;
+   *pMtime    = (ULONG)statBuf.st_mtime;
+   *pChecksum = 0;
+   
+   if(doChecksum)
    {
-      bestPossibleScore2 = blAffinealign(seqresSeq, strlen(seqresSeq),
-                                         seqresSeq, strlen(seqresSeq),
-                                         FALSE,          /* verbose     */
-                                         FALSE,          /* identity    */
-                                         GAPOPENPENALTY, /* penalty     */
-                                         GAPEXTPENALTY,  /* extension   */
-                                         alignSeqres,
-                                         alignRef,
-                                         &alignLen);
+      FILE  *fp;
+      ULONG size;
+      
+      if((fp=fopen(filename, "r"))==NULL)
+         return(FALSE);
+      *pChecksum = ChecksumStream(fp, &size);
+      fclose(fp);
    }
    
-   bestPossibleScore = MIN(bestPossibleScore1, bestPossibleScore2);
+   return(TRUE);
+}
 
-   if(bestPossibleScore <= 0)
-      return(0);
-   
-   score = blAffinealign(seqresSeq, strlen(seqresSeq),
-                         refSeq, strlen(refSeq),
-                         FALSE,          /* verbose                     */
-                         FALSE,          /* identity                    */
-                         GAPOPENPENALTY, /* penalty                     */
-                         GAPEXTPENALTY,  /* extension                   */
-                         alignSeqres,
-                         alignRef,
-                         &alignLen);
 
-   alignSeqres[alignLen]  = alignRef[alignLen] = '\0';
+/************************************************************************/
+/*>ULONG ChecksumStream(FILE *fp, ULONG *pSize)
+   --------------------------------------------
+*//**
+   \param[in]   fp      Open file
+   \param[out]  pSize   Bytes read
+   \return              32-bit FNV-1a checksum of the rest of the file
 
-#ifdef DEBUG   
-   fprintf(stderr, "\n>>>%s\n", alignSeqres);
-   fprintf(stderr, ">>>%s\n",   alignRef);
-#endif
+-  17.10.26 Original (split from GetFileChecksum())   By: agent
+*/
+ULONG ChecksumStream(FILE *fp, ULONG *pSize)
+{
+   ULONG checksum = 2166136261UL;
+   int   ch;
 
-   return((REAL)score / (REAL)bestPossibleScore);
+   *pSize = 0;
+   while((ch=getc(fp))!=EOF)
+   {
+      checksum ^= (ULONG)ch;
+      checksum  = (checksum * 16777619UL) & 0xFFFFFFFFUL;
+      (*pSize)++;
+   }
+   return(checksum);
 }
 
 
 /************************************************************************/
-DOMAIN *FindVHVLDomains(WHOLEPDB *wpdb, PDBCHAIN *chain, FILE *dataFp,
-                        DOMAIN *domains)
+/*>BOOL GetMDMChecksum(ULONG *pSize, ULONG *pChecksum)
+   ---------------------------------------------------
+*//**
+   \param[out]  pSize       Size of the mutation matrix file
+   \param[out]  pChecksum   Checksum of its contents
+   \return                  Success
+
+   Checksums the SCOREMATRIX mutation matrix file, found in the same 
+   way as blReadMDM() finds it, so that a binary template index can be
+   rejected when its score matrix is out of date
+
+-  17.10.26 Original   By: agent
+*/
+BOOL GetMDMChecksum(ULONG *pSize, ULONG *pChecksum)
 {
-   char sequence[MAXSEQ];
-   
-/*   GetSequenceForChainSeqres(wpdb, chain, sequence); */
-   
-   GetSequenceForChain(wpdb, chain, sequence);
-#ifdef DEBUG
-   printf("Chain: %s Sequence: %s\n", chain->chain, sequence);
-#endif
-   while(TRUE)
-   {
-      if(!CheckAndMask(sequence, dataFp, chain, &domains)) break;
-   }
+   FILE *fp;
+   BOOL noEnv;
 
-   return(domains);
+   if((fp=blOpenFile(SCOREMATRIX, DATAENV, "r", &noEnv))==NULL)
+      return(FALSE);
+   *pChecksum = ChecksumStream(fp, pSize);
+   fclose(fp);
+   return(TRUE);
 }
 
+
 /************************************************************************/
-int RealSeqLen(char *seq)
+/*>BOOL CheckTemplateIndex(INDEXHEADER *header, size_t mapSize)
+   ------------------------------------------------------------
+*//**
+   \param[in]   header    The mapped index
+   \param[in]   mapSize   Size of the mapping
+   \return               Do all the sections and entries lie within the
+                         mapping?
+
+   Bounds-checks a mapped template index so that a damaged file is 
+   rejected (and the FASTA file read) rather than giving pointers 
+   outside the mapping. Every entry's header and sequence must lie in 
+   the character pool and be '\0' terminated there, and its interface
+   and CDR lists must lie in the integer pool.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL CheckTemplateIndex(INDEXHEADER *header, size_t mapSize)
 {
-   char *chp;
-   int seqlen = 0;
+   char       *base = (char *)header,
+              *charPool;
+   INDEXENTRY *entries;
+   ULONG      size  = (ULONG)mapSize;
+   int        i;
 
-   for(chp=seq; *chp != '\0'; chp++)
+   if((header->nTemplates < 0) || (header->nChars < 0) ||
+      (header->nInts < 0))
+      return(FALSE);
+
+   /* Each section must fit in the file and the int sections must be
+      int aligned
+   */
+   if((header->entryOffset  > size) ||
+      ((ULONG)header->nTemplates > 
+       (size - header->entryOffset) / sizeof(INDEXENTRY)) ||
+      (header->charOffset   > size) ||
+      ((ULONG)header->nChars > size - header->charOffset) ||
+      (header->codeOffset   > size) ||
+      ((ULONG)header->nChars > size - header->codeOffset) ||
+      (header->intOffset    > size) ||
+      ((ULONG)header->nInts  > 
+       (size - header->intOffset) / sizeof(int)) ||
+      (header->matrixOffset > size) ||
+      ((ULONG)(NAACODES * NAACODES) > 
+       (size - header->matrixOffset) / sizeof(int)) ||
+      (header->entryOffset  % sizeof(int)) ||
+      (header->intOffset    % sizeof(int)) ||
+      (header->matrixOffset % sizeof(int)))
+      return(FALSE);
+
+   charPool = base + header->charOffset;
+   entries  = (INDEXENTRY *)(base + header->entryOffset);
+   for(i=0; i<header->nTemplates; i++)
    {
-      if((*chp != 'X') && (*chp != '-'))
-         seqlen++;
+      INDEXENTRY *e = &(entries[i]);
+
+      if((e->headerOffset < 0) || (e->headerOffset >= header->nChars) ||
+         (memchr(charPool + e->headerOffset, '\0', 
+                 header->nChars - e->headerOffset) == NULL)      ||
+         (e->seqOffset < 0) || (e->seqLen < 0)                    ||
+         (e->seqOffset >= header->nChars - e->seqLen)             ||
+         (charPool[e->seqOffset + e->seqLen] != '\0')             ||
+         (e->IFOffset  < 0) || (e->nIFRes  < 0)                   ||
+         (e->IFOffset  > header->nInts - e->nIFRes)               ||
+         (e->CDROffset < 0) || (e->nCDRRes < 0)                   ||
+         (e->CDROffset > header->nInts - e->nCDRRes))
+         return(FALSE);
    }
 
-   return(seqlen);
+   return(TRUE);
 }
 
+
 /************************************************************************/
-BOOL CheckAndMask(char *seqresSeq, FILE *dbFp, PDBCHAIN *chain,
-                  DOMAIN **pDomains)
+/*>TEMPLATELIB *MapTemplateIndex(char *idxFile, char *faaFile)
+   -----------------------------------------------------------
+*//**
+   \param[in]   idxFile    The binary template index
+   \param[in]   faaFile    The template FASTA file it was built from
+   \return                 The template library (NULL if the index is
+                           missing, invalid or stale)
+
+   Maps the binary template index read-only. The only work done is to
+   set up the TEMPLATE pointers into the mapped pools. The index is 
+   rejected if it was built by a different version, if it fails the 
+   bounds checks in CheckTemplateIndex(), or if the FASTA file or the 
+   mutation matrix has changed since it was built. The size and 
+   modification time of the FASTA file are checked first and its 
+   checksum is only calculated if the time does not match. The 
+   mutation matrix is small so is always checksummed.
+
+-  17.10.26 Original   By: agent
+*/
+TEMPLATELIB *MapTemplateIndex(char *idxFile, char *faaFile)
 {
-   char        bestMatchFastaHeader[MAXBUFF+1];
-   REAL        maxScore = 0.0;
-   static char alignSeqres[HUGEBUFF+1],
-               alignRef[HUGEBUFF+1];
-   static char bestAlignSeqres[HUGEBUFF+1],
-               bestAlignRef[HUGEBUFF+1];
-   char        header[MAXBUFF+1];
-   char        *refSeq = NULL;
-   BOOL        found = FALSE;
+   int         fd,
+               i;
+   struct stat statBuf;
+   void        *mapping;
+   size_t      mapSize;
+   INDEXHEADER *header;
+   INDEXENTRY  *entries;
+   TEMPLATELIB *templates;
+   char        *base;
+   ULONG       faaSize,
+               faaMtime,
+               faaChecksum,
+               mdmSize,
+               mdmChecksum;
+   
+   if((fd = open(idxFile, O_RDONLY)) < 0)
+      return(NULL);
+   if(fstat(fd, &statBuf) || (statBuf.st_size < sizeof(INDEXHEADER)))
+   {
+      close(fd);
+      return(NULL);
+   }
+   mapSize = (size_t)statBuf.st_size;
+   mapping = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(mapping == MAP_FAILED)
+      return(NULL);
 
-   if(RealSeqLen(seqresSeq) < MINSEQLEN)
-      return(FALSE);
+   base   = (char *)mapping;
+   header = (INDEXHEADER *)mapping;
+
+   /* Check this is an index we understand                              */
+   if(strncmp(header->magic, INDEXMAGIC, 8)         ||
+      (header->version    != INDEXVERSION)          ||
+      (header->headerSize != sizeof(INDEXHEADER))   ||
+      (header->entrySize  != sizeof(INDEXENTRY))    ||
+      (header->nAACodes   != NAACODES)              ||
+      (header->fileSize   != (ULONG)mapSize)        ||
+      !CheckTemplateIndex(header, mapSize))
+   {
+      munmap(mapping, mapSize);
+      return(NULL);
+   }
 
-   /* Find the best match in the reference sequences                    */
-   rewind(dbFp);
-   while((refSeq = blReadFASTA(dbFp, header, MAXBUFF))!=NULL)
+   /* Check it is up to date with respect to the FASTA file             */
+   if(!GetFileChecksum(faaFile, &faaSize, &faaMtime, &faaChecksum, 
+                       FALSE) ||
+      (faaSize != header->faaSize) ||
+      ((faaMtime != header->faaMtime) &&
+       (!GetFileChecksum(faaFile, &faaSize, &faaMtime, &faaChecksum, 
+                         TRUE) ||
+        (faaChecksum != header->faaChecksum)))   ||
+      !GetMDMChecksum(&mdmSize, &mdmChecksum)       ||
+      (mdmSize     != header->mdmSize)              ||
+      (mdmChecksum != header->mdmChecksum))
    {
-      REAL score;
-         
-      score = CompareSeqs(seqresSeq, refSeq, alignSeqres, alignRef);
-      if(score > maxScore)
-      {
-         maxScore = score;
-         strncpy(bestMatchFastaHeader,  header, MAXBUFF);
-         strncpy(bestAlignSeqres, alignSeqres, HUGEBUFF);
-         strncpy(bestAlignRef, alignRef, HUGEBUFF);
-      }
-      free(refSeq);
+      munmap(mapping, mapSize);
+      return(NULL);
    }
 
-#ifdef DEBUG
-   printf("MaxScore : %f\n", maxScore);
-   printf("Sequence : %s\n", bestAlignSeqres);
-   printf("Reference: %s\n", bestAlignRef);
-#endif
+   /* Set up the library pointing into the mapped pools                 */
+   if((templates = (TEMPLATELIB *)malloc(sizeof(TEMPLATELIB)))==NULL)
+   {
+      munmap(mapping, mapSize);
+      return(NULL);
+   }
+   templates->nTemplates  = header->nTemplates;
+   templates->nChars      = header->nChars;
+   templates->nInts       = header->nInts;
+   templates->charPool    = base + header->charOffset;
+   templates->codePool    = (UBYTE *)(base + header->codeOffset);
+   templates->intPool     = (int *)(base + header->intOffset);
+   templates->scoreMatrix = (int *)(base + header->matrixOffset);
+   templates->mapping     = mapping;
+   templates->mapSize     = mapSize;
+   templates->kmerStart   = NULL;
+   templates->kmerTemplates = NULL;
+   templates->bitPool     = NULL;
+   if((templates->templates = 
+       (TEMPLATE *)malloc(header->nTemplates * sizeof(TEMPLATE)))==NULL)
+   {
+      FreeTemplateLibrary(templates);
+      return(NULL);
+   }
    
-   /* If we found an antibody sequence                                  */
-   if(maxScore > ABTHRESHOLD)
+   entries = (INDEXENTRY *)(base + header->entryOffset);
+   for(i=0; i<header->nTemplates; i++)
    {
-      if(gVerbose)
-      {
-         fprintf(stderr, "Best match: %s Score: %.4f\n",
-                 bestMatchFastaHeader, maxScore);
-         fprintf(stderr, "SEQ: %s\n",   bestAlignSeqres);
-         fprintf(stderr, "REF: %s\n\n", bestAlignRef);
-      }
+      TEMPLATE *t = &(templates->templates[i]);
       
-      MaskAndAssignDomain(seqresSeq, chain, bestMatchFastaHeader,
-                          bestAlignSeqres, bestAlignRef, pDomains);
-#ifdef DEBUG
-      printf("Masked   : %s\n", seqresSeq);
-#endif
-      found = TRUE;
+      t->header    = templates->charPool + entries[i].headerOffset;
+      t->seq       = templates->charPool + entries[i].seqOffset;
+      t->codes     = templates->codePool + entries[i].seqOffset;
+      t->seqLen    = entries[i].seqLen;
+      t->IFRes     = templates->intPool  + entries[i].IFOffset;
+      t->nIFRes    = entries[i].nIFRes;
+      t->CDRRes    = templates->intPool  + entries[i].CDROffset;
+      t->nCDRRes   = entries[i].nCDRRes;
+      t->chainType = entries[i].chainType;
    }
-   
-   return(found);
+
+   return(templates);
 }
 
 
 /************************************************************************/
-/* Uses the label in the FASTA file to set the chain type as heavy
-   or light
+/*>BOOL WriteTemplateIndex(TEMPLATELIB *templates, char *idxFile,
+                           char *faaFile)
+   --------------------------------------------------------------
+*//**
+   \param[in]   templates  Template library read from the FASTA file
+   \param[in]   idxFile    Binary index file to write
+   \param[in]   faaFile    The FASTA file the library was read from
+   \return                 Success
+
+   Writes the template library as a binary index that can be mapped 
+   by MapTemplateIndex(). The index is written to a temporary file which
+   is then renamed so a running absplit never sees a partial file.
+
+-  17.10.26 Original   By: agent
 */
-void SetChainAsLightOrHeavy(DOMAIN *domain, char *fastaHeader)
+BOOL WriteTemplateIndex(TEMPLATELIB *templates, char *idxFile,
+                        char *faaFile)
 {
-   char *ptr;
-   domain->chainType = '?';
-   if((ptr = strchr(fastaHeader, '|'))!=NULL)
+   INDEXHEADER header;
+   INDEXENTRY  entry;
+   FILE        *fp;
+   char        tmpFile[PATH_MAX+8];
+   ULONG       offset;
+   int         i;
+   BOOL        ok = TRUE;
+   
+   memset(&header, 0, sizeof(INDEXHEADER));
+   strncpy(header.magic, INDEXMAGIC, 8);
+   header.version      = INDEXVERSION;
+   header.headerSize   = sizeof(INDEXHEADER);
+   header.entrySize    = sizeof(INDEXENTRY);
+   header.nTemplates   = templates->nTemplates;
+   header.nChars       = templates->nChars;
+   header.nInts        = templates->nInts;
+   header.nAACodes     = NAACODES;
+   if(!GetFileChecksum(faaFile, &header.faaSize, &header.faaMtime,
+                       &header.faaChecksum, TRUE) ||
+      !GetMDMChecksum(&header.mdmSize, &header.mdmChecksum))
+      return(FALSE);
+
+   /* Lay out the file - the integer pools are kept int-aligned         */
+   header.entryOffset  = sizeof(INDEXHEADER);
+   header.charOffset   = header.entryOffset + 
+                         templates->nTemplates * sizeof(INDEXENTRY);
+   header.codeOffset   = header.charOffset + templates->nChars;
+   offset              = header.codeOffset + templates->nChars;
+   header.intOffset    = (offset + sizeof(int) - 1) &
+                         ~((ULONG)sizeof(int) - 1);
+   header.matrixOffset = header.intOffset + templates->nInts*sizeof(int);
+   header.fileSize     = header.matrixOffset + 
+                         NAACODES * NAACODES * sizeof(int);
+   
+   sprintf(tmpFile, "%s.tmp", idxFile);
+   if((fp = fopen(tmpFile, "wb"))==NULL)
+      return(FALSE);
+
+   fwrite(&header, sizeof(INDEXHEADER), 1, fp);
+   for(i=0; i<templates->nTemplates; i++)
    {
-      ptr--;
-      domain->chainType = *ptr;
+      TEMPLATE *t = &(templates->templates[i]);
+
+      memset(&entry, 0, sizeof(INDEXENTRY));
+      entry.headerOffset = t->header - templates->charPool;
+      entry.seqOffset    = t->seq    - templates->charPool;
+      entry.seqLen       = t->seqLen;
+      entry.IFOffset     = t->IFRes  - templates->intPool;
+      entry.nIFRes       = t->nIFRes;
+      entry.CDROffset    = t->CDRRes - templates->intPool;
+      entry.nCDRRes      = t->nCDRRes;
+      entry.chainType    = t->chainType;
+      fwrite(&entry, sizeof(INDEXENTRY), 1, fp);
    }
+   fwrite(templates->charPool, sizeof(char),  templates->nChars, fp);
+   fwrite(templates->codePool, sizeof(UBYTE), templates->nChars, fp);
+   for(; offset<header.intOffset; offset++)
+      putc(0, fp);
+   fwrite(templates->intPool, sizeof(int), templates->nInts, fp);
+   fwrite(templates->scoreMatrix, sizeof(int), NAACODES * NAACODES, fp);
+
+   if(ferror(fp))
+      ok = FALSE;
+   if(fclose(fp))
+      ok = FALSE;
+
+   if(ok && rename(tmpFile, idxFile))
+      ok = FALSE;
+   if(!ok)
+      unlink(tmpFile);
+   
+   return(ok);
 }
 
 
 /************************************************************************/
-/* TODO!
-   This needs to take the alignment and translate the residues numbers
-   to the PDB sequential number instead of what is in the FASTA file
-   header
-*/
-void SetIFResidues(DOMAIN *domain, char *fastaHeader, char *seqAln,
-                   char *refAln)
-{
-   char *ptr1, *ptr2, *bar;
-   char headerCopy[MAXBUFF+1];
-   int  refResnum,
-        seqResnum,
-        nIFRes = 0,
-        IFResidues[MAXINTERFACE];
-   int  seqLen = strlen(seqAln);
-/*   int  seqLen = RealSeqLen(seqAln); */
-
-
-#ifdef DEBUG
-   printf(">>> seqLen = %d\n", seqLen);
-#endif
+/*>BOOL BuildTemplateIndex(void)
+   -----------------------------
+*//**
+   \return    Success
 
+   Builds the binary template index next to the installed template
+   FASTA file. Run at install time with absplit -b
 
+-  17.10.26 Original   By: agent
+*/
+BOOL BuildTemplateIndex(void)
+{
+   char        faaFile[PATH_MAX],
+               idxFile[PATH_MAX];
+   FILE        *dataFp;
+   TEMPLATELIB *templates;
+   BOOL        ok;
    
-   domain->nInterface = 0;
-   strncpy(headerCopy, fastaHeader, MAXBUFF);
-   headerCopy[MAXBUFF] = '\0';
-   if((ptr1 = strchr(headerCopy, '['))!=NULL)
+   DataFilePathName(faaFile, ABSEQFILE);
+   DataFilePathName(idxFile, ABIDXFILE);
+
+   if((dataFp=fopen(faaFile, "r"))==NULL)
    {
-      ptr1++;
-      bar = strchr(ptr1, '|');
-      
-      /* Grab the list of interface residues from the FASTA header      */
-      while((ptr2 = strchr(ptr1, ','))!=NULL)
-      {
-         if(ptr2 > bar)
-            break;
+      fprintf(stderr,"Error (%s): Can't read %s\n", PROGNAME, faaFile);
+      return(FALSE);
+   }
 
-         *ptr2 = '\0';
-         sscanf(ptr1, "%d", &refResnum);
-         IFResidues[nIFRes++] = refResnum;
-         ptr1  = ptr2+1;
-      }
-      if((ptr2 = strchr(ptr1, ']'))!=NULL)
-      {
-         *ptr2 = '\0';
-         sscanf(ptr1, "%d", &refResnum);
-         IFResidues[nIFRes++] = refResnum;
-      }
-      IFResidues[nIFRes++] = -1;
+   blReadMDM(SCOREMATRIX);
+   templates = ReadTemplateLibrary(dataFp);
+   fclose(dataFp);
+   if(templates == NULL)
+      return(FALSE);
 
-      /* Run through the alignment */
-      for(seqResnum=1; seqResnum<=seqLen; seqResnum++)
-      {
-         if(IsKeyResidue(seqResnum, IFResidues, seqAln, refAln))
-            domain->interface[domain->nInterface++] =
-               seqResnum - domain->startSeqRes;
-      }
-   }
+   ok = WriteTemplateIndex(templates, idxFile, faaFile);
+   if(ok && !gQuiet)
+      fprintf(stderr, "Wrote %d templates to %s\n", 
+              templates->nTemplates, idxFile);
+
+   FreeTemplateLibrary(templates);
+   return(ok);
 }
 
+
 /************************************************************************/
-void SetCDRResidues(DOMAIN *domain, char *fastaHeader, char *seqAln,
-                    char *refAln)
-{
-   char *ptr1, *ptr2,
-        headerCopy[MAXBUFF+1];
-   int  refResnum,
-        seqResnum,
-        nCDRRes = 0,
-        CDRResidues[MAXCDRRES];
-   int  seqLen = strlen(seqAln);
-/*   int  seqLen = RealSeqLen(seqAln); */
+/*>int ResidueCode(char res)
+   -------------------------
+*//**
+   \param[in]   res     One-letter amino acid code
+   \return              Integer code (0..NAACODES-1)
 
-   domain->nCDRRes = 0;
+   Integer encoding of residues used by the template library and the
+   alignment code. Anything not in AACODES gets AACODE_UNKNOWN
 
-   strncpy(headerCopy, fastaHeader, MAXBUFF);
-   headerCopy[MAXBUFF] = '\0';
+-  17.10.26 Original   By: agent
+*/
+int ResidueCode(char res)
+{
+   static int  sCodes[256];
+   static BOOL sInit = FALSE;
 
-   if((ptr1 = strchr(headerCopy, '['))!=NULL)
+   if(!sInit)
    {
-      ptr1++;
-      if((ptr1 = strchr(ptr1, '['))!=NULL)
+      int i;
+      for(i=0; i<256; i++)
+         sCodes[i] = AACODE_UNKNOWN;
+      for(i=0; AACODES[i]; i++)
       {
-         ptr1++;
-      
-         while((ptr2 = strchr(ptr1, ','))!=NULL)
-         {
-            *ptr2 = '\0';
-            sscanf(ptr1, "%d", &refResnum);
-            CDRResidues[nCDRRes++] = refResnum;
-            ptr1=ptr2+1;
-         }
-      
-         if((ptr2 = strchr(ptr1, ']'))!=NULL)
-         {
-            *ptr2 = '\0';
-            sscanf(ptr1, "%d", &refResnum);
-            CDRResidues[nCDRRes++] = refResnum;
-         }
-         CDRResidues[nCDRRes] = -1;
-
-         for(seqResnum=1; seqResnum<=seqLen; seqResnum++)
-         {
-            if(IsKeyResidue(seqResnum, CDRResidues, seqAln, refAln))
-               domain->CDRRes[domain->nCDRRes++] =
-                  seqResnum - domain->startSeqRes;
-         }
+         sCodes[(int)AACODES[i]]          = i;
+         sCodes[(int)tolower(AACODES[i])] = i;
       }
+      sInit = TRUE;
    }
+   
+   return(sCodes[(UBYTE)res]);
 }
 
 
+/************************************************************************/
+/*>void SetScoreMatrix(int *scoreMatrix)
+   -------------------------------------
+*//**
+   \param[out]  scoreMatrix   NAACODES x NAACODES score matrix
+
+   Fills in the integer-coded score matrix from the mutation matrix
+   which must already have been read with blReadMDM()
 
-int IsKeyResidue(int alnPos, int *refKeys,
-                 char *seqAln, char *refAln)
+-  17.10.26 Original   By: agent
+*/
+void SetScoreMatrix(int *scoreMatrix)
 {
-   int refPos = 0,
-       i;
+   int i, j;
    
-   /* Find where alnPos is in the reference sequence */
-   for(i=0; i<=alnPos; i++)
+   for(i=0; i<NAACODES; i++)
    {
-      if(refAln[i] != '-')
-         refPos++;
+      for(j=0; j<NAACODES; j++)
+      {
+         if((i == AACODE_UNKNOWN) || (j == AACODE_UNKNOWN))
+            scoreMatrix[i*NAACODES + j] = 0;
+         else
+            scoreMatrix[i*NAACODES + j] = 
+               blCalcMDMScore(AACODES[i], AACODES[j]);
+      }
    }
-   
-   /* Now see if this position is in the list of key reference positions*/
-   for(i=0; refKeys[i] >=0; i++)
+}
+
+
+/************************************************************************/
+/*>TEMPLATELIB *ReadTemplateLibrary(FILE *fp)
+   ------------------------------------------
+*//**
+   \param[in]   fp     The templates FASTA file
+   \return             The template library (NULL on failure)
+
+   Reads the template FASTA file into an in-memory template library so
+   that it only needs to be parsed once. The chain type and the 
+   interface and CDR position lists are parsed from the headers. 
+   Headers and sequences are stored in one character pool and the 
+   position lists in one integer pool. The file is read twice - once to
+   size the storage and once to fill it. The mutation matrix must have
+   been read with blReadMDM() so that the integer-coded score matrix
+   can be filled in.
+
+-  17.10.26 Original   By: agent
+*/
+TEMPLATELIB *ReadTemplateLibrary(FILE *fp)
+{
+   TEMPLATELIB *templates;
+   char        header[MAXBUFF+1],
+               *refSeq,
+               *chp,
+               *charPool;
+   int         nTemplates = 0,
+               nChars     = 0,
+               nInts      = 0,
+               *intPool,
+               i;
+
+   /* First pass to find how much storage is needed                     */
+   rewind(fp);
+   while((refSeq = blReadFASTA(fp, header, MAXBUFF))!=NULL)
    {
-      if(refPos == refKeys[i])
+      nTemplates++;
+      nChars += strlen(header) + strlen(refSeq) + 2;
+      nInts  += 2;              /* -1 terminators for both lists        */
+      if((chp = strchr(header, '['))!=NULL)
       {
-         
-#ifdef DEBUG
-         printf("alnPos %d refPos %d refKeys[%d] %d\n", alnPos, refPos, i, refKeys[i]);
-#endif
-         return(1);
+         nInts += ParseTemplatePositions(chp+1, NULL);
+         if((chp = strchr(chp+1, '['))!=NULL)
+            nInts += ParseTemplatePositions(chp+1, NULL);
       }
+      free(refSeq);
+   }
+   if(nTemplates == 0)
+      return(NULL);
+
+   /* Allocate the library                                              */
+   if((templates = (TEMPLATELIB *)malloc(sizeof(TEMPLATELIB)))==NULL)
+      return(NULL);
+   templates->nTemplates  = nTemplates;
+   templates->nChars      = nChars;
+   templates->nInts       = nInts;
+   templates->mapping     = NULL;
+   templates->mapSize     = 0;
+   templates->kmerStart   = NULL;
+   templates->kmerTemplates = NULL;
+   templates->bitPool     = NULL;
+   templates->templates   = (TEMPLATE *)malloc(nTemplates*sizeof(TEMPLATE));
+   templates->charPool    = (char *)malloc(nChars*sizeof(char));
+   templates->codePool    = (UBYTE *)malloc(nChars*sizeof(UBYTE));
+   templates->intPool     = (int *)malloc(nInts*sizeof(int));
+   templates->scoreMatrix = (int *)malloc(NAACODES*NAACODES*sizeof(int));
+   if((templates->templates   == NULL) ||
+      (templates->charPool    == NULL) ||
+      (templates->codePool    == NULL) ||
+      (templates->intPool     == NULL) ||
+      (templates->scoreMatrix == NULL))
+   {
+      FreeTemplateLibrary(templates);
+      return(NULL);
+   }
+   SetScoreMatrix(templates->scoreMatrix);
+
+   /* Second pass to fill in the data                                   */
+   charPool = templates->charPool;
+   intPool  = templates->intPool;
+   rewind(fp);
+   for(i=0; 
+       (i<nTemplates) && ((refSeq = blReadFASTA(fp, header, MAXBUFF))!=NULL);
+       i++)
+   {
+      TEMPLATE *t = &(templates->templates[i]);
+      int      j;
+
+      t->header = charPool;
+      strcpy(t->header, header);
+      charPool += strlen(header) + 1;
+
+      /* The integer-encoded sequence is stored at the same offset in
+         the code pool as the sequence in the character pool
+      */
+      t->seq    = charPool;
+      t->codes  = templates->codePool + (charPool - templates->charPool);
+      strcpy(t->seq, refSeq);
+      t->seqLen = strlen(refSeq);
+      for(j=0; j<=t->seqLen; j++)
+         t->codes[j] = (UBYTE)ResidueCode(t->seq[j]);
+      charPool += t->seqLen + 1;
+      free(refSeq);
+
+      /* The chain type precedes the first | in the header              */
+      t->chainType = '?';
+      if(((chp = strchr(t->header, '|'))!=NULL) && (chp > t->header))
+         t->chainType = *(chp-1);
+
+      /* Interface positions are in the first [] and CDR positions in 
+         the second
+      */
+      t->nIFRes  = t->nCDRRes = 0;
+      t->IFRes   = intPool;
+      t->IFRes[0] = -1;
+      if((chp = strchr(t->header, '['))!=NULL)
+         t->nIFRes = ParseTemplatePositions(chp+1, t->IFRes);
+      intPool   += t->nIFRes + 1;
+
+      t->CDRRes  = intPool;
+      t->CDRRes[0] = -1;
+      if((chp != NULL) && ((chp = strchr(chp+1, '['))!=NULL))
+         t->nCDRRes = ParseTemplatePositions(chp+1, t->CDRRes);
+      intPool   += t->nCDRRes + 1;
    }
+   templates->nTemplates = i;
    
-   return(0);
+   return(templates);
 }
 
 
 /************************************************************************/
-int TransferResnum(int refResnum, char *seqAln, char *refAln)
-{
-   int atomResnum = 0,
-       i;
+/*>int ParseTemplatePositions(char *list, int *positions)
+   ------------------------------------------------------
+*//**
+   \param[in]   list        Comma-separated list of integers terminated
+                            by a ]
+   \param[out]  positions   Array for the parsed values - terminated by
+                            -1. May be NULL to just count the values.
+   \return                  Number of values in the list
 
-   /* The position of interest is missing in the atom sequence          */
-   if(seqAln[refResnum] == '-')
-      return(-1);
+   Parses a list of residue positions from a template FASTA header
+
+-  17.10.26 Original   By: agent
+*/
+int ParseTemplatePositions(char *list, int *positions)
+{
+   int  nPositions = 0;
+   char *chp;
    
-   for(i=0; i<refResnum; i++)
+   for(chp=list; (*chp != ']') && (*chp != '\0'); )
    {
-      if(seqAln[i] != '-')
-         atomResnum++;
+      if(positions != NULL)
+         positions[nPositions] = atoi(chp);
+      nPositions++;
+
+      /* Skip to the next value                                         */
+      while((*chp != ',') && (*chp != ']') && (*chp != '\0'))
+         chp++;
+      if(*chp == ',')
+         chp++;
    }
 
-   return(atomResnum);
-}
+   if(positions != NULL)
+      positions[nPositions] = -1;
 
+   return(nPositions);
+}
 
 
 /************************************************************************/
-void PrintDomains(DOMAIN *domains)
+/*>BOOL BuildKmerIndex(TEMPLATELIB *templates)
+   -------------------------------------------
+*//**
+   \param[in,out]  templates   The template library
+   \return                     Success
+
+   Builds an inverted index from each k-mer of integer-coded residues
+   to the templates that contain it. Each template is listed once for
+   each distinct k-mer it contains. The index is stored as an array of
+   offsets (kmerStart) into a single array of template numbers 
+   (kmerTemplates). K-mers containing an X or an unknown residue are
+   not indexed.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL BuildKmerIndex(TEMPLATELIB *templates)
 {
-   DOMAIN *d;
+   int *lastTemplate,
+       nPostings = 0,
+       i, j;
 
-   printf("\n***Results\n");
-   
-   for(d=domains; d!=NULL; NEXT(d))
+   if((templates->kmerStart = (int *)calloc(NKMERS+1, sizeof(int)))
+      == NULL)
+      return(FALSE);
+   if((lastTemplate = (int *)malloc(NKMERS * sizeof(int)))==NULL)
+      return(FALSE);
+
+   /* Count the templates for each k-mer in kmerStart[kmer+1]           */
+   for(j=0; j<NKMERS; j++)
+      lastTemplate[j] = -1;
+   for(i=0; i<templates->nTemplates; i++)
    {
-      printf("Domain: %d Chain: %s Start: %d Stop: %d Type: %c \
-PairsWithDomain: %d (Chain: %s)\n",
-             d->domainNumber,
-             d->chain->chain,
-             d->startSeqRes,
-             d->lastSeqRes,
-             d->chainType,
-             (d->pairedDomain==NULL)?0:d->pairedDomain->domainNumber,
-             (d->pairedDomain==NULL)?"none":d->pairedDomain->chain->chain
-         );
-      printf("%s\n", d->domSeq);
-      if(d->nAntigenChains)
+      TEMPLATE *t = &(templates->templates[i]);
+      for(j=0; j<=t->seqLen-KMERLEN; j++)
       {
-         int i;
-         printf("   AntigenChains: ");
-         for(i=0; i<d->nAntigenChains; i++)
+         int kmer = KmerCode(t->codes+j);
+         if((kmer >= 0) && (lastTemplate[kmer] != i))
          {
-            printf("%s ",d->antigenChains[i]->chain);
+            lastTemplate[kmer] = i;
+            templates->kmerStart[kmer+1]++;
+            nPostings++;
          }
-         printf("\n");
       }
-      printf("\n");
-#ifdef DEBUG
+   }
+
+   /* Convert the counts to offsets                                     */
+   for(j=0; j<NKMERS; j++)
+      templates->kmerStart[j+1] += templates->kmerStart[j];
+   
+   if((templates->kmerTemplates = 
+       (int *)malloc((nPostings+1) * sizeof(int)))==NULL)
+   {
+      free(lastTemplate);
+      return(FALSE);
+   }
+
+   /* Fill in the template lists, using lastTemplate as a fill pointer */
+   for(j=0; j<NKMERS; j++)
+      lastTemplate[j] = templates->kmerStart[j];
+   for(i=0; i<templates->nTemplates; i++)
+   {
+      TEMPLATE *t = &(templates->templates[i]);
+      for(j=0; j<=t->seqLen-KMERLEN; j++)
       {
-         int i;
-         printf("IF: ");
-         for(i=0; i<d->nInterface; i++)
-         {
-            printf("%d ", d->interface[i]);
-         }
-         printf("\n\n");
-         printf("CDR: ");
-         for(i=0; i<d->nCDRRes; i++)
+         int kmer = KmerCode(t->codes+j);
+         if((kmer >= 0) &&
+            ((lastTemplate[kmer] == templates->kmerStart[kmer]) ||
+             (templates->kmerTemplates[lastTemplate[kmer]-1] != i)))
          {
-            printf("%d ", d->CDRRes[i]);
+            templates->kmerTemplates[lastTemplate[kmer]++] = i;
          }
-         printf("\n\n");
       }
-      if(d->startRes) blWritePDBRecord(stdout,d->startRes);
-      if(d->lastRes)  blWritePDBRecord(stdout,d->lastRes);
-#endif
    }
+   
+   free(lastTemplate);
+   return(TRUE);
 }
 
 
 /************************************************************************/
-void MaskAndAssignDomain(char *seq, PDBCHAIN *chain, char *fastaHeader,
-                         char *seqAln, char *refAln, DOMAIN **pDomains)
-{
-   int    seqPos      = 0,
-          alnPos      = 0,
-          domSeqPos   = 0;
-   DOMAIN *d, *prevD;
+/*>int KmerCode(UBYTE *codes)
+   --------------------------
+*//**
+   \param[in]   codes    Integer-coded residues (at least KMERLEN)
+   \return               The k-mer number or -1 if it contains an X or
+                         an unknown residue
 
-   if(*pDomains == NULL)
+   Calculates the k-mer number for KMERLEN integer-coded residues
+
+-  17.10.26 Original   By: agent
+*/
+int KmerCode(UBYTE *codes)
+{
+   int kmer = 0,
+       i;
+   
+   for(i=0; i<KMERLEN; i++)
    {
-      INIT((*pDomains), DOMAIN);
-      d = *pDomains;
-      prevD = NULL;
+      if(codes[i] >= AACODE_X)
+         return(-1);
+      kmer = kmer * NAACODES + codes[i];
    }
-   else
-   {
-      d = *pDomains;
-      LAST(d);
-      prevD = d;
-      ALLOCNEXT(d, DOMAIN);
-   }
-   if(d==NULL)
+   return(kmer);
+}
+
+
+/************************************************************************/
+/*>void RankTemplates(char *seq, TEMPLATELIB *templates, int *counts,
+                      int *ranking)
+   ------------------------------------------------------------------
+*//**
+   \param[in]   seq         The (masked) chain sequence
+   \param[in]   templates   The template library
+   \param[out]  counts      Workspace for a count for each template
+   \param[out]  ranking     The template numbers ranked by the number of
+                            k-mers they share with the sequence. Ties 
+                            are broken by template order.
+
+   Ranks the templates for ShortlistTemplates(). The ranking is kept so
+   that the templates left out of the shortlist can be found without
+   counting the k-mers again.
+
+-  17.10.26 Original (split from ShortlistTemplates())   By: agent
+*/
+void RankTemplates(char *seq, TEMPLATELIB *templates, int *counts,
+                   int *ranking)
+{
+   int   seqLen = strlen(seq),
+         i, j;
+   UBYTE *codes;
+
+   if((codes = (UBYTE *)malloc((seqLen+1) * sizeof(UBYTE)))==NULL)
    {
-      fprintf(stderr,"Error (%s): No memory for list of domains\n",
+      fprintf(stderr,"Error (%s): No memory for template shortlist\n",
               PROGNAME);
       exit(1);
    }
-   d->startSeqRes    = -1;
-   d->lastSeqRes     = -1;
-   d->chain          = chain;
-   d->pairIntDistSq  = 100000000.0;
-   d->pairCofGDistSq = 100000000.0;
-   d->domainNumber   = (prevD==NULL)?1:prevD->domainNumber+1;
-   d->pairedDomain   = NULL;
-   d->nCDRRes        = 0;
-   d->nInterface     = 0;
-   d->nHetAntigen    = 0;
-   d->nAntigenChains = 0;
-
-
-#ifdef DEBUG_SET_CDR
-   printf("SEQ      : %s\n", seqAln);
-   printf("REF      : %s\n", refAln);
-#endif
-
-   SetChainAsLightOrHeavy(d, fastaHeader);
+   for(i=0; i<templates->nTemplates; i++)
+      counts[i] = 0;
 
-   /* Mask the sequence */
-   for(seqPos=0, alnPos=0;
-       seqPos<strlen(seq) && alnPos<strlen(seqAln);
-       alnPos++)
+   /* Count the k-mers shared with each template                        */
+   for(i=0; i<seqLen; i++)
+      codes[i] = (UBYTE)ResidueCode(seq[i]);
+   for(i=0; i<=seqLen-KMERLEN; i++)
    {
-      /* If this is an aligned position */
-      if((seqAln[alnPos] != '-') &&
-         (seqAln[alnPos] != 'X') &&
-         (refAln[alnPos] != '-'))
+      int kmer = KmerCode(codes+i);
+      if(kmer >= 0)
       {
-         d->domSeq[domSeqPos++] = seq[seqPos];
-         seq[seqPos] = 'X';
-         if(d->startSeqRes < 0)
-            d->startSeqRes = seqPos;
-         if(seqPos > d->lastSeqRes)
-            d->lastSeqRes = seqPos;
+         for(j=templates->kmerStart[kmer];
+             j<templates->kmerStart[kmer+1];
+             j++)
+         {
+            counts[templates->kmerTemplates[j]]++;
+         }
       }
-      if(seqAln[alnPos] != '-')
-         seqPos++;
    }
 
-   d->domSeq[domSeqPos] = '\0';
+   /* Insertion into ranking[] keeping it sorted by descending count 
+      then ascending template
+   */
+   for(i=0; i<templates->nTemplates; i++)
+   {
+      for(j=i; (j>0) && (counts[ranking[j-1]] < counts[i]); j--)
+         ranking[j] = ranking[j-1];
+      ranking[j] = i;
+   }
 
-   SetIFResidues(d,          fastaHeader, seqAln, refAln);
-   SetCDRResidues(d,         fastaHeader, seqAln, refAln);
-#ifdef DEBUG
+   free(codes);
+}
+
+
+/************************************************************************/
+/*>static int CompareInts(const void *a, const void *b)
+   ----------------------------------------------------
+*//**
+   qsort() comparison of ints
+
+-  17.10.26 Original   By: agent
+*/
+static int CompareInts(const void *a, const void *b)
+{
+   int intA = *(int *)a,
+       intB = *(int *)b;
+   return((intA < intB) ? -1 : ((intA > intB) ? 1 : 0));
+}
+
+
+/************************************************************************/
+/*>int ShortlistTemplates(int *ranking, TEMPLATELIB *templates,
+                          int maxCandidates, int *candidates)
+   ----------------------------------------------------------
+*//**
+   \param[in]   ranking        Template ranking from RankTemplates()
+                               (not used for an exhaustive scan)
+   \param[in]   templates      The template library
+   \param[in]   maxCandidates  Number of templates to shortlist. 0 (or
+                               more than the number of templates) for
+                               all templates. A negative value gives
+                               the templates that would NOT be in the
+                               shortlist of that size.
+   \param[out]  candidates     The shortlisted template numbers in 
+                               ascending order
+   \return                     Number of shortlisted templates
+
+   Returns the top maxCandidates templates from the k-mer ranking. The
+   shortlist is returned in template order so that the first template
+   wins on equal alignment scores as it would with an exhaustive scan.
+
+-  17.10.26 Original   By: agent
+*/
+int ShortlistTemplates(int *ranking, TEMPLATELIB *templates,
+                       int maxCandidates, int *candidates)
+{
+   int  nCandidates,
+        i;
+   BOOL rest = FALSE;
+
+   if(maxCandidates < 0)
    {
-      int i;
-      
-      printf("IF Residue numbers: \n");
-      for(i=0;i<d->nInterface; i++)
-         printf("%d ", d->interface[i]);
-      printf("\n");
-      printf("CDR Residue numbers: \n");
-      for(i=0;i<d->nCDRRes; i++)
-         printf("%d ", d->CDRRes[i]);
-      printf("\n");
+      rest          = TRUE;
+      maxCandidates = -maxCandidates;
    }
-#endif
    
-   SetDomainBoundaries(d);
+   /* Exhaustive scan                                                   */
+   if((maxCandidates == 0) || (maxCandidates >= templates->nTemplates))
+   {
+      if(rest)
+         return(0);
+      for(i=0; i<templates->nTemplates; i++)
+         candidates[i] = i;
+      return(templates->nTemplates);
+   }
+
+   /* Take the top of the ranking or the rest, in template order        */
+   if(rest)
+   {
+      nCandidates = templates->nTemplates - maxCandidates;
+      memcpy(candidates, ranking + maxCandidates, 
+             nCandidates * sizeof(int));
+   }
+   else
+   {
+      nCandidates = maxCandidates;
+      memcpy(candidates, ranking, nCandidates * sizeof(int));
+   }
+   qsort(candidates, nCandidates, sizeof(int), CompareInts);
+
+   return(nCandidates);
 }
 
+
 /************************************************************************/
-void SetDomainBoundaries(DOMAIN *domain)
+/*>BOOL BuildKeyBitsets(TEMPLATELIB *templates)
+   --------------------------------------------
+*//**
+   \param[in,out]  templates   The template library
+   \return                     Success
+
+   Converts the interface and CDR position lists of each template to bit
+   sets over template positions 0..seqLen+1 (the alignment column beyond
+   the last template residue counts as position seqLen+1). Positions 
+   outside this range can never be matched so are dropped.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL BuildKeyBitsets(TEMPLATELIB *templates)
 {
-   int resnum = 0,
-       nCoor  = 0,
-       i;
-   PDB *p,
-       *nextRes;
+   int   i, j,
+         nBytes = 0;
+   UBYTE *bits;
 
-   domain->startRes = NULL;
-   domain->stopRes  = NULL;
-   domain->lastRes  = NULL;
-   
-   /* Given the integer sequence positions, find the pointers to
-      the PDB residues for these positions
-   */
-   for(p=domain->chain->start;
-       p!=domain->chain->stop && p!=NULL;
-       p=nextRes)
+   for(i=0; i<templates->nTemplates; i++)
+      nBytes += 2 * BITSETBYTES(templates->templates[i].seqLen + 2);
+
+   if((templates->bitPool = (UBYTE *)calloc(nBytes+1, 1))==NULL)
+      return(FALSE);
+
+   bits = templates->bitPool;
+   for(i=0; i<templates->nTemplates; i++)
    {
-      nextRes = blFindNextResidue(p);
-      if(resnum == domain->startSeqRes)
+      TEMPLATE *t     = &(templates->templates[i]);
+      int      nBits  = t->seqLen + 2;
+
+      t->IFBits  = bits;
+      bits      += BITSETBYTES(nBits);
+      t->CDRBits = bits;
+      bits      += BITSETBYTES(nBits);
+
+      for(j=0; t->IFRes[j] >= 0; j++)
       {
-         domain->startRes = p;
+         if(t->IFRes[j] < nBits)
+            BITSET(t->IFBits, t->IFRes[j]);
       }
-      else if(resnum == domain->lastSeqRes)
+      for(j=0; t->CDRRes[j] >= 0; j++)
       {
-         domain->lastRes = p;
-         domain->stopRes = nextRes;
-         break;
+         if(t->CDRRes[j] < nBits)
+            BITSET(t->CDRBits, t->CDRRes[j]);
       }
-      
-      resnum++;
    }
-
-   /* Find the CofG of the domain                                       */
-   domain->CofG.x = domain->CofG.y = domain->CofG.z = 0.0;
-   nCoor          = 0;
    
-   for(p=domain->startRes; p!=NULL && p!=domain->stopRes; NEXT(p))
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>void FreeTemplateLibrary(TEMPLATELIB *templates)
+   ------------------------------------------------
+*//**
+   \param[in]   templates   The template library
+
+   Frees the template library (or unmaps the binary index)
+
+-  17.10.26 Original   By: agent
+*/
+void FreeTemplateLibrary(TEMPLATELIB *templates)
+{
+   if(templates != NULL)
    {
-      if(!strncmp(p->atnam, "CA  ", 4))
+      FREE(templates->templates);
+      FREE(templates->kmerStart);
+      FREE(templates->kmerTemplates);
+      FREE(templates->bitPool);
+      if(templates->mapping != NULL)
       {
-#ifdef FUBAR
-         fprintf(stderr, "Calc CofG %d: %s%d%s\n",
-                 domain->domainNumber, p->chain, p->resnum, p->insert);
-#endif
-         domain->CofG.x += p->x;
-         domain->CofG.y += p->y;
-         domain->CofG.z += p->z;
-         nCoor++;
+         munmap(templates->mapping, templates->mapSize);
+      }
+      else
+      {
+         FREE(templates->charPool);
+         FREE(templates->codePool);
+         FREE(templates->intPool);
+         FREE(templates->scoreMatrix);
       }
+      free(templates);
    }
-   
-   domain->CofG.x /= nCoor;
-   domain->CofG.y /= nCoor;
-   domain->CofG.z /= nCoor;
+}
 
-   /* Find the CofG of the VH/VL interface residues                     */
-   domain->IntCofG.x = domain->IntCofG.y = domain->IntCofG.z = 0.0;
-   nCoor  = 0;
-   resnum = 0;
 
-   for(p=domain->startRes; p!=domain->stopRes; p=nextRes)
-   {
-      PDB *q;
-      
-      nextRes = blFindNextResidue(p);
-      for(q=p; q!=nextRes; NEXT(q))
+/************************************************************************/
+REAL ScoreAlignedResidues(char *aln1, char *aln2,
+                          int alignLen, int minLen)
+{
+      int nAligned = 0,
+          nMatched = 0,
+          i;
+
+      /* Score the matched residues                                     */
+      for(i=0; i<alignLen; i++)
       {
-         for(i=0; i<domain->nInterface; i++)
+         if((aln1[i] != '-') &&
+            (aln2[i] != '-'))
          {
-            if(resnum == domain->interface[i])
+            nAligned++;
+            if(aln1[i] == aln2[i])
             {
-               PDB *r;
-               
-               for(r=p; r!=nextRes; NEXT(r))
-               {
-                  if(!strncmp(r->atnam, "CA  ", 4))
-                  {
-                     domain->IntCofG.x += r->x;
-                     domain->IntCofG.y += r->y;
-                     domain->IntCofG.z += r->z;
-                     nCoor++;
-                  }
-               }
-               break;
+               nMatched++;
             }
-
          }
       }
-      resnum++;
-   }
-   domain->IntCofG.x /= nCoor;
-   domain->IntCofG.y /= nCoor;
-   domain->IntCofG.z /= nCoor;
+
+#ifdef DEBUG
+      printf("SEQ1: %s\n", alignDomSeq);
+      printf("SEQ2: %s\n", alignChainSeq);
+      printf("MATCH: %d ALIGN: %d SCORE: %f\n\n",
+             nMatched, nAligned, ((REAL)nMatched/(REAL)nAligned));
+#endif
+
+      if(nAligned < minLen)
+         return((REAL)0.0);
+      
+      return((REAL)nMatched/(REAL)nAligned);
 }
 
 
 /************************************************************************/
-void PairDomains(DOMAIN *domains)
+/*>REAL CompareSeqs(ALIGNQUERY *query, TEMPLATE *template, 
+                    ALIGNWORK *work, char *alignSeqres, char *alignRef)
+   --------------------------------------------------------------------
+*//**
+   \param[in]   query         the sequence of interest
+   \param[in]   template      the database sequence
+   \param[in]   work          alignment workspace
+   \param[out]  alignSeqres   Alignment of our sequence
+   \param[out]  alignRef      Alignment of database sequence
+   \return                    Score for alignment
+
+   - 31.03.20 Original   By: ACRM
+   - 20.09.21 Modified to use affine alignment and mutation matrix
+   - 17.10.26 Uses the native aligner unless the bioplib engine has been
+              selected   By: agent
+*/
+REAL CompareSeqs(ALIGNQUERY *query, TEMPLATE *template, ALIGNWORK *work,
+                 char *alignSeqres, char *alignRef)
 {
-   DOMAIN *d1, *d2;
-   
-   for(d1=domains; d1!=NULL; NEXT(d1))
+   int  alignLen;
+   REAL percMatch;
+
+   if(query->engine == ALIGN_BIOPLIB)
    {
-      for(d2=domains; d2!=NULL; NEXT(d2))
-      {
-         if(d1 != d2)
-         {
-            REAL distCofGSq;
-            VEC3F *c1, *c2;
-            c1 = &(d1->CofG);
-            c2 = &(d2->CofG);
-            
-            distCofGSq = DISTSQ(c1, c2);
+      blAffinealign(query->seq, query->seqLen,
+                    template->seq, template->seqLen,
+                    FALSE,          /* verbose                     */
+                    FALSE,          /* identity                    */
+                    GAPOPENPENALTY, /* penalty                     */
+                    GAPEXTPENALTY,  /* extension                   */
+                    alignSeqres,
+                    alignRef,
+                    &alignLen);
+   }
+   else
+   {
+      NativeAffineAlign(query, template, work, 
+                        alignSeqres, alignRef, &alignLen);
+   }
 
-#ifdef FUBAR
-            fprintf(stderr, "Chain1 %s; CofG1 %.3f %.3f %.3f; \
-Chain2 %s; CofG2 %.3f %.3f %.3f; \
-Dist %.3f\n",
-                    d1->lastRes->chain,
-                    c1->x, c1->y, c1->z, 
-                    d2->startRes->chain,
-                    c2->x, c2->y, c2->z,
-                    sqrt(distCofGSq));
-#endif
-            if((distCofGSq < COFGDISTCUTSQ) && (distCofGSq > 1.0))
-            {
-               REAL distIntSq;
-               
-               c1 = &(d1->IntCofG);
-               c2 = &(d2->IntCofG);
-               
-               distIntSq = DISTSQ(c1, c2);
+   alignSeqres[alignLen]  = alignRef[alignLen] = '\0';
 
-#ifdef FUBAR
-               fprintf(stderr, "Chain1 %s; IntCofG1 %.3f %.3f %.3f; \
-Chain2 %s; IntCofG2 %.3f %.3f %.3f; \
-Dist %.3f\n",
-                       d1->lastRes->chain,
-                       c1->x, c1->y, c1->z, 
-                       d2->startRes->chain,
-                       c2->x, c2->y, c2->z,
-                       sqrt(distIntSq));
+   percMatch = ScoreAlignedResidues(alignSeqres, alignRef, alignLen, MINSEQLEN);
+   
+#ifdef DEBUG   
+   fprintf(stderr, "\n>>>%s\n", alignSeqres);
+   fprintf(stderr, ">>>%s\n",   alignRef);
+   fprintf(stderr, ">>>SCORE: %f\n",   percMatch);
 #endif
 
-               if(distIntSq < INTDISTCUTSQ)
-               {
-                  if(distIntSq < distCofGSq)
-                  {
-                     if(((distCofGSq < d1->pairCofGDistSq) ||
-                         (distIntSq  < d1->pairIntDistSq)) &&
-                        ((distCofGSq < d2->pairCofGDistSq) ||
-                         (distIntSq  < d2->pairIntDistSq)))
-                     {
-                        d1->pairCofGDistSq = distCofGSq;
-                        d1->pairIntDistSq  = distIntSq;
-                        d2->pairCofGDistSq = distCofGSq;
-                        d2->pairIntDistSq  = distIntSq;
-                        d1->pairedDomain = d2;
-                        d2->pairedDomain = d1;
+   return(percMatch);
+}
 
-                        if(gVerbose)
-                        {
-                           printf("***Paired domain %d with %d\n",
+
+/************************************************************************/
+/*>ALIGNQUERY *PrepareAlignQuery(char *seq, int *scoreMatrix, int engine)
+   ----------------------------------------------------------------------
+*//**
+   \param[in]   seq          The query (chain) sequence
+   \param[in]   scoreMatrix  NAACODES x NAACODES score matrix
+   \param[in]   engine       Alignment engine (ALIGN_xxx)
+   \return                   The prepared query
+
+   Prepares a query sequence for alignment against the templates with 
+   the native aligner. The query is reversed (the dynamic programming
+   runs in the opposite direction from blAffinealign() so that the 
+   results are the same) and a query profile is built holding the score
+   of each query position against each residue code, together with a
+   profile of the counts (aligned pairs and identical pairs) that 
+   each position adds to an alignment path. For the SIMD engines the 
+   profiles are striped: lane k of vector t holds query position 
+   t + k*segLen
+
+-  17.10.26 Original   By: agent
+*/
+ALIGNQUERY *PrepareAlignQuery(char *seq, int *scoreMatrix, int engine)
+{
+   ALIGNQUERY *query;
+   int        nRows;
+   
+   if((query = (ALIGNQUERY *)malloc(sizeof(ALIGNQUERY)))==NULL)
+      return(NULL);
+
+   query->seqLen    = strlen(seq);
+   query->maxSeqLen = query->seqLen;
+   query->engine    = engine;
+   query->scoreMatrix = scoreMatrix;
+   switch(engine)
+   {
+   case ALIGN_BATCH:           /* Tracebacks are done with AVX2        */
+   case ALIGN_AVX2:
+      query->nLanes = 8;
+      break;
+   case ALIGN_SSE4:
+      query->nLanes = 4;
+      break;
+   default:
+      query->nLanes = 1;
+      break;
+   }
+   nRows          = ((query->seqLen + query->nLanes - 1) / query->nLanes)
+                    * query->nLanes;
+   nRows          = MAX(nRows, query->nLanes);
+   query->codes   = (UBYTE *)malloc((query->seqLen+1) * sizeof(UBYTE));
+   query->profile = (int *)malloc(NAACODES * nRows * sizeof(int));
+   query->matchProfile = (int *)malloc(NAACODES * nRows * sizeof(int));
+   if((query->codes == NULL) || (query->profile == NULL) ||
+      (query->matchProfile == NULL))
+   {
+      FreeAlignQuery(query);
+      return(NULL);
+   }
+
+   ReloadAlignQuery(query, seq);
+   return(query);
+}
+
+
+/************************************************************************/
+/*>void ReloadAlignQuery(ALIGNQUERY *query, char *seq)
+   ---------------------------------------------------
+*//**
+   \param[in,out] query   Query from PrepareAlignQuery()
+   \param[in]     seq     The new query sequence - no longer than the 
+                          sequence the query was prepared with
+
+   Prepares the query for another sequence without reallocating it
+
+-  17.10.26 Original (split from PrepareAlignQuery())   By: agent
+*/
+void ReloadAlignQuery(ALIGNQUERY *query, char *seq)
+{
+   int nRows,
+       i, c;
+
+   query->seq     = seq;
+   query->seqLen  = strlen(seq);
+   query->segLen  = (query->seqLen + query->nLanes - 1) / query->nLanes;
+   if(query->segLen == 0)
+      query->segLen = 1;
+   nRows          = query->segLen * query->nLanes;
+
+   /* Reversed integer-coded query                                      */
+   for(i=0; i<query->seqLen; i++)
+      query->codes[i] = (UBYTE)ResidueCode(seq[query->seqLen - i - 1]);
+   query->codes[query->seqLen] = AACODE_UNKNOWN;
+
+   /* Striped query profile and aligned/identical counts. Padding 
+      positions score zero
+   */
+   for(c=0; c<NAACODES; c++)
+   {
+      int *profile = query->profile + c * nRows,
+          *match   = query->matchProfile + c * nRows;
+      for(i=0; i<nRows; i++)
+         profile[i] = match[i] = 0;
+      for(i=0; i<query->seqLen; i++)
+      {
+         int pos = STRIPEDPOS(i, query->segLen, query->nLanes);
+         profile[pos] = query->scoreMatrix[query->codes[i]*NAACODES + c];
+         match[pos]   = COUNT_ALIGNED;
+         if((query->codes[i] == c) && (c != AACODE_UNKNOWN))
+            match[pos] += COUNT_MATCHED;
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>void FreeAlignQuery(ALIGNQUERY *query)
+   --------------------------------------
+*//**
+   \param[in]   query    Query prepared by PrepareAlignQuery()
+
+   Frees a prepared query
+
+-  17.10.26 Original   By: agent
+*/
+void FreeAlignQuery(ALIGNQUERY *query)
+{
+   if(query != NULL)
+   {
+      FREE(query->codes);
+      FREE(query->profile);
+      FREE(query->matchProfile);
+      free(query);
+   }
+}
+
+
+/************************************************************************/
+/*>ALIGNWORK *AllocAlignWork(ALIGNQUERY *query, int maxTemplateLen)
+   ----------------------------------------------------------------
+*//**
+   \param[in]   query           Prepared query
+   \param[in]   maxTemplateLen  Longest template that will be aligned
+   \return                      Workspace for the alignment
+
+   Allocates the dynamic programming workspace for aligning a query
+   against templates of up to maxTemplateLen residues. This is linear
+   in the sequence lengths; the traceback array is only allocated by
+   NativeAffineAlign() when it is first needed
+
+-  17.10.26 Original   By: agent
+*/
+ALIGNWORK *AllocAlignWork(ALIGNQUERY *query, int maxTemplateLen)
+{
+   ALIGNWORK *work;
+   int       nRows = query->segLen * query->nLanes;
+   
+   if((work = (ALIGNWORK *)malloc(sizeof(ALIGNWORK)))==NULL)
+      return(NULL);
+
+   work->maxTemplateLen = maxTemplateLen;
+   work->maxQueryLen    = query->seqLen;
+   work->maxRows        = nRows;
+   work->buffer  = (int *)malloc((NWORKROWS * nRows + 
+                                  2 * (query->seqLen + maxTemplateLen
+                                       + 2)) *
+                                 sizeof(int));
+   work->dirs    = NULL;
+   work->batch   = NULL;
+   if(query->engine == ALIGN_BATCH)
+   {
+      if((work->batch = (short *)malloc(8 * (query->seqLen + 2) * 
+                                        BATCHLANES * sizeof(short)))
+         == NULL)
+      {
+         FreeAlignWork(work);
+         return(NULL);
+      }
+   }
+   if(work->buffer == NULL)
+   {
+      FreeAlignWork(work);
+      return(NULL);
+   }
+
+   LayoutAlignWork(work, query);
+   return(work);
+}
+
+
+/************************************************************************/
+/*>ALIGNWORK *GrowAlignWork(ALIGNWORK *work, ALIGNQUERY *query,
+                            int maxTemplateLen)
+   ------------------------------------------------------------
+*//**
+   \param[in]   work            Workspace from AllocAlignWork() (or NULL)
+   \param[in]   query           Prepared query
+   \param[in]   maxTemplateLen  Longest template that will be aligned
+   \return                      Workspace for the alignment (NULL on
+                                failure, when work has been freed)
+
+   Reuses a workspace for another query. It is only reallocated if it
+   is too small for the query.
+
+-  17.10.26 Original   By: agent
+*/
+ALIGNWORK *GrowAlignWork(ALIGNWORK *work, ALIGNQUERY *query, 
+                         int maxTemplateLen)
+{
+   if((work != NULL)                                       &&
+      (query->seqLen <= work->maxQueryLen)                 &&
+      (query->segLen * query->nLanes <= work->maxRows)     &&
+      (maxTemplateLen <= work->maxTemplateLen)             &&
+      ((query->engine != ALIGN_BATCH) || (work->batch != NULL)))
+   {
+      LayoutAlignWork(work, query);
+      return(work);
+   }
+
+   FreeAlignWork(work);
+   return(AllocAlignWork(query, maxTemplateLen));
+}
+
+
+/************************************************************************/
+/*>static void LayoutAlignWork(ALIGNWORK *work, ALIGNQUERY *query)
+   ---------------------------------------------------------------
+*//**
+   \param[in,out] work     Workspace big enough for the query
+   \param[in]     query    Prepared query
+
+   Sets up the workspace arrays for the query's striped layout
+
+-  17.10.26 Original   By: agent
+*/
+static void LayoutAlignWork(ALIGNWORK *work, ALIGNQUERY *query)
+{
+   int nRows = query->segLen * query->nLanes,
+       i;
+
+   work->H        = work->buffer;
+   work->Hprev    = work->H      + nRows;
+   work->S1       = work->Hprev  + nRows;
+   work->S1prev   = work->S1     + nRows;
+   work->S2       = work->S1prev + nRows;
+   work->Rc       = work->S2     + nRows;
+   work->Ropen    = work->Rc     + nRows;
+   work->Dc       = work->Ropen  + nRows;
+   work->Rbound   = work->Dc     + nRows;
+   work->Hcnt     = work->Rbound + nRows;
+   work->Hprevcnt = work->Hcnt   + nRows;
+   work->S1cnt    = work->Hprevcnt + nRows;
+   work->S1prevcnt = work->S1cnt + nRows;
+   work->S2cnt    = work->S1prevcnt + nRows;
+   work->Rcnt     = work->S2cnt  + nRows;
+   work->Dcnt     = work->Rcnt   + nRows;
+   work->lastCol  = work->Dcnt   + nRows;
+   work->lastRow  = work->lastCol + query->seqLen + 1;
+   work->lastColCnt = work->lastRow + work->maxTemplateLen + 1;
+   work->lastRowCnt = work->lastColCnt + query->seqLen + 1;
+
+   /* The gap to the right is free (zero) from the first two rows       */
+   for(i=0; i<nRows; i++)
+      work->Rbound[i] = NEGSCORE;
+   for(i=0; (i<2) && (i<query->seqLen); i++)
+      work->Rbound[STRIPEDPOS(i, query->segLen, query->nLanes)] = 0;
+}
+
+
+/************************************************************************/
+/*>void FreeAlignWork(ALIGNWORK *work)
+   -----------------------------------
+*//**
+   \param[in]   work     Workspace from AllocAlignWork()
+
+   Frees an alignment workspace
+
+-  17.10.26 Original   By: agent
+*/
+void FreeAlignWork(ALIGNWORK *work)
+{
+   if(work != NULL)
+   {
+      FREE(work->buffer);
+      FREE(work->dirs);
+      FREE(work->batch);
+      free(work);
+   }
+}
+
+
+/************************************************************************/
+/*>void FillAlignScalar(ALIGNQUERY *query, TEMPLATE *template,
+                        ALIGNWORK *work, BOOL storeDirs)
+   -----------------------------------------------------------
+*//**
+   \param[in]   query      Prepared query (with nLanes==1)
+   \param[in]   template   Template to align against
+   \param[out]  work       Workspace: lastCol, lastRow and their counts
+                           are filled in, as is dirs if storeDirs is set
+   \param[in]   storeDirs  Store the traceback choices
+
+   Scalar version of the dynamic programming fill. This uses the same 
+   recurrence as blAffinealign() but runs forwards over the reversed
+   sequences. With i indexing the (reversed) query and j the (reversed)
+   template:
+
+      H(i,j) = s(i,j) + max(H(i-1,j-1), R(i,j), D(i,j))
+
+   where R is the best score from H(k,j-1) for k<=i-2 less the gap 
+   penalty (GAPOPENPENALTY + (i-k-2)*GAPEXTPENALTY) and D is the same
+   along j. R is zero for i<=1 and D is zero for j<=1 (end gaps are 
+   free). The diagonal wins ties, then D beats R on ties, and the 
+   nearest gap wins ties within R and D. These are the choices made by
+   blAffinealign().
+
+   Alongside each score, the number of aligned and identical residue 
+   pairs on the path leading to it are carried (packed as a count of
+   aligned pairs in the top 16 bits and identical pairs in the bottom
+   16) so that the identity can be had without a traceback. If a 
+   traceback is wanted, the choice at each cell and whether R and D 
+   open a gap are stored in the dirs array for TraceBackAlignment()
+
+-  17.10.26 Original   By: agent
+*/
+void FillAlignScalar(ALIGNQUERY *query, TEMPLATE *template,
+                     ALIGNWORK *work, BOOL storeDirs)
+{
+   int   qLen      = query->seqLen,
+         tLen      = template->seqLen,
+         *H        = work->H,
+         *Hprev    = work->Hprev,
+         *Hprev2   = work->S1,
+         *Dc       = work->Dc,
+         *Hcnt     = work->Hcnt,
+         *Hprevcnt = work->Hprevcnt,
+         *Hprev2cnt = work->S1cnt,
+         *Dcnt     = work->Dcnt,
+         i, j;
+
+   for(i=0; i<qLen; i++)
+   {
+      Hprev[i]    = Hprev2[i]    = Dc[i]   = NEGSCORE;
+      Hprevcnt[i] = Hprev2cnt[i] = Dcnt[i] = 0;
+   }
+   
+   for(j=0; j<tLen; j++)
+   {
+      int   code     = template->codes[tLen-j-1],
+            *profile = query->profile + code * qLen,
+            *match   = query->matchProfile + code * qLen,
+            Rc       = NEGSCORE,
+            Rcnt     = 0,
+            *swap;
+      UBYTE *dirs    = storeDirs?(work->dirs + j * qLen):NULL;
+      
+      for(i=0; i<qLen; i++)
+      {
+         int   dia, Rval, Dval, open, cont;
+         UBYTE dir = 0;
+
+         /* Gap to the right (along the query)                          */
+         open = ((i>1)?Hprev[i-2]:NEGSCORE) - GAPOPENPENALTY;
+         cont = Rc - GAPEXTPENALTY;
+         if(open >= cont)
+         {
+            Rc   = open;
+            Rcnt = (i>1)?Hprevcnt[i-2]:0;
+            dir |= DIR_ROPEN;
+         }
+         else
+         {
+            Rc   = cont;
+         }
+         Rval = (i<=1)?0:Rc;
+
+         /* Gap down (along the template)                               */
+         open = ((i>0)?Hprev2[i-1]:NEGSCORE) - GAPOPENPENALTY;
+         cont = Dc[i] - GAPEXTPENALTY;
+         if(open >= cont)
+         {
+            Dc[i]   = open;
+            Dcnt[i] = (i>0)?Hprev2cnt[i-1]:0;
+            dir    |= DIR_DOPEN;
+         }
+         else
+         {
+            Dc[i]   = cont;
+         }
+         Dval = (j<=1)?0:Dc[i];
+
+         dia  = (i>0)?Hprev[i-1]:NEGSCORE;
+         if(dia >= MAX(Rval, Dval))
+         {
+            H[i]    = dia;
+            Hcnt[i] = (i>0)?Hprevcnt[i-1]:0;
+            dir    |= DIR_DIAG;
+         }
+         else if(Rval > Dval)
+         {
+            H[i]    = Rval;
+            Hcnt[i] = Rcnt;
+            dir    |= DIR_RIGHT;
+         }
+         else
+         {
+            H[i]    = Dval;
+            Hcnt[i] = Dcnt[i];
+            dir    |= DIR_DOWN;
+         }
+         H[i]    += profile[i];
+         Hcnt[i] += match[i];
+         if(dirs != NULL)
+            dirs[i] = dir;
+      }
+
+      work->lastRow[j]    = H[qLen-1];
+      work->lastRowCnt[j] = Hcnt[qLen-1];
+
+      swap      = Hprev2;    Hprev2    = Hprev;    Hprev    = H;    
+      H         = swap;
+      swap      = Hprev2cnt; Hprev2cnt = Hprevcnt; Hprevcnt = Hcnt; 
+      Hcnt      = swap;
+   }
+
+   for(i=0; i<qLen; i++)
+   {
+      work->lastCol[i]    = Hprev[i];
+      work->lastColCnt[i] = Hprevcnt[i];
+   }
+}
+
+
+#ifdef HAVE_X86_SIMD
+/************************************************************************/
+/*>static void FillAlignSSE4(ALIGNQUERY *query, TEMPLATE *template,
+                             ALIGNWORK *work, BOOL storeDirs)
+   ----------------------------------------------------------------
+*//**
+   \param[in]   query      Prepared query (with nLanes==4)
+   \param[in]   template   Template to align against
+   \param[out]  work       Workspace: lastCol, lastRow and their counts
+                           are filled in, as is dirs if storeDirs is set
+   \param[in]   storeDirs  Store the traceback choices
+
+   SSE4.1 striped (Farrar) version of FillAlignScalar(). Each column is
+   processed as segLen vectors of 4 query positions. The diagonal and
+   D terms are element-wise. R within a column depends only on the
+   previous column so is a running maximum down the column; this is 
+   computed a segment at a time and then corrected across segment
+   boundaries with Farrar's lazy-F loop. The aligned/identical counts
+   follow the same choices as the scores.
+
+-  17.10.26 Original   By: agent
+*/
+__attribute__((target("sse4.1")))
+static void FillAlignSSE4(ALIGNQUERY *query, TEMPLATE *template,
+                          ALIGNWORK *work, BOOL storeDirs)
+{
+   int     segLen    = query->segLen,
+           nRows     = segLen * 4,
+           tLen      = template->seqLen,
+           lastPos,
+           *H        = work->H,
+           *Hprev    = work->Hprev,
+           *S1       = work->S1,
+           *S1prev   = work->S1prev,
+           *Hcnt     = work->Hcnt,
+           *Hprevcnt = work->Hprevcnt,
+           *S1cnt    = work->S1cnt,
+           *S1prevcnt = work->S1prevcnt,
+           *swap,
+           i, j, t, pass;
+   __m128i vNeg   = _mm_set1_epi32(NEGSCORE),
+           vOpen  = _mm_set1_epi32(GAPOPENPENALTY),
+           vExt   = _mm_set1_epi32(GAPEXTPENALTY),
+           vOnes  = _mm_set1_epi32(-1),
+           vRight = _mm_set1_epi32(DIR_RIGHT),
+           vDown  = _mm_set1_epi32(DIR_DOWN),
+           vROpen = _mm_set1_epi32(DIR_ROPEN),
+           vDOpen = _mm_set1_epi32(DIR_DOPEN);
+
+   lastPos = STRIPEDPOS(query->seqLen-1, segLen, 4);
+   for(i=0; i<nRows; i++)
+   {
+      Hprev[i]    = S1prev[i]    = work->Dc[i]   = NEGSCORE;
+      Hprevcnt[i] = S1prevcnt[i] = work->Dcnt[i] = 0;
+   }
+
+   for(j=0; j<tLen; j++)
+   {
+      int     code     = template->codes[tLen-j-1],
+              *profile = query->profile + code * nRows,
+              *match   = query->matchProfile + code * nRows;
+      UBYTE   *dirs    = storeDirs?(work->dirs + j * nRows):NULL;
+      __m128i vCarry, vCarryCnt, vDZero;
+
+      /* Shift the previous column down one row (S1) and two rows (S2) */
+      vCarry = _mm_loadu_si128((__m128i *)(Hprev + (segLen-1)*4));
+      vCarry = _mm_insert_epi32(_mm_slli_si128(vCarry, 4), NEGSCORE, 0);
+      _mm_storeu_si128((__m128i *)S1, vCarry);
+      memcpy(S1+4, Hprev, (segLen-1)*4*sizeof(int));
+      vCarry = _mm_loadu_si128((__m128i *)(S1 + (segLen-1)*4));
+      vCarry = _mm_insert_epi32(_mm_slli_si128(vCarry, 4), NEGSCORE, 0);
+      _mm_storeu_si128((__m128i *)work->S2, vCarry);
+      memcpy(work->S2+4, S1, (segLen-1)*4*sizeof(int));
+
+      /* and the same for the counts, shifting in zeros                */
+      vCarry = _mm_loadu_si128((__m128i *)(Hprevcnt + (segLen-1)*4));
+      _mm_storeu_si128((__m128i *)S1cnt, _mm_slli_si128(vCarry, 4));
+      memcpy(S1cnt+4, Hprevcnt, (segLen-1)*4*sizeof(int));
+      vCarry = _mm_loadu_si128((__m128i *)(S1cnt + (segLen-1)*4));
+      _mm_storeu_si128((__m128i *)work->S2cnt, _mm_slli_si128(vCarry, 4));
+      memcpy(work->S2cnt+4, S1cnt, (segLen-1)*4*sizeof(int));
+
+      /* Running maximum for R down each segment                        */
+      vCarry    = vNeg;
+      vCarryCnt = _mm_setzero_si128();
+      for(t=0; t<segLen; t++)
+      {
+         __m128i vO, vC, vMask;
+         vO        = _mm_sub_epi32(_mm_loadu_si128((__m128i *)
+                                                (work->S2 + t*4)), vOpen);
+         vC        = _mm_sub_epi32(vCarry, vExt);
+         vMask     = _mm_cmpgt_epi32(vC, vO);
+         vCarry    = _mm_max_epi32(vO, vC);
+         vCarryCnt = _mm_blendv_epi8(_mm_loadu_si128((__m128i *)
+                                                  (work->S2cnt + t*4)),
+                                     vCarryCnt, vMask);
+         _mm_storeu_si128((__m128i *)(work->Rc + t*4), vCarry);
+         _mm_storeu_si128((__m128i *)(work->Rcnt + t*4), vCarryCnt);
+         _mm_storeu_si128((__m128i *)(work->Ropen + t*4), 
+                          _mm_andnot_si128(vMask, vOnes));
+      }
+
+      /* Lazy-F correction across the segment boundaries               */
+      for(pass=0; pass<4; pass++)
+      {
+         vCarry    = _mm_loadu_si128((__m128i *)
+                                     (work->Rc + (segLen-1)*4));
+         vCarry    = _mm_insert_epi32(_mm_slli_si128(vCarry, 4), 
+                                      NEGSCORE, 0);
+         vCarryCnt = _mm_loadu_si128((__m128i *)
+                                     (work->Rcnt + (segLen-1)*4));
+         vCarryCnt = _mm_slli_si128(vCarryCnt, 4);
+         for(t=0; t<segLen; t++)
+         {
+            __m128i vR, vC, vMask;
+            vC    = _mm_sub_epi32(vCarry, vExt);
+            vR    = _mm_loadu_si128((__m128i *)(work->Rc + t*4));
+            vMask = _mm_cmpgt_epi32(vC, vR);
+            if(!_mm_movemask_epi8(vMask))
+               goto rDone;
+            vCarry    = _mm_blendv_epi8(vR, vC, vMask);
+            vCarryCnt = _mm_blendv_epi8(_mm_loadu_si128((__m128i *)
+                                                   (work->Rcnt + t*4)),
+                                        vCarryCnt, vMask);
+            _mm_storeu_si128((__m128i *)(work->Rc + t*4), vCarry);
+            _mm_storeu_si128((__m128i *)(work->Rcnt + t*4), vCarryCnt);
+            _mm_storeu_si128((__m128i *)(work->Ropen + t*4),
+                             _mm_andnot_si128(vMask, 
+                                 _mm_loadu_si128((__m128i *)
+                                                 (work->Ropen + t*4))));
+         }
+      }
+   rDone:
+
+      /* D is free for the first two columns                           */
+      vDZero = (j<=1)?vOnes:_mm_setzero_si128();
+      
+      for(t=0; t<segLen; t++)
+      {
+         __m128i vDia, vR, vD, vO, vC, vDCont, vM, vNotDia, vRWins, vH,
+                 vDCnt, vHCnt;
+
+         /* D - gap down from the column before last                   */
+         vO     = _mm_sub_epi32(_mm_loadu_si128((__m128i *)
+                                                (S1prev + t*4)), vOpen);
+         vC     = _mm_sub_epi32(_mm_loadu_si128((__m128i *)
+                                                (work->Dc + t*4)), vExt);
+         vDCont = _mm_cmpgt_epi32(vC, vO);
+         vD     = _mm_max_epi32(vO, vC);
+         vDCnt  = _mm_blendv_epi8(_mm_loadu_si128((__m128i *)
+                                                  (S1prevcnt + t*4)),
+                                  _mm_loadu_si128((__m128i *)
+                                                  (work->Dcnt + t*4)),
+                                  vDCont);
+         _mm_storeu_si128((__m128i *)(work->Dc + t*4), vD);
+         _mm_storeu_si128((__m128i *)(work->Dcnt + t*4), vDCnt);
+         vD     = _mm_andnot_si128(vDZero, vD);
+
+         /* R - zero in the first two rows                             */
+         vR     = _mm_max_epi32(_mm_loadu_si128((__m128i *)
+                                                (work->Rc + t*4)),
+                                _mm_loadu_si128((__m128i *)
+                                                (work->Rbound + t*4)));
+
+         /* Choose between the diagonal, R and D                       */
+         vDia    = _mm_loadu_si128((__m128i *)(S1 + t*4));
+         vM      = _mm_max_epi32(vR, vD);
+         vNotDia = _mm_cmpgt_epi32(vM, vDia);
+         vRWins  = _mm_cmpgt_epi32(vR, vD);
+         vH      = _mm_blendv_epi8(vDia, 
+                                   _mm_blendv_epi8(vD, vR, vRWins),
+                                   vNotDia);
+         vH      = _mm_add_epi32(vH, _mm_loadu_si128((__m128i *)
+                                                     (profile + t*4)));
+         _mm_storeu_si128((__m128i *)(H + t*4), vH);
+         vHCnt   = _mm_blendv_epi8(_mm_loadu_si128((__m128i *)
+                                                   (S1cnt + t*4)),
+                                   _mm_blendv_epi8(vDCnt, 
+                                      _mm_loadu_si128((__m128i *)
+                                                      (work->Rcnt + t*4)),
+                                                   vRWins),
+                                   vNotDia);
+         vHCnt   = _mm_add_epi32(vHCnt, _mm_loadu_si128((__m128i *)
+                                                        (match + t*4)));
+         _mm_storeu_si128((__m128i *)(Hcnt + t*4), vHCnt);
+
+         /* Traceback information                                      */
+         if(dirs != NULL)
+         {
+            __m128i vDir;
+            int     packed;
+            
+            vDir = _mm_and_si128(vNotDia, 
+                                 _mm_blendv_epi8(vDown, vRight, vRWins));
+            vDir = _mm_or_si128(vDir, 
+                                _mm_and_si128(_mm_loadu_si128((__m128i *)
+                                                 (work->Ropen + t*4)),
+                                              vROpen));
+            vDir = _mm_or_si128(vDir, _mm_andnot_si128(vDCont, vDOpen));
+            vDir = _mm_packus_epi32(vDir, vDir);
+            vDir = _mm_packus_epi16(vDir, vDir);
+            packed = _mm_cvtsi128_si32(vDir);
+            memcpy(dirs + t*4, &packed, 4);
+         }
+      }
+
+      work->lastRow[j]    = H[lastPos];
+      work->lastRowCnt[j] = Hcnt[lastPos];
+
+      swap = Hprev;     Hprev     = H;     H     = swap;
+      swap = S1prev;    S1prev    = S1;    S1    = swap;
+      swap = Hprevcnt;  Hprevcnt  = Hcnt;  Hcnt  = swap;
+      swap = S1prevcnt; S1prevcnt = S1cnt; S1cnt = swap;
+   }
+
+   for(i=0; i<query->seqLen; i++)
+   {
+      work->lastCol[i]    = Hprev[STRIPEDPOS(i, segLen, 4)];
+      work->lastColCnt[i] = Hprevcnt[STRIPEDPOS(i, segLen, 4)];
+   }
+}
+
+
+/************************************************************************/
+/*>static void FillAlignAVX2(ALIGNQUERY *query, TEMPLATE *template,
+                             ALIGNWORK *work, BOOL storeDirs)
+   ----------------------------------------------------------------
+*//**
+   \param[in]   query      Prepared query (with nLanes==8)
+   \param[in]   template   Template to align against
+   \param[out]  work       Workspace: lastCol, lastRow and their counts
+                           are filled in, as is dirs if storeDirs is set
+   \param[in]   storeDirs  Store the traceback choices
+
+   AVX2 version of FillAlignSSE4() working on 8 query positions at a
+   time.
+
+-  17.10.26 Original   By: agent
+*/
+__attribute__((target("avx2")))
+static void FillAlignAVX2(ALIGNQUERY *query, TEMPLATE *template,
+                          ALIGNWORK *work, BOOL storeDirs)
+{
+   int     segLen    = query->segLen,
+           nRows     = segLen * 8,
+           tLen      = template->seqLen,
+           lastPos,
+           *H        = work->H,
+           *Hprev    = work->Hprev,
+           *S1       = work->S1,
+           *S1prev   = work->S1prev,
+           *Hcnt     = work->Hcnt,
+           *Hprevcnt = work->Hprevcnt,
+           *S1cnt    = work->S1cnt,
+           *S1prevcnt = work->S1prevcnt,
+           *swap,
+           i, j, t, pass;
+   __m256i vNeg   = _mm256_set1_epi32(NEGSCORE),
+           vZero  = _mm256_setzero_si256(),
+           vOpen  = _mm256_set1_epi32(GAPOPENPENALTY),
+           vExt   = _mm256_set1_epi32(GAPEXTPENALTY),
+           vOnes  = _mm256_set1_epi32(-1),
+           vRight = _mm256_set1_epi32(DIR_RIGHT),
+           vDown  = _mm256_set1_epi32(DIR_DOWN),
+           vROpen = _mm256_set1_epi32(DIR_ROPEN),
+           vDOpen = _mm256_set1_epi32(DIR_DOPEN),
+           vShift = _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6);
+
+   lastPos = STRIPEDPOS(query->seqLen-1, segLen, 8);
+   for(i=0; i<nRows; i++)
+   {
+      Hprev[i]    = S1prev[i]    = work->Dc[i]   = NEGSCORE;
+      Hprevcnt[i] = S1prevcnt[i] = work->Dcnt[i] = 0;
+   }
+
+   for(j=0; j<tLen; j++)
+   {
+      int     code     = template->codes[tLen-j-1],
+              *profile = query->profile + code * nRows,
+              *match   = query->matchProfile + code * nRows;
+      UBYTE   *dirs    = storeDirs?(work->dirs + j * nRows):NULL;
+      __m256i vCarry, vCarryCnt, vDZero;
+
+      /* Shift the previous column down one row (S1) and two rows (S2) */
+      vCarry = _mm256_loadu_si256((__m256i *)(Hprev + (segLen-1)*8));
+      vCarry = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(vCarry,
+                                                              vShift),
+                                  vNeg, 0x01);
+      _mm256_storeu_si256((__m256i *)S1, vCarry);
+      memcpy(S1+8, Hprev, (segLen-1)*8*sizeof(int));
+      vCarry = _mm256_loadu_si256((__m256i *)(S1 + (segLen-1)*8));
+      vCarry = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(vCarry,
+                                                              vShift),
+                                  vNeg, 0x01);
+      _mm256_storeu_si256((__m256i *)work->S2, vCarry);
+      memcpy(work->S2+8, S1, (segLen-1)*8*sizeof(int));
+
+      /* and the same for the counts, shifting in zeros                */
+      vCarry = _mm256_loadu_si256((__m256i *)(Hprevcnt + (segLen-1)*8));
+      vCarry = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(vCarry,
+                                                              vShift),
+                                  vZero, 0x01);
+      _mm256_storeu_si256((__m256i *)S1cnt, vCarry);
+      memcpy(S1cnt+8, Hprevcnt, (segLen-1)*8*sizeof(int));
+      vCarry = _mm256_loadu_si256((__m256i *)(S1cnt + (segLen-1)*8));
+      vCarry = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(vCarry,
+                                                              vShift),
+                                  vZero, 0x01);
+      _mm256_storeu_si256((__m256i *)work->S2cnt, vCarry);
+      memcpy(work->S2cnt+8, S1cnt, (segLen-1)*8*sizeof(int));
+
+      /* Running maximum for R down each segment                        */
+      vCarry    = vNeg;
+      vCarryCnt = vZero;
+      for(t=0; t<segLen; t++)
+      {
+         __m256i vO, vC, vMask;
+         vO        = _mm256_sub_epi32(_mm256_loadu_si256((__m256i *)
+                                                (work->S2 + t*8)), vOpen);
+         vC        = _mm256_sub_epi32(vCarry, vExt);
+         vMask     = _mm256_cmpgt_epi32(vC, vO);
+         vCarry    = _mm256_max_epi32(vO, vC);
+         vCarryCnt = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i *)
+                                                (work->S2cnt + t*8)),
+                                        vCarryCnt, vMask);
+         _mm256_storeu_si256((__m256i *)(work->Rc + t*8), vCarry);
+         _mm256_storeu_si256((__m256i *)(work->Rcnt + t*8), vCarryCnt);
+         _mm256_storeu_si256((__m256i *)(work->Ropen + t*8), 
+                             _mm256_andnot_si256(vMask, vOnes));
+      }
+
+      /* Lazy-F correction across the segment boundaries               */
+      for(pass=0; pass<8; pass++)
+      {
+         vCarry    = _mm256_loadu_si256((__m256i *)
+                                        (work->Rc + (segLen-1)*8));
+         vCarry    = _mm256_blend_epi32(
+                        _mm256_permutevar8x32_epi32(vCarry, vShift),
+                        vNeg, 0x01);
+         vCarryCnt = _mm256_loadu_si256((__m256i *)
+                                        (work->Rcnt + (segLen-1)*8));
+         vCarryCnt = _mm256_blend_epi32(
+                        _mm256_permutevar8x32_epi32(vCarryCnt, vShift),
+                        vZero, 0x01);
+         for(t=0; t<segLen; t++)
+         {
+            __m256i vR, vC, vMask;
+            vC    = _mm256_sub_epi32(vCarry, vExt);
+            vR    = _mm256_loadu_si256((__m256i *)(work->Rc + t*8));
+            vMask = _mm256_cmpgt_epi32(vC, vR);
+            if(!_mm256_movemask_epi8(vMask))
+               goto rDone;
+            vCarry    = _mm256_blendv_epi8(vR, vC, vMask);
+            vCarryCnt = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i *)
+                                                   (work->Rcnt + t*8)),
+                                           vCarryCnt, vMask);
+            _mm256_storeu_si256((__m256i *)(work->Rc + t*8), vCarry);
+            _mm256_storeu_si256((__m256i *)(work->Rcnt + t*8), 
+                                vCarryCnt);
+            _mm256_storeu_si256((__m256i *)(work->Ropen + t*8),
+                                _mm256_andnot_si256(vMask, 
+                                    _mm256_loadu_si256((__m256i *)
+                                                (work->Ropen + t*8))));
+         }
+      }
+   rDone:
+
+      /* D is free for the first two columns                           */
+      vDZero = (j<=1)?vOnes:vZero;
+      
+      for(t=0; t<segLen; t++)
+      {
+         __m256i vDia, vR, vD, vO, vC, vDCont, vM, vNotDia, vRWins, vH,
+                 vDCnt, vHCnt;
+
+         /* D - gap down from the column before last                   */
+         vO     = _mm256_sub_epi32(_mm256_loadu_si256((__m256i *)
+                                                (S1prev + t*8)), vOpen);
+         vC     = _mm256_sub_epi32(_mm256_loadu_si256((__m256i *)
+                                                (work->Dc + t*8)), vExt);
+         vDCont = _mm256_cmpgt_epi32(vC, vO);
+         vD     = _mm256_max_epi32(vO, vC);
+         vDCnt  = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i *)
+                                                (S1prevcnt + t*8)),
+                                     _mm256_loadu_si256((__m256i *)
+                                                (work->Dcnt + t*8)),
+                                     vDCont);
+         _mm256_storeu_si256((__m256i *)(work->Dc + t*8), vD);
+         _mm256_storeu_si256((__m256i *)(work->Dcnt + t*8), vDCnt);
+         vD     = _mm256_andnot_si256(vDZero, vD);
+
+         /* R - zero in the first two rows                             */
+         vR     = _mm256_max_epi32(_mm256_loadu_si256((__m256i *)
+                                                (work->Rc + t*8)),
+                                   _mm256_loadu_si256((__m256i *)
+                                                (work->Rbound + t*8)));
+
+         /* Choose between the diagonal, R and D                       */
+         vDia    = _mm256_loadu_si256((__m256i *)(S1 + t*8));
+         vM      = _mm256_max_epi32(vR, vD);
+         vNotDia = _mm256_cmpgt_epi32(vM, vDia);
+         vRWins  = _mm256_cmpgt_epi32(vR, vD);
+         vH      = _mm256_blendv_epi8(vDia, 
+                                      _mm256_blendv_epi8(vD, vR, vRWins),
+                                      vNotDia);
+         vH      = _mm256_add_epi32(vH, _mm256_loadu_si256((__m256i *)
+                                                     (profile + t*8)));
+         _mm256_storeu_si256((__m256i *)(H + t*8), vH);
+         vHCnt   = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i *)
+                                                   (S1cnt + t*8)),
+                                      _mm256_blendv_epi8(vDCnt, 
+                                         _mm256_loadu_si256((__m256i *)
+                                                   (work->Rcnt + t*8)),
+                                                         vRWins),
+                                      vNotDia);
+         vHCnt   = _mm256_add_epi32(vHCnt, _mm256_loadu_si256((__m256i *)
+                                                        (match + t*8)));
+         _mm256_storeu_si256((__m256i *)(Hcnt + t*8), vHCnt);
+
+         /* Traceback information - pack the 8 lanes to bytes          */
+         if(dirs != NULL)
+         {
+            __m256i vDir;
+            int     packed;
+
+            vDir = _mm256_and_si256(vNotDia, 
+                                    _mm256_blendv_epi8(vDown, vRight, 
+                                                       vRWins));
+            vDir = _mm256_or_si256(vDir, 
+                                   _mm256_and_si256(_mm256_loadu_si256(
+                                         (__m256i *)(work->Ropen + t*8)),
+                                                    vROpen));
+            vDir = _mm256_or_si256(vDir, 
+                                   _mm256_andnot_si256(vDCont, vDOpen));
+            vDir = _mm256_packus_epi32(vDir, vDir);
+            vDir = _mm256_packus_epi16(vDir, vDir);
+            packed = _mm_cvtsi128_si32(_mm256_castsi256_si128(vDir));
+            memcpy(dirs + t*8, &packed, 4);
+            packed = _mm_cvtsi128_si32(_mm256_extracti128_si256(vDir, 1));
+            memcpy(dirs + t*8 + 4, &packed, 4);
+         }
+      }
+
+      work->lastRow[j]    = H[lastPos];
+      work->lastRowCnt[j] = Hcnt[lastPos];
+
+      swap = Hprev;     Hprev     = H;     H     = swap;
+      swap = S1prev;    S1prev    = S1;    S1    = swap;
+      swap = Hprevcnt;  Hprevcnt  = Hcnt;  Hcnt  = swap;
+      swap = S1prevcnt; S1prevcnt = S1cnt; S1cnt = swap;
+   }
+
+   for(i=0; i<query->seqLen; i++)
+   {
+      work->lastCol[i]    = Hprev[STRIPEDPOS(i, segLen, 8)];
+      work->lastColCnt[i] = Hprevcnt[STRIPEDPOS(i, segLen, 8)];
+   }
+}
+#endif
+
+
+/************************************************************************/
+/*>static void FillAlign(ALIGNQUERY *query, TEMPLATE *template,
+                         ALIGNWORK *work, BOOL storeDirs)
+   ------------------------------------------------------------
+*//**
+   \param[in]   query      Prepared query
+   \param[in]   template   Template to align against
+   \param[out]  work       Workspace
+   \param[in]   storeDirs  Store the traceback choices
+
+   Runs the fill with the engine the query was prepared for
+
+-  17.10.26 Original   By: agent
+*/
+static void FillAlign(ALIGNQUERY *query, TEMPLATE *template,
+                      ALIGNWORK *work, BOOL storeDirs)
+{
+   switch(query->engine)
+   {
+#ifdef HAVE_X86_SIMD
+   case ALIGN_BATCH:
+   case ALIGN_AVX2:
+      FillAlignAVX2(query, template, work, storeDirs);
+      break;
+   case ALIGN_SSE4:
+      FillAlignSSE4(query, template, work, storeDirs);
+      break;
+#endif
+   default:
+      FillAlignScalar(query, template, work, storeDirs);
+      break;
+   }
+}
+
+
+/************************************************************************/
+/*>static int FindBestCell(ALIGNQUERY *query, TEMPLATE *template,
+                           ALIGNWORK *work, int *pBestI, int *pBestJ,
+                           int *pCounts)
+   --------------------------------------------------------------
+*//**
+   \param[in]   query      Prepared query
+   \param[in]   template   Template that was aligned
+   \param[in]   work       Workspace filled by one of the FillAlign
+                           routines
+   \param[out]  pBestI     Query position of the best cell
+   \param[out]  pBestJ     Template position of the best cell
+   \param[out]  pCounts    Packed aligned/identical counts for the path
+                           ending at the best cell
+   \return                 Best score
+
+   Finds the best scoring cell in the last row or column, preferring
+   the same cell as blAffinealign() on ties - the last column is 
+   searched first and both are searched from the end
+
+-  17.10.26 Original   By: agent
+*/
+static int FindBestCell(ALIGNQUERY *query, TEMPLATE *template,
+                        ALIGNWORK *work, int *pBestI, int *pBestJ,
+                        int *pCounts)
+{
+   int qLen = query->seqLen,
+       tLen = template->seqLen,
+       best,
+       i, j;
+   
+   *pBestI = qLen-1;
+   *pBestJ = tLen-1;
+   best     = work->lastCol[qLen-1];
+   *pCounts = work->lastColCnt[qLen-1];
+   for(i=qLen-1; i>=0; i--)
+   {
+      if(work->lastCol[i] > best)
+      {
+         best     = work->lastCol[i];
+         *pCounts = work->lastColCnt[i];
+         *pBestI  = i;
+         *pBestJ  = tLen-1;
+      }
+   }
+   for(j=tLen-1; j>=0; j--)
+   {
+      if(work->lastRow[j] > best)
+      {
+         best     = work->lastRow[j];
+         *pCounts = work->lastRowCnt[j];
+         *pBestI  = qLen-1;
+         *pBestJ  = j;
+      }
+   }
+
+   return(best);
+}
+
+
+/************************************************************************/
+/*>int NativeAffineAlign(ALIGNQUERY *query, TEMPLATE *template,
+                         ALIGNWORK *work, char *align1, char *align2,
+                         int *alignLen)
+   ------------------------------------------------------------
+*//**
+   \param[in]   query      Prepared query
+   \param[in]   template   Template to align against
+   \param[in]   work       Workspace from AllocAlignWork()
+   \param[out]  align1     Alignment of the query
+   \param[out]  align2     Alignment of the template
+   \param[out]  alignLen   Length of the alignment
+   \return                 Alignment score
+
+   Native replacement for blAffinealign() with GAPOPENPENALTY and
+   GAPEXTPENALTY using the integer-coded score matrix. Runs the fill
+   with the engine the query was prepared for and then traces back.
+   Gives the same alignment as blAffinealign().
+
+-  17.10.26 Original   By: agent
+*/
+int NativeAffineAlign(ALIGNQUERY *query, TEMPLATE *template,
+                      ALIGNWORK *work, char *align1, char *align2,
+                      int *alignLen)
+{
+   *alignLen = 0;
+   if((query->seqLen == 0) || (template->seqLen == 0) ||
+      (template->seqLen > work->maxTemplateLen))
+      return(0);
+
+   if(work->dirs == NULL)
+   {
+      if((work->dirs = (UBYTE *)malloc(work->maxTemplateLen * 
+                                       work->maxRows *
+                                       sizeof(UBYTE)))==NULL)
+         return(0);
+   }
+
+   FillAlign(query, template, work, TRUE);
+   return(TraceBackAlignment(query, template, work, 
+                             align1, align2, alignLen));
+}
+
+
+/************************************************************************/
+/*>REAL ScoreAlignment(ALIGNQUERY *query, TEMPLATE *template, 
+                       ALIGNWORK *work)
+   ----------------------------------------------------------
+*//**
+   \param[in]   query      Prepared query
+   \param[in]   template   Template to align against
+   \param[in]   work       Workspace from AllocAlignWork()
+   \return                 Identity over the aligned residues
+
+   Score-only version of CompareSeqs(). The fill is run without storing
+   the traceback and the numbers of aligned and identical residue pairs
+   are taken from the counts carried with the best cell. Gives the same
+   score as ScoreAlignedResidues() on the alignment from 
+   NativeAffineAlign() (residues are compared by their integer codes,
+   which is the same for upper case sequences).
+
+-  17.10.26 Original   By: agent
+*/
+REAL ScoreAlignment(ALIGNQUERY *query, TEMPLATE *template, 
+                    ALIGNWORK *work)
+{
+   int bestI, bestJ,
+       counts,
+       nAligned, nMatched;
+   
+   if((query->seqLen == 0) || (template->seqLen == 0) ||
+      (template->seqLen > work->maxTemplateLen))
+      return((REAL)0.0);
+   
+   FillAlign(query, template, work, FALSE);
+   FindBestCell(query, template, work, &bestI, &bestJ, &counts);
+   nAligned = counts / COUNT_ALIGNED;
+   nMatched = counts % COUNT_ALIGNED;
+
+   if(nAligned < MINSEQLEN)
+      return((REAL)0.0);
+   
+   return((REAL)nMatched/(REAL)nAligned);
+}
+
+
+/************************************************************************/
+/*>int TraceBackAlignment(ALIGNQUERY *query, TEMPLATE *template,
+                          ALIGNWORK *work, char *align1, char *align2,
+                          int *alignLen)
+   -------------------------------------------------------------
+*//**
+   \param[in]   query      Prepared query
+   \param[in]   template   Template that was aligned
+   \param[in]   work       Workspace filled by one of the FillAlign
+                           routines
+   \param[out]  align1     Alignment of the query
+   \param[out]  align2     Alignment of the template
+   \param[out]  alignLen   Length of the alignment
+   \return                 Alignment score
+
+   Starts from the best scoring cell in the last row or column and 
+   traces back through the stored choices. Unaligned ends are included with gaps opposite,
+   as with blAffinealign().
+
+-  17.10.26 Original   By: agent
+*/
+int TraceBackAlignment(ALIGNQUERY *query, TEMPLATE *template,
+                       ALIGNWORK *work, char *align1, char *align2,
+                       int *alignLen)
+{
+   int   qLen   = query->seqLen,
+         tLen   = template->seqLen,
+         segLen = query->segLen,
+         nLanes = query->nLanes,
+         nRows  = segLen * nLanes,
+         best, bestI, bestJ, counts,
+         i, j, k,
+         n = 0;
+   char  *qSeq  = query->seq,
+         *tSeq  = template->seq;
+   UBYTE *dirs  = work->dirs;
+
+   best = FindBestCell(query, template, work, &bestI, &bestJ, &counts);
+
+   /* Unaligned residues at the start                                   */
+   for(i=qLen-1; i>bestI; i--)
+   {
+      align1[n]   = qSeq[qLen-i-1];
+      align2[n++] = '-';
+   }
+   for(j=tLen-1; j>bestJ; j--)
+   {
+      align1[n]   = '-';
+      align2[n++] = tSeq[tLen-j-1];
+   }
+
+   /* Trace back                                                        */
+   i = bestI;
+   j = bestJ;
+   while(TRUE)
+   {
+      UBYTE dir = dirs[j*nRows + STRIPEDPOS(i, segLen, nLanes)];
+      
+      align1[n]   = qSeq[qLen-i-1];
+      align2[n++] = tSeq[tLen-j-1];
+
+      if((dir & DIR_CHOICE) == DIR_DIAG)
+      {
+         i--;
+         j--;
+      }
+      else if((dir & DIR_CHOICE) == DIR_RIGHT)
+      {
+         if(i <= 1)
+            break;
+         for(k=i; !(dirs[j*nRows + STRIPEDPOS(k, segLen, nLanes)] &
+                    DIR_ROPEN); k--);
+         for(i--; i>k-2; i--)
+         {
+            align1[n]   = qSeq[qLen-i-1];
+            align2[n++] = '-';
+         }
+         j--;
+      }
+      else
+      {
+         if(j <= 1)
+            break;
+         for(k=j; !(dirs[k*nRows + STRIPEDPOS(i, segLen, nLanes)] &
+                    DIR_DOPEN); k--);
+         for(j--; j>k-2; j--)
+         {
+            align1[n]   = '-';
+            align2[n++] = tSeq[tLen-j-1];
+         }
+         i--;
+      }
+   }
+
+   /* Unaligned residues at the end                                     */
+   for(i--; i>=0; i--)
+   {
+      align1[n]   = qSeq[qLen-i-1];
+      align2[n++] = '-';
+   }
+   for(j--; j>=0; j--)
+   {
+      align1[n]   = '-';
+      align2[n++] = tSeq[tLen-j-1];
+   }
+
+   *alignLen = n;
+   return(best);
+}
+
+
+/************************************************************************/
+/*>static int CompareBatchEntries(const void *a, const void *b)
+   ------------------------------------------------------------
+*//**
+   qsort() comparison for BATCHENTRYs - sorts on template length and 
+   then on position in the candidate list
+
+-  17.10.26 Original   By: agent
+*/
+static int CompareBatchEntries(const void *a, const void *b)
+{
+   BATCHENTRY *e1 = (BATCHENTRY *)a,
+              *e2 = (BATCHENTRY *)b;
+
+   if(e1->template->seqLen != e2->template->seqLen)
+      return((e1->template->seqLen < e2->template->seqLen)?-1:1);
+   return(e1->candidate - e2->candidate);
+}
+
+
+#ifdef HAVE_X86_SIMD
+/************************************************************************/
+/*>static void ScoreBatchAVX2(ALIGNQUERY *query, TEMPLATE **batch, 
+                              int nBatch, ALIGNWORK *work, REAL *scores)
+   ---------------------------------------------------------------------
+*//**
+   \param[in]   query      Prepared query
+   \param[in]   batch      Up to BATCHLANES templates (each no longer
+                           than BATCHMAXLEN)
+   \param[in]   nBatch     Number of templates in the batch
+   \param[in]   work       Workspace from AllocAlignWork()
+   \param[out]  scores     Identity score for each template
+
+   Inter-sequence version of ScoreAlignment(). Each 16-bit lane runs the
+   recurrence of FillAlignScalar() for a different template against the
+   same query, so the query is processed a residue at a time and the
+   score of that residue against the current residue of each template
+   is a single load from a column profile built as the templates are
+   stepped through. Scores use saturating arithmetic (the minus 
+   infinity sentinel stays put); the aligned and identical counts are
+   packed into 8 bits each, which is why templates are limited to 
+   BATCHMAXLEN residues.
+
+   Templates shorter than the longest in the batch finish early; the
+   last column for a template is searched for its best cell at the
+   column where it finishes. Ties are resolved as in FindBestCell().
+
+-  17.10.26 Original   By: agent
+*/
+__attribute__((target("avx2")))
+static void ScoreBatchAVX2(ALIGNQUERY *query, TEMPLATE **batch, 
+                           int nBatch, ALIGNWORK *work, REAL *scores)
+{
+   int     qLen      = query->seqLen,
+           maxLen    = 0,
+           stride    = qLen + 2,
+           lane, i, j, c;
+   short   *H        = work->batch,
+           *Hprev    = H         + stride * BATCHLANES,
+           *Hprev2   = Hprev     + stride * BATCHLANES,
+           *Dc       = Hprev2    + stride * BATCHLANES,
+           *Hcnt     = Dc        + stride * BATCHLANES,
+           *Hprevcnt = Hcnt      + stride * BATCHLANES,
+           *Hprev2cnt = Hprevcnt + stride * BATCHLANES,
+           *Dcnt     = Hprev2cnt + stride * BATCHLANES,
+           *swap,
+           lens[BATCHLANES],
+           profile[NAACODES * BATCHLANES],
+           match[NAACODES * BATCHLANES],
+           colBest[BATCHLANES],    colBestCnt[BATCHLANES],
+           rowBest[BATCHLANES],    rowBestCnt[BATCHLANES];
+   __m256i vNeg   = _mm256_set1_epi16(NEGSCORE16),
+           vZero  = _mm256_setzero_si256(),
+           vOpen  = _mm256_set1_epi16(GAPOPENPENALTY),
+           vExt   = _mm256_set1_epi16(GAPEXTPENALTY),
+           vLens, vRowBest, vRowBestCnt, vColBest, vColBestCnt;
+
+   for(lane=0; lane<BATCHLANES; lane++)
+   {
+      lens[lane] = (short)((lane < nBatch)?batch[lane]->seqLen:0);
+      if(lens[lane] > maxLen)
+         maxLen = lens[lane];
+   }
+   vLens       = _mm256_loadu_si256((__m256i *)lens);
+   vRowBest    = vColBest    = vNeg;
+   vRowBestCnt = vColBestCnt = vZero;
+
+   /* Rows -2 and -1 are never written and act as the boundary         */
+   for(i=0; i<stride*BATCHLANES; i++)
+   {
+      H[i]    = Hprev[i]    = Hprev2[i]    = Dc[i]   = NEGSCORE16;
+      Hcnt[i] = Hprevcnt[i] = Hprev2cnt[i] = Dcnt[i] = 0;
+   }
+   
+   for(j=0; j<maxLen; j++)
+   {
+      __m256i vRc, vRcnt, vMask;
+
+      /* Column profile - each query residue code against this column's
+         residue in each template
+      */
+      for(lane=0; lane<BATCHLANES; lane++)
+      {
+         int code = (j < lens[lane])?
+                    batch[lane]->codes[lens[lane]-j-1]:AACODE_UNKNOWN;
+         for(c=0; c<NAACODES; c++)
+         {
+            profile[c*BATCHLANES + lane] = 
+               (short)query->scoreMatrix[c * NAACODES + code];
+            match[c*BATCHLANES + lane] = (short)BATCH_COUNT_ALIGNED;
+            if((c == code) && (c != AACODE_UNKNOWN))
+               match[c*BATCHLANES + lane] += BATCH_COUNT_MATCHED;
+         }
+      }
+
+      vRc   = vNeg;
+      vRcnt = vZero;
+      for(i=0; i<qLen; i++)
+      {
+         short   *cur   = H        + (i+2) * BATCHLANES,
+                 *curC  = Hcnt     + (i+2) * BATCHLANES,
+                 *prev  = Hprev    + (i+2) * BATCHLANES,
+                 *prevC = Hprevcnt + (i+2) * BATCHLANES,
+                 *prev2 = Hprev2   + (i+2) * BATCHLANES,
+                 *prev2C = Hprev2cnt + (i+2) * BATCHLANES,
+                 *dc    = Dc       + (i+2) * BATCHLANES,
+                 *dcC   = Dcnt     + (i+2) * BATCHLANES;
+         int     code   = query->codes[i];
+         __m256i vO, vC, vR, vD, vDCnt, vDia, vM, vNotDia, vRWins, vH, 
+                 vHCnt;
+
+         /* Gap to the right (along the query)                          */
+         vO    = _mm256_subs_epi16(_mm256_loadu_si256((__m256i *)
+                                      (prev - 2*BATCHLANES)), vOpen);
+         vC    = _mm256_subs_epi16(vRc, vExt);
+         vMask = _mm256_cmpgt_epi16(vC, vO);
+         vRc   = _mm256_max_epi16(vO, vC);
+         vRcnt = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i *)
+                                       (prevC - 2*BATCHLANES)),
+                                    vRcnt, vMask);
+         vR    = (i<=1)?vZero:vRc;
+
+         /* Gap down (along the templates)                              */
+         vO    = _mm256_subs_epi16(_mm256_loadu_si256((__m256i *)
+                                      (prev2 - BATCHLANES)), vOpen);
+         vC    = _mm256_subs_epi16(_mm256_loadu_si256((__m256i *)dc), 
+                                   vExt);
+         vMask = _mm256_cmpgt_epi16(vC, vO);
+         vD    = _mm256_max_epi16(vO, vC);
+         vDCnt = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i *)
+                                       (prev2C - BATCHLANES)),
+                                    _mm256_loadu_si256((__m256i *)dcC),
+                                    vMask);
+         _mm256_storeu_si256((__m256i *)dc,  vD);
+         _mm256_storeu_si256((__m256i *)dcC, vDCnt);
+         if(j<=1)
+            vD = vZero;
+
+         /* Choose between the diagonal, R and D                        */
+         vDia    = _mm256_loadu_si256((__m256i *)(prev - BATCHLANES));
+         vM      = _mm256_max_epi16(vR, vD);
+         vNotDia = _mm256_cmpgt_epi16(vM, vDia);
+         vRWins  = _mm256_cmpgt_epi16(vR, vD);
+         vH      = _mm256_blendv_epi8(vDia,
+                                      _mm256_blendv_epi8(vD, vR, vRWins),
+                                      vNotDia);
+         vH      = _mm256_adds_epi16(vH, _mm256_loadu_si256((__m256i *)
+                                     (profile + code*BATCHLANES)));
+         vHCnt   = _mm256_blendv_epi8(_mm256_loadu_si256((__m256i *)
+                                         (prevC - BATCHLANES)),
+                                      _mm256_blendv_epi8(vDCnt, vRcnt, 
+                                                         vRWins),
+                                      vNotDia);
+         vHCnt   = _mm256_add_epi16(vHCnt, _mm256_loadu_si256((__m256i *)
+                                    (match + code*BATCHLANES)));
+         _mm256_storeu_si256((__m256i *)cur,  vH);
+         _mm256_storeu_si256((__m256i *)curC, vHCnt);
+      }
+
+      /* Last row - the latest column wins ties                         */
+      {
+         __m256i vH    = _mm256_loadu_si256((__m256i *)
+                                            (H + (qLen+1)*BATCHLANES)),
+                 vHCnt = _mm256_loadu_si256((__m256i *)
+                                            (Hcnt + (qLen+1)*BATCHLANES));
+         vMask = _mm256_andnot_si256(_mm256_cmpgt_epi16(vRowBest, vH),
+                    _mm256_cmpgt_epi16(vLens, _mm256_set1_epi16(j)));
+         vRowBest    = _mm256_blendv_epi8(vRowBest,    vH,    vMask);
+         vRowBestCnt = _mm256_blendv_epi8(vRowBestCnt, vHCnt, vMask);
+      }
+
+      /* Last column for templates ending here - the latest row wins 
+         ties
+      */
+      vMask = _mm256_cmpeq_epi16(vLens, _mm256_set1_epi16(j+1));
+      if(_mm256_movemask_epi8(vMask))
+      {
+         for(i=0; i<qLen; i++)
+         {
+            __m256i vH    = _mm256_loadu_si256((__m256i *)
+                                               (H + (i+2)*BATCHLANES)),
+                    vHCnt = _mm256_loadu_si256((__m256i *)
+                                               (Hcnt + (i+2)*BATCHLANES)),
+                    vUpd  = _mm256_andnot_si256(
+                               _mm256_cmpgt_epi16(vColBest, vH), vMask);
+            vColBest    = _mm256_blendv_epi8(vColBest,    vH,    vUpd);
+            vColBestCnt = _mm256_blendv_epi8(vColBestCnt, vHCnt, vUpd);
+         }
+      }
+
+      swap = Hprev2;    Hprev2    = Hprev;    Hprev    = H;    H    = swap;
+      swap = Hprev2cnt; Hprev2cnt = Hprevcnt; Hprevcnt = Hcnt; Hcnt = swap;
+   }
+
+   _mm256_storeu_si256((__m256i *)colBest,    vColBest);
+   _mm256_storeu_si256((__m256i *)colBestCnt, vColBestCnt);
+   _mm256_storeu_si256((__m256i *)rowBest,    vRowBest);
+   _mm256_storeu_si256((__m256i *)rowBestCnt, vRowBestCnt);
+   
+   for(lane=0; lane<nBatch; lane++)
+   {
+      unsigned short counts = (unsigned short)((rowBest[lane] > 
+                                                colBest[lane])?
+                                               rowBestCnt[lane]:
+                                               colBestCnt[lane]);
+      int            nAligned = counts / BATCH_COUNT_ALIGNED,
+                     nMatched = counts % BATCH_COUNT_ALIGNED;
+
+      scores[lane] = (nAligned < MINSEQLEN)?
+                     (REAL)0.0:(REAL)nMatched/(REAL)nAligned;
+   }
+}
+#endif
+
+
+/************************************************************************/
+/*>void ScoreTemplatesBatched(ALIGNQUERY *query, ALIGNWORK *work,
+                              TEMPLATELIB *templates, int *candidates,
+                              int nCandidates, REAL *scores)
+   ---------------------------------------------------------------
+*//**
+   \param[in]   query        Prepared query
+   \param[in]   work         Workspace from AllocAlignWork()
+   \param[in]   templates    The template library
+   \param[in]   candidates   Template numbers to score
+   \param[in]   nCandidates  Number of candidates
+   \param[out]  scores       Identity score for each candidate
+
+   Scores the query against the candidate templates BATCHLANES at a
+   time with ScoreBatchAVX2(). Templates are sorted on length before
+   being packed into batches so that the templates in a batch finish
+   together. Templates that are too long to batch are scored one at a
+   time with ScoreAlignment().
+
+-  17.10.26 Original   By: agent
+*/
+void ScoreTemplatesBatched(ALIGNQUERY *query, ALIGNWORK *work,
+                           TEMPLATELIB *templates, int *candidates,
+                           int nCandidates, REAL *scores)
+{
+   BATCHENTRY *sorted;
+   TEMPLATE   *batch[BATCHLANES];
+   REAL       batchScores[BATCHLANES];
+   int        nSorted = 0,
+              i, j;
+   
+   if((sorted = (BATCHENTRY *)malloc(nCandidates * sizeof(BATCHENTRY)))
+      == NULL)
+   {
+      for(i=0; i<nCandidates; i++)
+         scores[i] = ScoreAlignment(query, 
+                                    &(templates->templates[candidates[i]]),
+                                    work);
+      return;
+   }
+
+   for(i=0; i<nCandidates; i++)
+   {
+      TEMPLATE *t = &(templates->templates[candidates[i]]);
+      if(t->seqLen <= BATCHMAXLEN)
+      {
+         sorted[nSorted].template  = t;
+         sorted[nSorted].candidate = i;
+         nSorted++;
+      }
+      else
+      {
+         scores[i] = ScoreAlignment(query, t, work);
+      }
+   }
+   qsort(sorted, nSorted, sizeof(BATCHENTRY), CompareBatchEntries);
+
+   for(i=0; i<nSorted; i+=BATCHLANES)
+   {
+      int nBatch = MIN(BATCHLANES, nSorted-i);
+
+      for(j=0; j<nBatch; j++)
+         batch[j] = sorted[i+j].template;
+#ifdef HAVE_X86_SIMD
+      ScoreBatchAVX2(query, batch, nBatch, work, batchScores);
+#else
+      for(j=0; j<nBatch; j++)
+         batchScores[j] = ScoreAlignment(query, batch[j], work);
+#endif
+      for(j=0; j<nBatch; j++)
+         scores[sorted[i+j].candidate] = batchScores[j];
+   }
+   
+   free(sorted);
+}
+
+
+/************************************************************************/
+/*>int SelectAlignEngine(int engine)
+   ---------------------------------
+*//**
+   \param[in]   engine    Requested engine (ALIGN_xxx)
+   \return                Engine to use
+
+   Chooses the alignment engine. ALIGN_AUTO gives the best engine that
+   the CPU supports; a SIMD engine that the CPU does not support falls
+   back to the best one that it does. The batch engine needs AVX2.
+
+-  17.10.26 Original   By: agent
+*/
+int SelectAlignEngine(int engine)
+{
+   int best = ALIGN_SCALAR;
+   
+#ifdef HAVE_X86_SIMD
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx2"))
+      best = ALIGN_AVX2;
+   else if(__builtin_cpu_supports("sse4.1"))
+      best = ALIGN_SSE4;
+#endif
+
+   if(engine == ALIGN_BATCH)
+      return((best == ALIGN_AVX2)?ALIGN_BATCH:best);
+   if((engine == ALIGN_AUTO) || (engine > best))
+      return(best);
+   return(engine);
+}
+
+
+/************************************************************************/
+/*>REAL CompareSeqsOLD(char *seqresSeq, char *refSeq, 
+                    char *alignSeqres, char *alignRef)
+   -----------------------------------------------
+*//**
+   \param[in]   seqresSeq     the sequence of interest
+   \param[in]   refSeq        the database sequence
+   \param[out]  alignSeqres   Alignment of our sequence
+   \param[out]  alignRef      Alignment of database sequence
+   \return                    Score for alignment
+
+   - 31.03.20 Original   By: ACRM
+   - 20.09.21 Modified to use affine alignment and mutation matrix
+*/
+REAL CompareSeqsOLD(char *seqresSeq, char *refSeq,
+                 char *alignSeqres, char *alignRef)
+{
+   int  score;
+   int  alignLen;
+   int  bestPossibleScore,
+        bestPossibleScore1 = 100000,
+        bestPossibleScore2 = 100000;
+
+   bestPossibleScore1 = blAffinealign(refSeq, strlen(refSeq),
+                                      refSeq, strlen(refSeq),
+                                      FALSE,          /* verbose        */
+                                      FALSE,          /* identity       */
+                                      GAPOPENPENALTY, /* penalty        */
+                                      GAPEXTPENALTY,  /* extension      */
+                                      alignSeqres,
+                                      alignRef,
+                                      &alignLen);
+
+   if(strlen(seqresSeq) >= MINSEQLEN)
+   {
+      bestPossibleScore2 = blAffinealign(seqresSeq, strlen(seqresSeq),
+                                         seqresSeq, strlen(seqresSeq),
+                                         FALSE,          /* verbose     */
+                                         FALSE,          /* identity    */
+                                         GAPOPENPENALTY, /* penalty     */
+                                         GAPEXTPENALTY,  /* extension   */
+                                         alignSeqres,
+                                         alignRef,
+                                         &alignLen);
+   }
+   
+   bestPossibleScore = MIN(bestPossibleScore1, bestPossibleScore2);
+
+   if(bestPossibleScore <= 0)
+      return(0);
+   
+   score = blAffinealign(seqresSeq, strlen(seqresSeq),
+                         refSeq, strlen(refSeq),
+                         FALSE,          /* verbose                     */
+                         FALSE,          /* identity                    */
+                         GAPOPENPENALTY, /* penalty                     */
+                         GAPEXTPENALTY,  /* extension                   */
+                         alignSeqres,
+                         alignRef,
+                         &alignLen);
+
+   alignSeqres[alignLen]  = alignRef[alignLen] = '\0';
+
+#ifdef DEBUG   
+   fprintf(stderr, "\n>>>%s\n", alignSeqres);
+   fprintf(stderr, ">>>%s\n",   alignRef);
+#endif
+
+   return((REAL)score / (REAL)bestPossibleScore);
+}
+
+
+/************************************************************************/
+/*>DOMAIN *FindVHVLDomains(WHOLEPDB *wpdb, PDBCHAIN *chain,
+                           TEMPLATELIB *templates, DOMAIN *domains,
+                           CHAINHIT **pChainCache)
+   ---------------------------------------------------------------
+*//**
+   \param[in]     wpdb         The PDB entry - only needed if the SEQRES
+                               sequence is used for the chain
+   \param[in]     chain        The chain to search
+   \param[in]     templates    The template library
+   \param[in]     domains      The list of domains found so far
+   \param[in,out] pChainCache  Domains found for each chain sequence in
+                               this entry
+   \param[in]     arena        Arena for the domains
+   \return                     The updated list of domains
+
+   Finds the VH and VL domains in a chain. If an earlier chain in the
+   entry had the same sequence, its template hits and residue assignments
+   are reused and only the coordinate-dependent work is redone.
+
+-  17.10.26 Added pChainCache and arena   By: agent
+*/
+DOMAIN *FindVHVLDomains(WHOLEPDB *wpdb, PDBCHAIN *chain,
+                        TEMPLATELIB *templates, DOMAIN *domains,
+                        CHAINHIT **pChainCache, ARENA *arena)
+{
+   char     sequence[MAXSEQ],
+            chainSeq[MAXSEQ];
+   CHAINHIT *chainHit;
+   ULONG    hash;
+   int      nFound = 0;
+   
+/*   GetSequenceForChainSeqres(wpdb, chain, sequence); */
+   
+   GetSequenceForChain(chain, sequence);
+#ifdef DEBUG
+   printf("Chain: %s Sequence: %s\n", chain->chain, sequence);
+#endif
+
+   /* If we have already seen this sequence, reuse its domains          */
+   hash = HashSequence(sequence);
+   if((chainHit = FindChainHit(*pChainCache, sequence, hash)) != NULL)
+   {
+      ReuseChainHit(chainHit, chain, &domains, arena);
+      return(domains);
+   }
+   chainHit = AddChainHit(pChainCache, sequence, hash, chain);
+
+   /* Keep the unmasked sequence so that CheckAndMask() can tell which
+      X characters are masked domains
+   */
+   strcpy(chainSeq, sequence);
+   while(TRUE)
+   {
+      if(!CheckAndMask(sequence, chainSeq, nFound, templates, chain,
+                       &domains, chainHit, arena))
+         break;
+      nFound++;
+   }
+
+   return(domains);
+}
+
+/************************************************************************/
+/*>ULONG HashSequence(char *seq)
+   -----------------------------
+*//**
+   \param[in]   seq   A sequence
+   \return            32-bit FNV-1a hash of the sequence
+
+-  17.10.26 Original   By: agent
+*/
+ULONG HashSequence(char *seq)
+{
+   return(HashBytes(2166136261UL, seq, strlen(seq)));
+}
+
+
+/************************************************************************/
+/*>ULONG HashBytes(ULONG hash, char *data, int nBytes)
+   ---------------------------------------------------
+*//**
+   \param[in]   hash     Hash so far (2166136261 to start)
+   \param[in]   data     Data to add to the hash
+   \param[in]   nBytes   Size of the data
+   \return               Updated 32-bit FNV-1a hash
+
+-  17.10.26 Original   By: agent
+*/
+ULONG HashBytes(ULONG hash, char *data, int nBytes)
+{
+   int i;
+   
+   for(i=0; i<nBytes; i++)
+   {
+      hash ^= (ULONG)(UBYTE)data[i];
+      hash  = (hash * 16777619UL) & 0xFFFFFFFFUL;
+   }
+   return(hash);
+}
+
+
+/************************************************************************/
+/*>CHAINHIT *FindChainHit(CHAINHIT *chainCache, char *seq, ULONG hash)
+   ------------------------------------------------------------------
+*//**
+   \param[in]   chainCache   Domains found for each chain sequence
+   \param[in]   seq          Chain sequence
+   \param[in]   hash         HashSequence() of the sequence
+   \return                   Cache entry for the sequence (or NULL)
+
+-  17.10.26 Original   By: agent
+*/
+CHAINHIT *FindChainHit(CHAINHIT *chainCache, char *seq, ULONG hash)
+{
+   CHAINHIT *c;
+
+   for(c=chainCache; c!=NULL; NEXT(c))
+   {
+      if((c->hash == hash) && !strcmp(c->seq, seq))
+         return(c);
+   }
+   return(NULL);
+}
+
+
+/************************************************************************/
+/*>CHAINHIT *AddChainHit(CHAINHIT **pChainCache, char *seq, ULONG hash,
+                         PDBCHAIN *chain)
+   -------------------------------------------------------------------
+*//**
+   \param[in,out] pChainCache  Domains found for each chain sequence
+   \param[in]     seq          Chain sequence
+   \param[in]     hash         HashSequence() of the sequence
+   \param[in]     chain        The chain
+   \return                     New (empty) cache entry for the sequence
+
+-  17.10.26 Original   By: agent
+*/
+CHAINHIT *AddChainHit(CHAINHIT **pChainCache, char *seq, ULONG hash,
+                      PDBCHAIN *chain)
+{
+   CHAINHIT *c;
+   
+   if(*pChainCache == NULL)
+   {
+      INIT((*pChainCache), CHAINHIT);
+      c = *pChainCache;
+   }
+   else
+   {
+      c = *pChainCache;
+      LAST(c);
+      ALLOCNEXT(c, CHAINHIT);
+   }
+   if((c == NULL) || ((c->seq = strdup(seq)) == NULL))
+   {
+      fprintf(stderr,"Error (%s): No memory for chain sequence cache\n",
+              PROGNAME);
+      exit(1);
+   }
+   c->hash  = hash;
+   c->chain = chain;
+   c->hits  = NULL;
+
+   return(c);
+}
+
+
+/************************************************************************/
+/*>void RecordDomainHit(CHAINHIT *chainHit, DOMAIN *domain,
+                        TEMPLATE *template, REAL score,
+                        char *alignSeqres, char *alignRef)
+   -------------------------------------------------------
+*//**
+   \param[in,out] chainHit     Cache entry for the chain sequence
+   \param[in]     domain       The domain that has been assigned
+   \param[in]     template     The best matching template
+   \param[in]     score        Its score
+   \param[in]     alignSeqres  The chain sequence alignment
+   \param[in]     alignRef     The template alignment
+
+   Adds a domain to the cache entry for a chain sequence
+
+-  17.10.26 Original   By: agent
+*/
+void RecordDomainHit(CHAINHIT *chainHit, DOMAIN *domain,
+                     TEMPLATE *template, REAL score,
+                     char *alignSeqres, char *alignRef)
+{
+   DOMAINHIT *h;
+   
+   if(chainHit->hits == NULL)
+   {
+      INIT(chainHit->hits, DOMAINHIT);
+      h = chainHit->hits;
+   }
+   else
+   {
+      h = chainHit->hits;
+      LAST(h);
+      ALLOCNEXT(h, DOMAINHIT);
+   }
+   if((h == NULL) ||
+      ((h->alignSeqres = strdup(alignSeqres))                     == NULL) ||
+      ((h->alignRef    = strdup(alignRef))                        == NULL) ||
+      ((h->domSeq      = strdup(domain->domSeq))                  == NULL) ||
+      ((h->interface   = (int *)malloc((domain->nInterface+1) *
+                                       sizeof(int)))              == NULL) ||
+      ((h->CDRRes      = (int *)malloc((domain->nCDRRes+1) *
+                                       sizeof(int)))              == NULL))
+   {
+      fprintf(stderr,"Error (%s): No memory for chain sequence cache\n",
+              PROGNAME);
+      exit(1);
+   }
+
+   h->template    = template;
+   h->score       = score;
+   h->startSeqRes = domain->startSeqRes;
+   h->lastSeqRes  = domain->lastSeqRes;
+   h->nInterface  = domain->nInterface;
+   h->nCDRRes     = domain->nCDRRes;
+   memcpy(h->interface, domain->interface, domain->nInterface*sizeof(int));
+   memcpy(h->CDRRes,    domain->CDRRes,    domain->nCDRRes*sizeof(int));
+}
+
+
+/************************************************************************/
+/*>void ReuseChainHit(CHAINHIT *chainHit, PDBCHAIN *chain, 
+                      DOMAIN **pDomains, ARENA *arena)
+   ---------------------------------------------------------
+*//**
+   \param[in]     chainHit   Cache entry for the chain sequence
+   \param[in]     chain      A chain with the same sequence
+   \param[in,out] pDomains   The list of domains
+   \param[in]     arena      Arena for the domains
+
+   Adds domains for a chain from the cache entry for its sequence. Only
+   SetDomainBoundaries() (which finds the coordinates) is redone.
+
+-  17.10.26 Original   By: agent
+*/
+void ReuseChainHit(CHAINHIT *chainHit, PDBCHAIN *chain, 
+                   DOMAIN **pDomains, ARENA *arena)
+{
+   DOMAINHIT *h;
+   DOMAIN    *d;
+   
+   if(gVerbose)
+      fprintf(stderr, "Chain %s has the same sequence as chain %s\n\n",
+              chain->chain, chainHit->chain->chain);
+
+   for(h=chainHit->hits; h!=NULL; NEXT(h))
+   {
+      if(gVerbose)
+      {
+         fprintf(stderr, "Best match: %s Score: %.4f\n",
+                 h->template->header, h->score);
+         fprintf(stderr, "SEQ: %s\n",   h->alignSeqres);
+         fprintf(stderr, "REF: %s\n\n", h->alignRef);
+      }
+
+      d = NewDomain(chain, pDomains, arena);
+      SetChainAsLightOrHeavy(d, h->template);
+      d->startSeqRes = h->startSeqRes;
+      d->lastSeqRes  = h->lastSeqRes;
+      d->nInterface  = h->nInterface;
+      d->nCDRRes     = h->nCDRRes;
+      d->domSeq      = (char *)ArenaAlloc(arena, strlen(h->domSeq)+1);
+      d->interface   = (int *)ArenaAlloc(arena, 
+                                         (h->nInterface+1)*sizeof(int));
+      d->CDRRes      = (int *)ArenaAlloc(arena, 
+                                         (h->nCDRRes+1)*sizeof(int));
+      strcpy(d->domSeq, h->domSeq);
+      memcpy(d->interface, h->interface, h->nInterface*sizeof(int));
+      memcpy(d->CDRRes,    h->CDRRes,    h->nCDRRes*sizeof(int));
+      SetDomainKeyBits(d);
+
+      SetDomainBoundaries(d);
+   }
+}
+
+
+/************************************************************************/
+/*>void FreeChainCache(CHAINHIT *chainCache)
+   -----------------------------------------
+*//**
+   \param[in]   chainCache   Domains found for each chain sequence
+
+-  17.10.26 Original   By: agent
+*/
+void FreeChainCache(CHAINHIT *chainCache)
+{
+   CHAINHIT  *c;
+   DOMAINHIT *h;
+   
+   for(c=chainCache; c!=NULL; NEXT(c))
+   {
+      for(h=c->hits; h!=NULL; NEXT(h))
+      {
+         FREE(h->alignSeqres);
+         FREE(h->alignRef);
+         FREE(h->domSeq);
+         FREE(h->interface);
+         FREE(h->CDRRes);
+      }
+      FREELIST(c->hits, DOMAINHIT);
+      FREE(c->seq);
+   }
+   FREELIST(chainCache, CHAINHIT);
+}
+
+
+/************************************************************************/
+/*>ULONG TemplateLibraryVersion(TEMPLATELIB *templates)
+   ----------------------------------------------------
+*//**
+   \param[in]   templates   The template library
+   \return                  Hash of everything that affects the template
+                            chosen for a chain
+
+   Identifies the template library (and the k-mer shortlist size and
+   alignment engine) in the persistent alignment cache so that stale 
+   entries are never used
+
+-  17.10.26 Original   By: agent
+*/
+ULONG TemplateLibraryVersion(TEMPLATELIB *templates)
+{
+   ULONG hash = 2166136261UL;
+   int   i;
+   
+   hash = HashBytes(hash, (char *)&gShortlist,   sizeof(int));
+   hash = HashBytes(hash, (char *)&gAlignEngine, sizeof(int));
+   hash = HashBytes(hash, (char *)templates->scoreMatrix,
+                    NAACODES*NAACODES*sizeof(int));
+   for(i=0; i<templates->nTemplates; i++)
+   {
+      TEMPLATE *t = &(templates->templates[i]);
+      
+      hash = HashBytes(hash, t->header, strlen(t->header)+1);
+      hash = HashBytes(hash, t->seq,    strlen(t->seq)+1);
+      hash = HashBytes(hash, &(t->chainType), 1);
+      hash = HashBytes(hash, (char *)t->IFRes,  t->nIFRes*sizeof(int));
+      hash = HashBytes(hash, (char *)t->CDRRes, t->nCDRRes*sizeof(int));
+   }
+   return(hash);
+}
+
+
+/************************************************************************/
+/*>BOOL LockAlignCache(ALIGNCACHE *cache, int lockType)
+   ----------------------------------------------------
+*//**
+   \param[in]   cache      The alignment cache
+   \param[in]   lockType   F_RDLCK, F_WRLCK or F_UNLCK
+   \return                 Success
+
+   Locks (or unlocks) the whole cache file against other processes and
+   makes sure that the mapping covers the whole file, since another 
+   process may have extended it. Waits for the lock if necessary.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL LockAlignCache(ALIGNCACHE *cache, int lockType)
+{
+   struct flock lock;
+   struct stat  statBuf;
+
+   lock.l_type   = lockType;
+   lock.l_whence = SEEK_SET;
+   lock.l_start  = 0;
+   lock.l_len    = 0;
+   while(fcntl(cache->fd, F_SETLKW, &lock) < 0)
+   {
+      if(errno != EINTR)
+         return(FALSE);
+   }
+   if(lockType == F_UNLCK)
+      return(TRUE);
+
+   if(fstat(cache->fd, &statBuf))
+      return(FALSE);
+   if((size_t)statBuf.st_size != cache->mapSize)
+   {
+      if(cache->mapping != NULL)
+         munmap(cache->mapping, cache->mapSize);
+      cache->mapSize = (size_t)statBuf.st_size;
+      cache->mapping = (char *)mmap(NULL, cache->mapSize,
+                                    PROT_READ|PROT_WRITE, MAP_SHARED,
+                                    cache->fd, 0);
+      if(cache->mapping == (char *)MAP_FAILED)
+      {
+         cache->mapping = NULL;
+         cache->mapSize = 0;
+         return(FALSE);
+      }
+   }
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>ALIGNCACHE *OpenAlignCache(char *cacheFile, TEMPLATELIB *templates)
+   -------------------------------------------------------------------
+*//**
+   \param[in]   cacheFile   The cache file
+   \param[in]   templates   The template library
+   \return                  The open cache (NULL on failure)
+
+   Opens the persistent alignment cache, creating it if it doesn't 
+   exist. A file that exists but isn't a cache is left alone.
+
+-  17.10.26 Original   By: agent
+*/
+ALIGNCACHE *OpenAlignCache(char *cacheFile, TEMPLATELIB *templates)
+{
+   ALIGNCACHE  *cache;
+   CACHEHEADER *header;
+   BOOL        ok = FALSE;
+
+   if((cache = (ALIGNCACHE *)malloc(sizeof(ALIGNCACHE)))==NULL)
+      return(NULL);
+   cache->mapping    = NULL;
+   cache->mapSize    = 0;
+   cache->hits       = 0;
+   cache->misses     = 0;
+   cache->reclaimed  = 0;
+   cache->notStored  = 0;
+   cache->libVersion = TemplateLibraryVersion(templates);
+
+   if((cache->fd = open(cacheFile, O_RDWR|O_CREAT, 0644)) < 0)
+   {
+      free(cache);
+      return(NULL);
+   }
+   
+   if(LockAlignCache(cache, F_WRLCK))
+   {
+      /* A new file - size it for the slots and some records            */
+      if(cache->mapSize == 0)
+      {
+         size_t dataStart = sizeof(CACHEHEADER) +
+                            CACHESLOTS * sizeof(CACHESLOT);
+         
+         if(!ftruncate(cache->fd, (off_t)(dataStart + CACHEGROW)) &&
+            LockAlignCache(cache, F_WRLCK))
+         {
+            header = (CACHEHEADER *)cache->mapping;
+            strncpy(header->magic, CACHEMAGIC, 8);
+            header->version    = CACHEVERSION;
+            header->headerSize = sizeof(CACHEHEADER);
+            header->slotSize   = sizeof(CACHESLOT);
+            header->nSlots     = CACHESLOTS;
+            header->nUsed      = 0;
+            header->dataEnd    = (ULONG)dataStart;
+            header->hits       = 0;
+            header->misses     = 0;
+         }
+      }
+
+      /* Check this is a cache we understand                            */
+      header = (CACHEHEADER *)cache->mapping;
+      if((cache->mapSize >= sizeof(CACHEHEADER))           &&
+         !strncmp(header->magic, CACHEMAGIC, 8)            &&
+         (header->version    == CACHEVERSION)              &&
+         (header->headerSize == sizeof(CACHEHEADER))       &&
+         (header->slotSize   == sizeof(CACHESLOT))         &&
+         (header->nSlots     >  0)                         &&
+         (header->dataEnd    <= (ULONG)cache->mapSize))
+      {
+         ok = TRUE;
+      }
+      LockAlignCache(cache, F_UNLCK);
+   }
+
+   if(!ok)
+   {
+      if(cache->mapping != NULL)
+         munmap(cache->mapping, cache->mapSize);
+      close(cache->fd);
+      free(cache);
+      return(NULL);
+   }
+   
+   return(cache);
+}
+
+
+/************************************************************************/
+/*>void CloseAlignCache(ALIGNCACHE *cache)
+   ---------------------------------------
+*//**
+   \param[in]   cache   The alignment cache (may be NULL)
+
+   Adds the hit and miss counts for this run to the totals in the cache
+   file and closes it
+
+-  17.10.26 Original   By: agent
+*/
+void CloseAlignCache(ALIGNCACHE *cache)
+{
+   if(cache == NULL)
+      return;
+
+   if(LockAlignCache(cache, F_WRLCK))
+   {
+      CACHEHEADER *header = (CACHEHEADER *)cache->mapping;
+
+      header->hits   += cache->hits;
+      header->misses += cache->misses;
+      if(gVerbose)
+      {
+         fprintf(stderr, "Alignment cache: %lu hits, %lu misses \
+(%lu hits, %lu misses in total)\n",
+                 cache->hits, cache->misses, header->hits, header->misses);
+         if(cache->reclaimed)
+            fprintf(stderr, "Alignment cache: %lu stale entries \
+reclaimed\n", cache->reclaimed);
+         if(cache->notStored)
+            fprintf(stderr, "Alignment cache full: %lu results not \
+stored\n", cache->notStored);
+      }
+      LockAlignCache(cache, F_UNLCK);
+   }
+
+   if(cache->mapping != NULL)
+      munmap(cache->mapping, cache->mapSize);
+   close(cache->fd);
+   free(cache);
+}
+
+
+/************************************************************************/
+/*>ARCHIVE *OpenArchive(char *archiveFile)
+   ---------------------------------------
+*//**
+   \param[in]   archiveFile   Archive file name
+   \return                    The open archive (or NULL)
+
+   Opens an archive and its index (the name with .idx added) for 
+   appending, so the output of several runs can be collected in one 
+   file. Each output file is stored exactly as it would be written on 
+   its own, and the index has a line for each with its name and its
+   offset and length in bytes, so it can be read with a single pread().
+
+-  17.10.26 Original   By: agent
+*/
+ARCHIVE *OpenArchive(char *archiveFile)
+{
+   ARCHIVE *archive;
+   char    *indexFile;
+
+   if((archive = (ARCHIVE *)malloc(sizeof(ARCHIVE)))==NULL)
+      return(NULL);
+   if((indexFile = (char *)malloc(strlen(archiveFile)+5))==NULL)
+   {
+      free(archive);
+      return(NULL);
+   }
+   sprintf(indexFile, "%s.idx", archiveFile);
+
+   archive->index = NULL;
+   if(((archive->fp    = fopen(archiveFile, "a"))==NULL) ||
+      ((archive->index = fopen(indexFile,   "a"))==NULL))
+   {
+      if(archive->fp != NULL)
+         fclose(archive->fp);
+      free(archive);
+      archive = NULL;
+   }
+
+   free(indexFile);
+   return(archive);
+}
+
+
+/************************************************************************/
+/*>BOOL LockArchive(ARCHIVE *archive, int lockType)
+   ------------------------------------------------
+*//**
+   \param[in]   archive    The archive
+   \param[in]   lockType   F_WRLCK or F_UNLCK
+   \return                 Success
+
+   Locks (or unlocks) the archive against other processes, waiting for
+   the lock if necessary. Once locked, the archive is positioned at its
+   end since another process may have added to it. Everything written
+   is flushed before unlocking.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL LockArchive(ARCHIVE *archive, int lockType)
+{
+   struct flock lock;
+
+   if(lockType == F_UNLCK)
+   {
+      fflush(archive->fp);
+      fflush(archive->index);
+   }
+   
+   lock.l_type   = lockType;
+   lock.l_whence = SEEK_SET;
+   lock.l_start  = 0;
+   lock.l_len    = 0;
+   while(fcntl(fileno(archive->fp), F_SETLKW, &lock) < 0)
+   {
+      if(errno != EINTR)
+         return(FALSE);
+   }
+
+   if((lockType != F_UNLCK) && fseeko(archive->fp, 0, SEEK_END))
+      return(FALSE);
+   
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>void CloseArchive(ARCHIVE *archive)
+   -----------------------------------
+*//**
+   \param[in]   archive   The archive (or NULL)
+
+-  17.10.26 Original   By: agent
+*/
+void CloseArchive(ARCHIVE *archive)
+{
+   if(archive == NULL)
+      return;
+
+   fclose(archive->fp);
+   fclose(archive->index);
+   free(archive);
+}
+
+
+/************************************************************************/
+/*>CACHERECORD *GetCacheRecord(ALIGNCACHE *cache, CACHESLOT *slot,
+                               TEMPLATELIB *templates)
+   ---------------------------------------------------------------
+*//**
+   \param[in]   cache       The alignment cache (locked)
+   \param[in]   slot        A slot in use
+   \param[in]   templates   The template library
+   \return                  The record (NULL if it is not valid)
+
+   Finds the record for a cache slot and checks that it lies within the
+   file, that its strings fit in the record (and in a HUGEBUFF buffer)
+   and are '\0' terminated where expected, and that its template exists
+
+-  17.10.26 Original   By: agent
+*/
+CACHERECORD *GetCacheRecord(ALIGNCACHE *cache, CACHESLOT *slot,
+                            TEMPLATELIB *templates)
+{
+   CACHERECORD *record;
+   char        *seq;
+   ULONG       dataStart,
+               recordSize = (ULONG)slot->recordSize;
+
+   dataStart = sizeof(CACHEHEADER) + 
+               ((CACHEHEADER *)cache->mapping)->nSlots * sizeof(CACHESLOT);
+   if((slot->recordSize < (int)sizeof(CACHERECORD)) ||
+      (slot->offset < dataStart) || (slot->offset % 8)            ||
+      (slot->offset + recordSize > (ULONG)cache->mapSize))
+      return(NULL);
+
+   record = (CACHERECORD *)(cache->mapping + slot->offset);
+   if((record->seqLen   < 0) || (record->seqLen   > slot->recordSize) ||
+      (record->alignLen < 0) || (record->alignLen > HUGEBUFF)         ||
+      (sizeof(CACHERECORD) + (ULONG)record->seqLen + 
+       2 * (ULONG)record->alignLen + 3 > recordSize)                  ||
+      (record->templateNum < -1) || 
+      (record->templateNum >= templates->nTemplates))
+      return(NULL);
+
+   seq = (char *)(record + 1);
+   if((seq[record->seqLen] != '\0') ||
+      (seq[record->seqLen + record->alignLen + 1] != '\0') ||
+      (seq[record->seqLen + 2 * record->alignLen + 2] != '\0'))
+      return(NULL);
+
+   return(record);
+}
+
+
+/************************************************************************/
+/*>BOOL LookupAlignCache(ALIGNCACHE *cache, char *chainSeq, int nFound,
+                         TEMPLATELIB *templates, TEMPLATE **pBestMatch,
+                         REAL *pScore, char *alignSeqres, 
+                         char *alignRef)
+   ---------------------------------------------------------------------
+*//**
+   \param[in]   cache        The alignment cache
+   \param[in]   chainSeq     The (unmasked) chain sequence
+   \param[in]   nFound       Domains already found in the chain
+   \param[in]   templates    The template library
+   \param[out]  pBestMatch   The best matching template (NULL if none)
+   \param[out]  pScore       Its score
+   \param[out]  alignSeqres  The chain sequence alignment
+   \param[out]  alignRef     The template alignment
+   \return                   Was the result found in the cache?
+
+   Looks up the result of the next template search for a chain. Since 
+   the search is deterministic, the masked sequence is defined by the
+   chain sequence and the number of domains already found. The record
+   is checked with GetCacheRecord() and only copied with known lengths
+   since another process may have written anything to the file.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL LookupAlignCache(ALIGNCACHE *cache, char *chainSeq, int nFound,
+                      TEMPLATELIB *templates, TEMPLATE **pBestMatch,
+                      REAL *pScore, char *alignSeqres, char *alignRef)
+{
+   CACHEHEADER *header;
+   CACHESLOT   *slots;
+   ULONG       seqHash = HashSequence(chainSeq);
+   int         seqLen  = strlen(chainSeq),
+               i, n;
+   BOOL        found = FALSE;
+
+   if(!LockAlignCache(cache, F_RDLCK))
+   {
+      cache->misses++;
+      return(FALSE);
+   }
+
+   header = (CACHEHEADER *)cache->mapping;
+   slots  = (CACHESLOT *)(cache->mapping + sizeof(CACHEHEADER));
+   i      = (int)((seqHash + nFound) % (ULONG)header->nSlots);
+   
+   for(n=0; (n<header->nSlots) && (slots[i].offset != 0); n++)
+   {
+      CACHESLOT *s = &(slots[i]);
+      
+      if((s->seqHash == seqHash) && (s->domainNum == nFound) &&
+         (s->libVersion == cache->libVersion))
+      {
+         CACHERECORD *record;
+         char        *seq;
+         
+         if(((record = GetCacheRecord(cache, s, templates)) != NULL) &&
+            (record->seqLen == seqLen) &&
+            !memcmp((seq = (char *)(record + 1)), chainSeq, seqLen))
+         {
+            *pScore     = record->score;
+            *pBestMatch = (record->templateNum < 0) ? NULL :
+                          &(templates->templates[record->templateNum]);
+            memcpy(alignSeqres, seq + seqLen + 1, record->alignLen);
+            memcpy(alignRef,    seq + seqLen + record->alignLen + 2,
+                   record->alignLen);
+            alignSeqres[record->alignLen] = alignRef[record->alignLen] =
+               '\0';
+            found = TRUE;
+            break;
+         }
+      }
+      i = (i + 1) % header->nSlots;
+   }
+
+   LockAlignCache(cache, F_UNLCK);
+
+   if(found)
+      cache->hits++;
+   else
+      cache->misses++;
+   return(found);
+}
+
+
+/************************************************************************/
+/*>static int CompareCacheSlots(const void *a, const void *b)
+   ----------------------------------------------------------
+*//**
+   qsort() comparison of CACHESLOTs by record offset
+
+-  17.10.26 Original   By: agent
+*/
+static int CompareCacheSlots(const void *a, const void *b)
+{
+   ULONG offsetA = ((CACHESLOT *)a)->offset,
+         offsetB = ((CACHESLOT *)b)->offset;
+   return((offsetA < offsetB) ? -1 : ((offsetA > offsetB) ? 1 : 0));
+}
+
+
+/************************************************************************/
+/*>void PurgeAlignCache(ALIGNCACHE *cache)
+   ---------------------------------------
+*//**
+   \param[in]   cache   The alignment cache (write locked)
+
+   Removes the entries made with other versions of the template library
+   from a full cache. The remaining records are moved down to the start
+   of the record area and the remaining slots are hashed into a cleared
+   table.
+
+-  17.10.26 Original   By: agent
+*/
+void PurgeAlignCache(ALIGNCACHE *cache)
+{
+   CACHEHEADER *header = (CACHEHEADER *)cache->mapping;
+   CACHESLOT   *slots  = (CACHESLOT *)(cache->mapping +
+                                       sizeof(CACHEHEADER)),
+               *live;
+   ULONG       dataEnd = sizeof(CACHEHEADER) + 
+                         header->nSlots * sizeof(CACHESLOT);
+   int         i, j,
+               nLive = 0;
+
+   if((live = (CACHESLOT *)malloc(header->nUsed * sizeof(CACHESLOT)))
+      == NULL)
+      return;
+   
+   for(i=0; i<header->nSlots; i++)
+   {
+      if((slots[i].offset != 0) &&
+         (slots[i].libVersion == cache->libVersion) &&
+         (nLive < (int)header->nUsed))
+      {
+         live[nLive++] = slots[i];
+      }
+   }
+   if(nLive == (int)header->nUsed)
+   {
+      free(live);
+      return;
+   }
+
+   /* Compact the records in file order so none is overwritten before
+      it has been moved
+   */
+   qsort(live, nLive, sizeof(CACHESLOT), CompareCacheSlots);
+   for(i=0; i<nLive; i++)
+   {
+      memmove(cache->mapping + dataEnd, cache->mapping + live[i].offset,
+              live[i].recordSize);
+      live[i].offset  = dataEnd;
+      dataEnd        += live[i].recordSize;
+   }
+
+   /* Hash the live slots into a cleared table                          */
+   memset(slots, 0, header->nSlots * sizeof(CACHESLOT));
+   for(i=0; i<nLive; i++)
+   {
+      j = (int)((live[i].seqHash + live[i].domainNum) % 
+                (ULONG)header->nSlots);
+      while(slots[j].offset != 0)
+         j = (j + 1) % header->nSlots;
+      slots[j] = live[i];
+   }
+
+   cache->reclaimed += header->nUsed - nLive;
+   header->nUsed     = nLive;
+   header->dataEnd   = dataEnd;
+   free(live);
+}
+
+
+/************************************************************************/
+/*>void StoreAlignCache(ALIGNCACHE *cache, char *chainSeq, int nFound,
+                        TEMPLATELIB *templates, TEMPLATE *bestMatch,
+                        REAL score, char *alignSeqres, char *alignRef)
+   --------------------------------------------------------------------
+*//**
+   \param[in]   cache        The alignment cache
+   \param[in]   chainSeq     The (unmasked) chain sequence
+   \param[in]   nFound       Domains already found in the chain
+   \param[in]   templates    The template library
+   \param[in]   bestMatch    The best matching template (NULL if none)
+   \param[in]   score        Its score
+   \param[in]   alignSeqres  The chain sequence alignment
+   \param[in]   alignRef     The template alignment
+
+   Adds the result of a template search to the cache. Nothing is stored
+   if another process has already stored it. Once the hash table is 
+   three quarters full, entries for other versions of the template 
+   library are reclaimed and nothing is stored if that doesn't free
+   enough slots. The slot is only filled in once the record has been
+   written.
+
+-  17.10.26 Original   By: agent
+*/
+void StoreAlignCache(ALIGNCACHE *cache, char *chainSeq, int nFound,
+                     TEMPLATELIB *templates, TEMPLATE *bestMatch,
+                     REAL score, char *alignSeqres, char *alignRef)
+{
+   CACHEHEADER *header;
+   CACHESLOT   *slots;
+   CACHERECORD *record;
+   ULONG       seqHash = HashSequence(chainSeq),
+               offset;
+   int         i,
+               seqLen,
+               alignLen,
+               recordSize;
+   char        *seq;
+
+   if(!LockAlignCache(cache, F_WRLCK))
+      return;
+
+   header = (CACHEHEADER *)cache->mapping;
+   slots  = (CACHESLOT *)(cache->mapping + sizeof(CACHEHEADER));
+   if(header->nUsed * 4 >= (ULONG)header->nSlots * 3)
+   {
+      PurgeAlignCache(cache);
+      if(header->nUsed * 4 >= (ULONG)header->nSlots * 3)
+      {
+         cache->notStored++;
+         LockAlignCache(cache, F_UNLCK);
+         return;
+      }
+   }
+
+   /* Find an empty slot, checking it hasn't been stored already        */
+   seqLen = strlen(chainSeq);
+   i      = (int)((seqHash + nFound) % (ULONG)header->nSlots);
+   while(slots[i].offset != 0)
+   {
+      CACHESLOT *s = &(slots[i]);
+
+      if((s->seqHash == seqHash) && (s->domainNum == nFound) &&
+         (s->libVersion == cache->libVersion) &&
+         ((record = GetCacheRecord(cache, s, templates)) != NULL) &&
+         (record->seqLen == seqLen) &&
+         !memcmp((char *)(record + 1), chainSeq, seqLen))
+      {
+         LockAlignCache(cache, F_UNLCK);
+         return;
+      }
+      i = (i + 1) % header->nSlots;
+   }
+
+   /* Grow the file if needed                                           */
+   alignLen   = (bestMatch == NULL) ? 0 : strlen(alignSeqres);
+   recordSize = sizeof(CACHERECORD) + seqLen + 2 * alignLen + 3;
+   recordSize = (recordSize + 7) & ~7;
+   offset     = header->dataEnd;
+   if(offset + recordSize > (ULONG)cache->mapSize)
+   {
+      size_t newSize = cache->mapSize + 
+                       MAX(cache->mapSize / 2, CACHEGROW + recordSize);
+      
+      if(ftruncate(cache->fd, (off_t)newSize) ||
+         !LockAlignCache(cache, F_WRLCK))
+      {
+         LockAlignCache(cache, F_UNLCK);
+         return;
+      }
+      header = (CACHEHEADER *)cache->mapping;
+      slots  = (CACHESLOT *)(cache->mapping + sizeof(CACHEHEADER));
+   }
+
+   /* Write the record and then fill in the slot                        */
+   record = (CACHERECORD *)(cache->mapping + offset);
+   record->score       = score;
+   record->templateNum = (bestMatch == NULL) ? -1 : 
+                         (int)(bestMatch - templates->templates);
+   record->seqLen      = seqLen;
+   record->alignLen    = alignLen;
+   seq = (char *)(record + 1);
+   strcpy(seq, chainSeq);
+   if(bestMatch == NULL)
+   {
+      seq[seqLen+1] = seq[seqLen+2] = '\0';
+   }
+   else
+   {
+      strcpy(seq + seqLen + 1,            alignSeqres);
+      strcpy(seq + seqLen + alignLen + 2, alignRef);
+   }
+
+   slots[i].seqHash    = seqHash;
+   slots[i].libVersion = cache->libVersion;
+   slots[i].domainNum  = nFound;
+   slots[i].recordSize = recordSize;
+   slots[i].offset     = offset;
+   header->dataEnd     = offset + recordSize;
+   header->nUsed++;
+
+   LockAlignCache(cache, F_UNLCK);
+}
+
+
+/************************************************************************/
+int RealSeqLen(char *seq)
+{
+   char *chp;
+   int seqlen = 0;
+
+   for(chp=seq; *chp != '\0'; chp++)
+   {
+      if((*chp != 'X') && (*chp != '-'))
+         seqlen++;
+   }
+
+   return(seqlen);
+}
+
+/************************************************************************/
+/*>void ScoreTemplates(ALIGNQUERY *query, ALIGNWORK *work,
+                       TEMPLATELIB *templates, int *candidates,
+                       int nCandidates, REAL *scores)
+   ---------------------------------------------------------------
+*//**
+   \param[in]   query        Prepared query
+   \param[in]   work         Workspace from AllocAlignWork()
+   \param[in]   templates    The template library
+   \param[in]   candidates   Template numbers to score
+   \param[in]   nCandidates  Number of candidates
+   \param[out]  scores       Identity score for each candidate
+
+   Scores the query against each of the candidate templates with the
+   engine the query was prepared for
+
+-  17.10.26 Original   By: agent
+*/
+void ScoreTemplates(ALIGNQUERY *query, ALIGNWORK *work,
+                    TEMPLATELIB *templates, int *candidates,
+                    int nCandidates, REAL *scores)
+{
+   int i;
+   
+   if(query->engine == ALIGN_BATCH)
+   {
+      ScoreTemplatesBatched(query, work, templates, candidates, 
+                            nCandidates, scores);
+   }
+   else if(query->engine == ALIGN_BIOPLIB)
+   {
+      char alignSeqres[HUGEBUFF+1],
+           alignRef[HUGEBUFF+1];
+      
+      for(i=0; i<nCandidates; i++)
+         scores[i] = CompareSeqs(query, 
+                                 &(templates->templates[candidates[i]]),
+                                 work, alignSeqres, alignRef);
+   }
+   else
+   {
+      for(i=0; i<nCandidates; i++)
+         scores[i] = ScoreAlignment(query, 
+                                    &(templates->templates[candidates[i]]),
+                                    work);
+   }
+}
+
+
+/************************************************************************/
+/*>BOOL AlignSequenceFile(char *templateFile, char *seqFile)
+   ---------------------------------------------------------
+*//**
+   \param[in]   templateFile  FASTA file of templates (in the format of
+                              the installed template file)
+   \param[in]   seqFile       FASTA file of query sequences
+   \return                    Success
+
+   Aligns every query sequence against every template with the selected
+   engine and prints the score from ScoreTemplates(), the score from
+   CompareSeqs() and the alignment for each pair. The output for two
+   engines should be identical, so this is used to check the native
+   engines against blAffinealign() and the batched engine against the
+   others.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL AlignSequenceFile(char *templateFile, char *seqFile)
+{
+   FILE        *fp;
+   TEMPLATELIB *templates;
+   char        header[MAXBUFF+1],
+               alignSeqres[HUGEBUFF+1],
+               alignRef[HUGEBUFF+1],
+               *seq;
+   int         *candidates,
+               i;
+   REAL        *scores;
+
+   /* The mutation matrix is needed for the score matrix and for 
+      blAffinealign()
+   */
+   blReadMDM(SCOREMATRIX);
+   if((fp=fopen(templateFile, "r"))==NULL)
+      return(FALSE);
+   templates = ReadTemplateLibrary(fp);
+   fclose(fp);
+   if(templates == NULL)
+      return(FALSE);
+
+   templates->maxSeqLen = 0;
+   for(i=0; i<templates->nTemplates; i++)
+   {
+      if(templates->templates[i].seqLen > templates->maxSeqLen)
+         templates->maxSeqLen = templates->templates[i].seqLen;
+   }
+
+   if(((candidates = (int *)malloc(templates->nTemplates * sizeof(int)))
+       == NULL) ||
+      ((scores = (REAL *)malloc(templates->nTemplates * sizeof(REAL)))
+       == NULL))
+   {
+      FreeTemplateLibrary(templates);
+      return(FALSE);
+   }
+   for(i=0; i<templates->nTemplates; i++)
+      candidates[i] = i;
+
+   if((fp=fopen(seqFile, "r"))==NULL)
+   {
+      free(candidates);
+      free(scores);
+      FreeTemplateLibrary(templates);
+      return(FALSE);
+   }
+
+   while((seq = blReadFASTA(fp, header, MAXBUFF))!=NULL)
+   {
+      ALIGNQUERY *query;
+      ALIGNWORK  *work;
+
+      if(((query = PrepareAlignQuery(seq, templates->scoreMatrix,
+                                     gAlignEngine)) == NULL) ||
+         ((work = AllocAlignWork(query, templates->maxSeqLen)) == NULL))
+      {
+         fprintf(stderr,"Error (%s): No memory for template \
+alignment\n", PROGNAME);
+         exit(1);
+      }
+
+      ScoreTemplates(query, work, templates, candidates, 
+                     templates->nTemplates, scores);
+      for(i=0; i<templates->nTemplates; i++)
+      {
+         REAL score;
+         
+         score = CompareSeqs(query, &(templates->templates[i]), work,
+                             alignSeqres, alignRef);
+         printf("%s %s %.6f %.6f\n%s\n%s\n", header,
+                templates->templates[i].header, scores[i], score,
+                alignSeqres, alignRef);
+      }
+
+      FreeAlignWork(work);
+      FreeAlignQuery(query);
+      free(seq);
+   }
+
+   fclose(fp);
+   free(candidates);
+   free(scores);
+   FreeTemplateLibrary(templates);
+   
+   return(TRUE);
+}
+
+
+/************************************************************************/
+/*>THREADPOOL *CreateThreadPool(int nThreads)
+   ------------------------------------------
+*//**
+   \param[in]   nThreads    Total number of threads to scan with 
+                            (including the main thread)
+   \return                  The thread pool (NULL on failure)
+
+   Starts nThreads-1 worker threads for scanning the templates. The 
+   main thread joins in with each scan.
+
+-  17.10.26 Original   By: agent
+*/
+THREADPOOL *CreateThreadPool(int nThreads)
+{
+   THREADPOOL *pool;
+   int        i;
+   
+   if((pool = (THREADPOOL *)malloc(sizeof(THREADPOOL)))==NULL)
+      return(NULL);
+
+   pool->nThreads  = 0;
+   pool->job       = NULL;
+   pool->jobNumber = 0;
+   pool->shutdown  = FALSE;
+   pthread_mutex_init(&(pool->lock), NULL);
+   pthread_cond_init(&(pool->workReady), NULL);
+   pthread_cond_init(&(pool->workDone), NULL);
+
+   if((pool->threads = (pthread_t *)malloc(nThreads * sizeof(pthread_t)))
+      == NULL)
+   {
+      FreeThreadPool(pool);
+      return(NULL);
+   }
+   
+   for(i=0; i<nThreads-1; i++)
+   {
+      if(pthread_create(&(pool->threads[i]), NULL, ScanWorker, pool))
+      {
+         FreeThreadPool(pool);
+         return(NULL);
+      }
+      pool->nThreads++;
+   }
+
+   return(pool);
+}
+
+
+/************************************************************************/
+/*>void FreeThreadPool(THREADPOOL *pool)
+   -------------------------------------
+*//**
+   \param[in]   pool     Thread pool from CreateThreadPool()
+
+   Stops the worker threads and frees the pool
+
+-  17.10.26 Original   By: agent
+*/
+void FreeThreadPool(THREADPOOL *pool)
+{
+   int i;
+   
+   if(pool == NULL)
+      return;
+
+   pthread_mutex_lock(&(pool->lock));
+   pool->shutdown = TRUE;
+   pthread_cond_broadcast(&(pool->workReady));
+   pthread_mutex_unlock(&(pool->lock));
+
+   for(i=0; i<pool->nThreads; i++)
+      pthread_join(pool->threads[i], NULL);
+
+   pthread_mutex_destroy(&(pool->lock));
+   pthread_cond_destroy(&(pool->workReady));
+   pthread_cond_destroy(&(pool->workDone));
+   FREE(pool->threads);
+   free(pool);
+}
+
+
+/************************************************************************/
+/*>static void RunScanJob(THREADPOOL *pool, SCANJOB *job, 
+                           ALIGNWORK *work)
+   ------------------------------------------------------
+*//**
+   \param[in]     pool    The thread pool
+   \param[in,out] job     The scan
+   \param[in]     work    This thread's workspace for the query
+
+   Claims chunks of candidates from the job and scores them until there
+   are none left. Each thread has its own alignment workspace and 
+   writes only to the scores for the candidates it claimed.
+
+-  17.10.26 Original   By: agent
+*/
+static void RunScanJob(THREADPOOL *pool, SCANJOB *job, ALIGNWORK *work)
+{
+   while(TRUE)
+   {
+      int first, count;
+      
+      pthread_mutex_lock(&(pool->lock));
+      first = job->nextCandidate;
+      count = MIN(job->chunkSize, job->nCandidates - first);
+      job->nextCandidate += count;
+      pthread_mutex_unlock(&(pool->lock));
+
+      if(count <= 0)
+         break;
+
+      ScoreTemplates(job->query, work, job->templates, 
+                     job->candidates + first, count, job->scores + first);
+   }
+}
+
+
+/************************************************************************/
+/*>static void *ScanWorker(void *arg)
+   ----------------------------------
+*//**
+   \param[in]   arg     The thread pool
+
+   Worker thread. Waits for each new scan, joins in with it and then 
+   reports that it has finished. The thread keeps its alignment
+   workspace from one scan to the next, only growing it for a longer
+   query.
+
+-  17.10.26 Original   By: agent
+*/
+static void *ScanWorker(void *arg)
+{
+   THREADPOOL *pool   = (THREADPOOL *)arg;
+   ALIGNWORK  *work   = NULL;
+   ULONG      lastJob = 0;
+   
+   while(TRUE)
+   {
+      SCANJOB *job;
+      
+      pthread_mutex_lock(&(pool->lock));
+      while(!pool->shutdown && (pool->jobNumber == lastJob))
+         pthread_cond_wait(&(pool->workReady), &(pool->lock));
+      if(pool->shutdown)
+      {
+         pthread_mutex_unlock(&(pool->lock));
+         break;
+      }
+      lastJob = pool->jobNumber;
+      job     = pool->job;
+      pthread_mutex_unlock(&(pool->lock));
+
+      if((work = GrowAlignWork(work, job->query, 
+                               job->templates->maxSeqLen))!=NULL)
+         RunScanJob(pool, job, work);
+
+      pthread_mutex_lock(&(pool->lock));
+      if(work == NULL)
+         job->failed = TRUE;
+      if(--(job->nActive) == 0)
+         pthread_cond_signal(&(pool->workDone));
+      pthread_mutex_unlock(&(pool->lock));
+   }
+
+   FreeAlignWork(work);
+   return(NULL);
+}
+
+
+/************************************************************************/
+/*>BOOL ScoreTemplatesThreaded(THREADPOOL *pool, ALIGNQUERY *query,
+                               ALIGNWORK *work, TEMPLATELIB *templates,
+                               int *candidates, int nCandidates, 
+                               REAL *scores)
+   -------------------------------------------------------------------
+*//**
+   \param[in]   pool         Thread pool from CreateThreadPool()
+   \param[in]   query        Prepared query
+   \param[in]   work         Workspace for the main thread
+   \param[in]   templates    The template library
+   \param[in]   candidates   Template numbers to score
+   \param[in]   nCandidates  Number of candidates
+   \param[out]  scores       Identity score for each candidate
+   \return                   Success
+
+   Version of ScoreTemplates() that shares the candidates between the
+   threads in the pool. The scores are the same as ScoreTemplates() 
+   gives, whatever the number of threads. The batch engine hands out
+   up to BATCHLANES candidates at a time, but fewer when there are not
+   enough candidates to give every thread a full batch.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL ScoreTemplatesThreaded(THREADPOOL *pool, ALIGNQUERY *query,
+                            ALIGNWORK *work, TEMPLATELIB *templates,
+                            int *candidates, int nCandidates, 
+                            REAL *scores)
+{
+   SCANJOB job;
+   int     nThreads = pool->nThreads + 1;
+
+   job.query         = query;
+   job.templates     = templates;
+   job.candidates    = candidates;
+   job.nCandidates   = nCandidates;
+   job.nextCandidate = 0;
+   job.chunkSize     = 1;
+   if(query->engine == ALIGN_BATCH)
+   {
+      job.chunkSize  = MIN(BATCHLANES, 
+                           (nCandidates + nThreads - 1) / nThreads);
+      job.chunkSize  = MAX(job.chunkSize, 1);
+   }
+   job.nActive       = pool->nThreads;
+   job.scores        = scores;
+   job.failed        = FALSE;
+
+   pthread_mutex_lock(&(pool->lock));
+   pool->job = &job;
+   pool->jobNumber++;
+   pthread_cond_broadcast(&(pool->workReady));
+   pthread_mutex_unlock(&(pool->lock));
+
+   /* The main thread joins in and then waits for the workers           */
+   RunScanJob(pool, &job, work);
+
+   pthread_mutex_lock(&(pool->lock));
+   while(job.nActive > 0)
+      pthread_cond_wait(&(pool->workDone), &(pool->lock));
+   pool->job = NULL;
+   pthread_mutex_unlock(&(pool->lock));
+
+   return(!job.failed);
+}
+
+
+/************************************************************************/
+/*>REAL ScanTemplates(ALIGNQUERY *query, ALIGNWORK *work,
+                      TEMPLATELIB *templates, int *candidates,
+                      int nCandidates, TEMPLATE **pBestMatch)
+   ----------------------------------------------------------------------
+*//**
+   \param[in]   query            The (masked) chain sequence prepared
+                                 for alignment
+   \param[in]   work             Alignment workspace
+   \param[in]   templates        The template library
+   \param[in]   candidates       Template numbers to align against
+   \param[in]   nCandidates      Number of candidates
+   \param[out]  pBestMatch       The best matching template (NULL if 
+                                 none scored above zero)
+   \return                       Score for the best template
+
+   Scores the sequence against each of the candidate templates and
+   returns the best. The first template wins on equal scores (the
+   candidates are in template order so this is the lowest numbered
+   template). Only the scores are calculated (except with the bioplib
+   engine) - the alignment with the best template is left to the 
+   caller. If there is a thread pool, the candidates are shared 
+   between the threads; the result does not depend on the number of
+   threads.
+
+-  17.10.26 Original   By: agent
+*/
+REAL ScanTemplates(ALIGNQUERY *query, ALIGNWORK *work,
+                   TEMPLATELIB *templates, int *candidates,
+                   int nCandidates, TEMPLATE **pBestMatch)
+{
+   REAL maxScore = 0.0,
+        *scores;
+   int  i;
+
+   *pBestMatch = NULL;
+
+   if((scores = (REAL *)malloc(nCandidates * sizeof(REAL)))==NULL)
+   {
+      fprintf(stderr,"Error (%s): No memory for template scores\n",
+              PROGNAME);
+      exit(1);
+   }
+   
+   /* blAffinealign() is not thread safe so the bioplib engine always 
+      runs in the main thread
+   */
+   if((gThreadPool != NULL) && (query->engine != ALIGN_BIOPLIB))
+   {
+      if(!ScoreTemplatesThreaded(gThreadPool, query, work, templates, 
+                                 candidates, nCandidates, scores))
+      {
+         fprintf(stderr,"Error (%s): No memory for template \
+alignment\n", PROGNAME);
+         exit(1);
+      }
+   }
+   else
+   {
+      ScoreTemplates(query, work, templates, candidates, nCandidates,
+                     scores);
+   }
+   
+   for(i=0; i<nCandidates; i++)
+   {
+      if(scores[i] > maxScore)
+      {
+         maxScore    = scores[i];
+         *pBestMatch = &(templates->templates[candidates[i]]);
+      }
+   }
+
+   free(scores);
+   return(maxScore);
+}
+
+
+/************************************************************************/
+/*>int NextResidualSegment(char *seq, char *chainSeq, int pos, 
+                           int *segLen)
+   -------------------------------------------------------------
+*//**
+   \param[in]   seq       The chain sequence with domains masked as X
+   \param[in]   chainSeq  The unmasked chain sequence
+   \param[in]   pos       Position at which to start looking
+   \param[out]  segLen    Length of the segment
+   \return                Start of the next segment (-1 if none)
+
+   Finds the next residual segment - a maximal run of positions that have
+   not been masked as part of a domain. X characters that were in the
+   original chain sequence (unknown residues) do not split a segment.
+
+-  17.10.26 Original   By: agent
+*/
+int NextResidualSegment(char *seq, char *chainSeq, int pos, int *segLen)
+{
+   int start;
+
+   /* Skip masked positions                                             */
+   while((seq[pos] != '\0') && (seq[pos] == 'X') && (chainSeq[pos] != 'X'))
+      pos++;
+   if(seq[pos] == '\0')
+      return(-1);
+
+   /* Find the end of the segment                                       */
+   for(start=pos; 
+       (seq[pos] != '\0') && !((seq[pos] == 'X') && (chainSeq[pos] != 'X'));
+       pos++);
+
+   *segLen = pos - start;
+   return(start);
+}
+
+
+/************************************************************************/
+/*>REAL FindBestTemplate(ALIGNQUERY *query, ALIGNWORK *work, 
+                         int *candidates, int *ranking,
+                         TEMPLATELIB *templates, TEMPLATE **pBestMatch)
+   ----------------------------------------------------------------
+*//**
+   \param[in]   query        The sequence to match, prepared for
+                             alignment
+   \param[in]   work         Alignment workspace for the query
+   \param[out]  candidates   Space for a candidate list as long as the
+                             template library
+   \param[out]  ranking      Space for a template ranking as long as the
+                             template library
+   \param[in]   templates    The template library
+   \param[out]  pBestMatch   The best matching template (NULL if none)
+   \return                   Score for the best matching template
+
+   Finds the best matching template for a sequence. Only the k-mer 
+   shortlist is aligned unless that fails to find an antibody, when the
+   rest of the library is taken from the same k-mer ranking. Templates
+   are ranked on score alone.
+
+-  17.10.26 Original (split from CheckAndMask())   By: agent
+*/
+REAL FindBestTemplate(ALIGNQUERY *query, ALIGNWORK *work, 
+                      int *candidates, int *ranking, 
+                      TEMPLATELIB *templates, TEMPLATE **pBestMatch)
+{
+   REAL        maxScore;
+   int         nCandidates;
+
+   *pBestMatch = NULL;
+
+   /* Find the best match in the reference sequences, first aligning
+      only against the templates that share most k-mers. The candidate
+      list is used for the counts while ranking.
+   */
+   if((gShortlist > 0) && (gShortlist < templates->nTemplates))
+      RankTemplates(query->seq, templates, candidates, ranking);
+   nCandidates = ShortlistTemplates(ranking, templates, gShortlist,
+                                    candidates);
+   maxScore    = ScanTemplates(query, work, templates,
+                               candidates, nCandidates, pBestMatch);
+
+   /* If the shortlist didn't find an antibody, check the rest          */
+   if((maxScore <= ABTHRESHOLD) &&
+      (nCandidates < templates->nTemplates))
+   {
+      TEMPLATE *restMatch = NULL;
+      REAL     restScore;
+
+      nCandidates = ShortlistTemplates(ranking, templates, -gShortlist,
+                                       candidates);
+      restScore   = ScanTemplates(query, work, templates,
+                                  candidates, nCandidates, &restMatch);
+      if(restScore > maxScore)
+      {
+         maxScore    = restScore;
+         *pBestMatch = restMatch;
+      }
+   }
+
+   return(maxScore);
+}
+
+
+/************************************************************************/
+/*>REAL AlignBestTemplate(char *seqresSeq, char *chainSeq,
+                          TEMPLATELIB *templates, TEMPLATE **pBestMatch,
+                          char *alignSeqres, char *alignRef)
+   ----------------------------------------------------------------------
+*//**
+   \param[in]   seqresSeq    The chain sequence with domains masked as X
+   \param[in]   chainSeq     The unmasked chain sequence
+   \param[in]   templates    The template library
+   \param[out]  pBestMatch   The best matching template (NULL if none)
+   \param[out]  alignSeqres  The chain sequence alignment
+   \param[out]  alignRef     The template alignment
+   \return                   Score for the best matching template
+
+   Finds the best matching template for the unmasked part of the 
+   sequence. Only the residual segments left between the domains already
+   masked are scanned against the template library - segments too short
+   to hold a domain are skipped. The alignment of the best segment with
+   its template gives the score and is returned padded out to the whole
+   (masked) chain, with the rest of the chain against gaps, for the 
+   masking and residue assignments. The query, workspace and candidate
+   list are shared by all the segments.
+
+-  17.10.26 Original (split from CheckAndMask())   By: agent
+*/
+REAL AlignBestTemplate(char *seqresSeq, char *chainSeq,
+                       TEMPLATELIB *templates, TEMPLATE **pBestMatch,
+                       char *alignSeqres, char *alignRef)
+{
+   REAL        maxScore = 0.0;
+   char        segment[MAXSEQ];
+   TEMPLATE    *bestMatch = NULL;
+   int         segStart = 0,
+               segLen,
+               bestStart = 0,
+               bestLen   = 0,
+               alignLen,
+               tailLen,
+               *candidates,
+               *ranking;
+   ALIGNQUERY  *query;
+   ALIGNWORK   *work;
+
+   alignSeqres[0] = alignRef[0] = '\0';
+   *pBestMatch    = NULL;
+
+   /* Size the query and workspace for the whole chain                  */
+   if(((candidates = (int *)malloc(templates->nTemplates * sizeof(int)))
+       == NULL) ||
+      ((ranking    = (int *)malloc(templates->nTemplates * sizeof(int)))
+       == NULL) ||
+      ((query = PrepareAlignQuery(seqresSeq, templates->scoreMatrix,
+                                  gAlignEngine)) == NULL) ||
+      ((work = AllocAlignWork(query, templates->maxSeqLen)) == NULL))
+   {
+      fprintf(stderr,"Error (%s): No memory for template alignment\n",
+              PROGNAME);
+      exit(1);
+   }
+
+   /* Find the best template over the residual segments                 */
+   while((segStart = NextResidualSegment(seqresSeq, chainSeq, segStart,
+                                         &segLen)) >= 0)
+   {
+      TEMPLATE *segMatch;
+      REAL     segScore;
+
+      strncpy(segment, seqresSeq+segStart, segLen);
+      segment[segLen] = '\0';
+      segStart += segLen;
+
+      if(RealSeqLen(segment) < MINSEQLEN)
+         continue;
+
+      /* The workspace is big enough so this only lays it out again   */
+      ReloadAlignQuery(query, segment);
+      work     = GrowAlignWork(work, query, templates->maxSeqLen);
+      segScore = FindBestTemplate(query, work, candidates, ranking,
+                                  templates, &segMatch);
+      if((segMatch != NULL) && 
+         ((bestMatch == NULL) || (segScore > maxScore)))
+      {
+         maxScore  = segScore;
+         bestMatch = segMatch;
+         bestStart = segStart - segLen;
+         bestLen   = segLen;
+      }
+   }
+
+   if(bestMatch != NULL)
+   {
+      /* Align the best segment and pad the alignment out to the whole
+         chain
+      */
+      strncpy(segment, seqresSeq+bestStart, bestLen);
+      segment[bestLen] = '\0';
+      ReloadAlignQuery(query, segment);
+      work     = GrowAlignWork(work, query, templates->maxSeqLen);
+      maxScore = CompareSeqs(query, bestMatch, work, 
+                             alignSeqres, alignRef);
+
+      alignLen = strlen(alignSeqres);
+      tailLen  = strlen(seqresSeq) - bestStart - bestLen;
+      memmove(alignSeqres+bestStart, alignSeqres, alignLen);
+      memmove(alignRef+bestStart,    alignRef,    alignLen);
+      strncpy(alignSeqres, seqresSeq, bestStart);
+      memset(alignRef, '-', bestStart);
+      alignLen += bestStart;
+      strcpy(alignSeqres+alignLen, seqresSeq+bestStart+bestLen);
+      memset(alignRef+alignLen, '-', tailLen);
+      alignRef[alignLen+tailLen] = '\0';
+   }
+
+   free(candidates);
+   free(ranking);
+   FreeAlignWork(work);
+   FreeAlignQuery(query);
+
+   *pBestMatch = bestMatch;
+   return(maxScore);
+}
+
+
+/************************************************************************/
+/*>BOOL CheckAndMask(char *seqresSeq, char *chainSeq, int nFound,
+                     TEMPLATELIB *templates, PDBCHAIN *chain, 
+                     DOMAIN **pDomains, CHAINHIT *chainHit,
+                     ARENA *arena)
+   ----------------------------------------------------------
+*//**
+   \param[in,out] seqresSeq   The chain sequence - the domain found is
+                              masked with X characters
+   \param[in]     chainSeq    The unmasked chain sequence
+   \param[in]     nFound      Domains already found in the chain
+   \param[in]     templates   The template library
+   \param[in]     chain       The chain being processed
+   \param[in,out] pDomains    The list of domains
+   \param[in,out] chainHit    Cache entry for the chain sequence to
+                              which the domain is added (or NULL)
+   \param[in]     arena       Arena for the domains
+   \return                    Was a domain found?
+
+   Finds the best matching template for the (unmasked part of the) 
+   sequence and, if it scores above threshold, masks it and adds a
+   domain to the list. The persistent alignment cache is checked before
+   doing any alignment.
+
+-  17.09.21 Original   By: ACRM
+-  17.10.26 Uses the template library rather than re-reading the FASTA
+            file. Only the k-mer shortlist is aligned unless that fails
+            to find an antibody. Templates are ranked on score alone
+            and only the best is aligned. Scans only the residual
+            segments. Records the domain in the chain sequence cache.
+            Uses the persistent alignment cache   By: agent
+*/
+BOOL CheckAndMask(char *seqresSeq, char *chainSeq, int nFound,
+                  TEMPLATELIB *templates, PDBCHAIN *chain,
+                  DOMAIN **pDomains, CHAINHIT *chainHit, ARENA *arena)
+{
+   REAL        maxScore = 0.0;
+   char        bestAlignSeqres[HUGEBUFF+1],
+               bestAlignRef[HUGEBUFF+1];
+   TEMPLATE    *bestMatch = NULL;
+   BOOL        found = FALSE;
+
+   if(RealSeqLen(seqresSeq) < MINSEQLEN)
+      return(FALSE);
+
+   if((gAlignCache == NULL) ||
+      !LookupAlignCache(gAlignCache, chainSeq, nFound, templates,
+                        &bestMatch, &maxScore,
+                        bestAlignSeqres, bestAlignRef))
+   {
+      maxScore = AlignBestTemplate(seqresSeq, chainSeq, templates,
+                                   &bestMatch, 
+                                   bestAlignSeqres, bestAlignRef);
+      if(gAlignCache != NULL)
+         StoreAlignCache(gAlignCache, chainSeq, nFound, templates,
+                         (maxScore > ABTHRESHOLD)?bestMatch:NULL, 
+                         maxScore, bestAlignSeqres, bestAlignRef);
+   }
+
+#ifdef DEBUG
+   printf("MaxScore : %f\n", maxScore);
+   printf("Sequence : %s\n", bestAlignSeqres);
+   printf("Reference: %s\n", bestAlignRef);
+#endif
+   
+   /* If we found an antibody sequence                                  */
+   if((bestMatch != NULL) && (maxScore > ABTHRESHOLD))
+   {
+      DOMAIN *d;
+      
+      if(gVerbose)
+      {
+         fprintf(stderr, "Best match: %s Score: %.4f\n",
+                 bestMatch->header, maxScore);
+         fprintf(stderr, "SEQ: %s\n",   bestAlignSeqres);
+         fprintf(stderr, "REF: %s\n\n", bestAlignRef);
+      }
+      
+      d = MaskAndAssignDomain(seqresSeq, chain, bestMatch,
+                              bestAlignSeqres, bestAlignRef, pDomains,
+                              arena);
+      if(chainHit != NULL)
+         RecordDomainHit(chainHit, d, bestMatch, maxScore,
+                         bestAlignSeqres, bestAlignRef);
+#ifdef DEBUG
+      printf("Masked   : %s\n", seqresSeq);
+#endif
+      found = TRUE;
+   }
+   
+   return(found);
+}
+
+
+/************************************************************************/
+/* Uses the chain type from the template library (taken from the label
+   in the FASTA file) to set the chain type as heavy or light
+*/
+void SetChainAsLightOrHeavy(DOMAIN *domain, TEMPLATE *template)
+{
+   domain->chainType = template->chainType;
+}
+
+
+/************************************************************************/
+/*>ALIGNMAP *BuildAlignMap(char *seqAln, char *refAln)
+   ---------------------------------------------------
+*//**
+   \param[in]   seqAln   The chain sequence alignment
+   \param[in]   refAln   The template alignment
+   \return               Coordinate maps for the alignment
+
+   Builds the maps between alignment columns and chain and template 
+   residues in a single pass so that masking and the interface, CDR and
+   residue number assignments don't have to rescan the alignment.
+
+-  17.10.26 Original   By: agent
+*/
+ALIGNMAP *BuildAlignMap(char *seqAln, char *refAln)
+{
+   ALIGNMAP *map;
+   int      alignLen = strlen(seqAln),
+            col,
+            nSeq = 0,
+            nRef = 0;
+
+   /* Each residue has a column so seqLen and refLen are <= alignLen   */
+   if(((map = (ALIGNMAP *)malloc(sizeof(ALIGNMAP))) == NULL) ||
+      ((map->seqPos = (int *)malloc((5*alignLen + 1) * sizeof(int))) 
+       == NULL))
+   {
+      fprintf(stderr,"Error (%s): No memory for alignment map\n",
+              PROGNAME);
+      exit(1);
+   }
+   map->alignLen = alignLen;
+   map->refPos   = map->seqPos   + alignLen;
+   map->refCount = map->refPos   + alignLen;
+   map->seqCol   = map->refCount + alignLen + 1;
+   map->refCol   = map->seqCol   + alignLen;
+
+   for(col=0; col<alignLen; col++)
+   {
+      if(seqAln[col] != '-')
+      {
+         map->seqCol[nSeq] = col;
+         map->seqPos[col]  = nSeq++;
+      }
+      else
+      {
+         map->seqPos[col]  = -1;
+      }
+
+      if(refAln[col] != '-')
+      {
+         map->refCol[nRef] = col;
+         map->refPos[col]  = nRef++;
+      }
+      else
+      {
+         map->refPos[col]  = -1;
+      }
+      map->refCount[col] = nRef;
+   }
+   
+   /* The key residue assignment has always looked one column beyond the
+      end of the alignment and counted the terminator as a residue
+   */
+   map->refCount[alignLen] = nRef + 1;
+   map->seqLen = nSeq;
+   map->refLen = nRef;
+   
+   return(map);
+}
+
+
+/************************************************************************/
+/*>void FreeAlignMap(ALIGNMAP *map)
+   --------------------------------
+*//**
+   \param[in]   map   Alignment map to free
+
+-  17.10.26 Original   By: agent
+*/
+void FreeAlignMap(ALIGNMAP *map)
+{
+   if(map != NULL)
+   {
+      FREE(map->seqPos);
+      free(map);
+   }
+}
+
+
+/************************************************************************/
+/*>int SetKeyResidues(ALIGNMAP *map, UBYTE *refKeyBits, int nRefKeyBits,
+                      int startSeqRes, int *keys)
+   ---------------------------------------------------------------------
+*//**
+   \param[in]   map          Alignment map
+   \param[in]   refKeyBits   Key template positions as a bit set
+   \param[in]   nRefKeyBits  Size of the bit set
+   \param[in]   startSeqRes  Start of the domain in the chain
+   \param[out]  keys         Key positions in the domain (NULL just to
+                             count them)
+   \return                   Number of key positions
+
+   Transfers key (interface or CDR) positions from the template to the
+   domain. Alignment columns are numbered from 1 and a column is a key
+   position if the number of template residues up to and including it
+   is in the template's list.
+
+-  17.10.26 Original (replaces IsKeyResidue())   By: agent
+*/
+int SetKeyResidues(ALIGNMAP *map, UBYTE *refKeyBits, int nRefKeyBits,
+                   int startSeqRes, int *keys)
+{
+   int col,
+       refPos,
+       nKeys = 0;
+
+   for(col=1; col<=map->alignLen; col++)
+   {
+      refPos = map->refCount[col];
+      if((refPos < nRefKeyBits) && BITTEST(refKeyBits, refPos))
+      {
+         if(keys != NULL)
+            keys[nKeys] = col - startSeqRes;
+         nKeys++;
+      }
+   }
+
+   return(nKeys);
+}
+
+
+/************************************************************************/
+/* TODO!
+   This needs to take the alignment and translate the residues numbers
+   to the PDB sequential number instead of what is in the FASTA file
+   header
+*/
+void SetIFResidues(DOMAIN *domain, TEMPLATE *template, ALIGNMAP *map)
+{
+#ifdef DEBUG
+   printf(">>> seqLen = %d\n", map->alignLen);
+#endif
+
+   domain->nInterface = 0;
+   if(template->nIFRes)
+      domain->nInterface = SetKeyResidues(map, template->IFBits, 
+                                          template->seqLen + 2,
+                                          domain->startSeqRes, NULL);
+   domain->interface = (int *)ArenaAlloc(domain->arena,
+                                         (domain->nInterface+1) *
+                                         sizeof(int));
+   if(domain->nInterface)
+      SetKeyResidues(map, template->IFBits, template->seqLen + 2,
+                     domain->startSeqRes, domain->interface);
+}
+
+/************************************************************************/
+void SetCDRResidues(DOMAIN *domain, TEMPLATE *template, ALIGNMAP *map)
+{
+   domain->nCDRRes = 0;
+
+   if(template->nCDRRes)
+      domain->nCDRRes = SetKeyResidues(map, template->CDRBits, 
+                                       template->seqLen + 2,
+                                       domain->startSeqRes, NULL);
+   domain->CDRRes = (int *)ArenaAlloc(domain->arena,
+                                      (domain->nCDRRes+1) * sizeof(int));
+   if(domain->nCDRRes)
+      SetKeyResidues(map, template->CDRBits, template->seqLen + 2,
+                     domain->startSeqRes, domain->CDRRes);
+}
+
+
+/************************************************************************/
+int TransferResnum(ALIGNMAP *map, int refResnum)
+{
+   /* The position of interest is missing in the atom sequence          */
+   return(map->seqPos[refResnum]);
+}
+
+
+
+/************************************************************************/
+/*>void SetDomainKeyBits(DOMAIN *domain)
+   -------------------------------------
+*//**
+   \param[in,out]  domain   The domain
+
+   Builds bit sets of the CDR and interface residues of a domain for the
+   ISCDRRES() and ISINTERFACERES() tests. The bit sets cover the range of
+   residue numbers in the two lists.
+
+-  17.10.26 Original   By: agent
+*/
+void SetDomainKeyBits(DOMAIN *domain)
+{
+   int i,
+       minRes = 0,
+       maxRes = -1,
+       nBytes;
+
+   for(i=0; i<domain->nCDRRes; i++)
+   {
+      if((maxRes < minRes) || (domain->CDRRes[i] < minRes))
+         minRes = domain->CDRRes[i];
+      if((maxRes < minRes) || (domain->CDRRes[i] > maxRes))
+         maxRes = domain->CDRRes[i];
+   }
+   for(i=0; i<domain->nInterface; i++)
+   {
+      if((maxRes < minRes) || (domain->interface[i] < minRes))
+         minRes = domain->interface[i];
+      if((maxRes < minRes) || (domain->interface[i] > maxRes))
+         maxRes = domain->interface[i];
+   }
+
+   domain->keyBase  = minRes;
+   domain->nKeyBits = maxRes - minRes + 1;
+   nBytes           = BITSETBYTES(domain->nKeyBits);
+   domain->CDRBits  = (UBYTE *)ArenaAlloc(domain->arena, 2*nBytes + 1);
+   domain->IFBits   = domain->CDRBits + nBytes;
+
+   for(i=0; i<domain->nCDRRes; i++)
+      BITSET(domain->CDRBits, domain->CDRRes[i] - minRes);
+   for(i=0; i<domain->nInterface; i++)
+      BITSET(domain->IFBits, domain->interface[i] - minRes);
+}
+
+
+/************************************************************************/
+/*>ARENA *CreateArena(size_t blockSize)
+   ------------------------------------
+*//**
+   \param[in]   blockSize   Size of each block of memory
+   \return                  The arena (NULL if no memory)
+
+   Creates an arena from which memory can be allocated in small pieces
+   and then all freed at once
+
+-  17.10.26 Original   By: agent
+*/
+ARENA *CreateArena(size_t blockSize)
+{
+   ARENA *arena;
+
+   if((arena = (ARENA *)malloc(sizeof(ARENA)))!=NULL)
+   {
+      arena->blocks    = NULL;
+      arena->blockSize = blockSize;
+   }
+   return(arena);
+}
+
+
+/************************************************************************/
+/*>void *ArenaAlloc(ARENA *arena, size_t size)
+   -------------------------------------------
+*//**
+   \param[in]   arena   The arena
+   \param[in]   size    Bytes required
+   \return              Zeroed memory, aligned for any type
+
+   Allocates memory from an arena. A new block is started if the current
+   one is full; requests larger than the block size get a block of their
+   own. Exits if there is no memory.
+
+-  17.10.26 Original   By: agent
+*/
+void *ArenaAlloc(ARENA *arena, size_t size)
+{
+   ARENABLOCK *block = arena->blocks;
+   size_t     header = (sizeof(ARENABLOCK) + 15) & ~(size_t)15;
+   char       *mem;
+
+   size = (size + 15) & ~(size_t)15;
+   if((block == NULL) || (block->used + size > block->size))
+   {
+      size_t blockSize = MAX(arena->blockSize, size);
+
+      if((block = (ARENABLOCK *)malloc(header + blockSize))==NULL)
+      {
+         fprintf(stderr,"Error (%s): No memory for domains\n", PROGNAME);
+         exit(1);
+      }
+      block->size   = blockSize;
+      block->used   = 0;
+      block->next   = arena->blocks;
+      arena->blocks = block;
+   }
+
+   mem          = (char *)block + header + block->used;
+   block->used += size;
+   memset(mem, 0, size);
+   return((void *)mem);
+}
+
+
+/************************************************************************/
+/*>void FreeArena(ARENA *arena)
+   ----------------------------
+*//**
+   \param[in]   arena   The arena
+
+   Frees an arena and everything allocated from it
+
+-  17.10.26 Original   By: agent
+*/
+void FreeArena(ARENA *arena)
+{
+   ARENABLOCK *block, *next;
+
+   if(arena != NULL)
+   {
+      for(block=arena->blocks; block!=NULL; block=next)
+      {
+         next = block->next;
+         free(block);
+      }
+      free(arena);
+   }
+}
+
+
+/************************************************************************/
+/*>void AddAntigenChain(DOMAIN *domain, PDBCHAIN *chain)
+   -----------------------------------------------------
+*//**
+   \param[in,out] domain   The domain
+   \param[in]     chain    Antigen chain
+
+   Adds an antigen chain to a domain, growing the arrays of antigen
+   chains and their new labels as needed
+
+-  17.10.26 Original   By: agent
+*/
+void AddAntigenChain(DOMAIN *domain, PDBCHAIN *chain)
+{
+   if(domain->nAntigenChains == domain->maxAntigenChains)
+   {
+      PDBCHAIN **chains;
+      char     (*labels)[8];
+      int      maxChains = (domain->maxAntigenChains == 0) ? 
+                           MAXANTIGEN : 2 * domain->maxAntigenChains;
+
+      chains = (PDBCHAIN **)ArenaAlloc(domain->arena,
+                                       maxChains * sizeof(PDBCHAIN *));
+      labels = (char (*)[8])ArenaAlloc(domain->arena, maxChains * 8);
+      if(domain->nAntigenChains)
+      {
+         memcpy(chains, domain->antigenChains,
+                domain->nAntigenChains * sizeof(PDBCHAIN *));
+         memcpy(labels, domain->newAgChainLabels,
+                domain->nAntigenChains * 8);
+      }
+      domain->antigenChains    = chains;
+      domain->newAgChainLabels = labels;
+      domain->maxAntigenChains = maxChains;
+   }
+   domain->antigenChains[domain->nAntigenChains++] = chain;
+}
+
+
+/************************************************************************/
+/*>void AddHetAntigen(DOMAIN *domain, PDBRESIDUE *res)
+   ---------------------------------------------------
+*//**
+   \param[in,out] domain   The domain
+   \param[in]     res      HET antigen residue
+
+   Adds a HET antigen residue to a domain, growing the array as needed
+
+-  17.10.26 Original   By: agent
+*/
+void AddHetAntigen(DOMAIN *domain, PDBRESIDUE *res)
+{
+   if(domain->nHetAntigen == domain->maxHetAntigen)
+   {
+      PDBRESIDUE **hets;
+      int        maxHets = (domain->maxHetAntigen == 0) ? 
+                           MAXHETANTIGEN : 2 * domain->maxHetAntigen;
+
+      hets = (PDBRESIDUE **)ArenaAlloc(domain->arena,
+                                       maxHets * sizeof(PDBRESIDUE *));
+      if(domain->nHetAntigen)
+         memcpy(hets, domain->hetAntigen,
+                domain->nHetAntigen * sizeof(PDBRESIDUE *));
+      domain->hetAntigen    = hets;
+      domain->maxHetAntigen = maxHets;
+   }
+   domain->hetAntigen[domain->nHetAntigen++] = res;
+}
+
+
+/************************************************************************/
+void PrintDomains(DOMAIN *domains)
+{
+   DOMAIN *d;
+
+   printf("\n***Results\n");
+   
+   for(d=domains; d!=NULL; NEXT(d))
+   {
+      printf("Domain: %d Chain: %s Start: %d Stop: %d Type: %c \
+PairsWithDomain: %d (Chain: %s)\n",
+             d->domainNumber,
+             d->chain->chain,
+             d->startSeqRes,
+             d->lastSeqRes,
+             d->chainType,
+             (d->pairedDomain==NULL)?0:d->pairedDomain->domainNumber,
+             (d->pairedDomain==NULL)?"none":d->pairedDomain->chain->chain
+         );
+      printf("%s\n", d->domSeq);
+      if(d->nAntigenChains)
+      {
+         int i;
+         printf("   AntigenChains: ");
+         for(i=0; i<d->nAntigenChains; i++)
+         {
+            printf("%s ",d->antigenChains[i]->chain);
+         }
+         printf("\n");
+      }
+      printf("\n");
+#ifdef DEBUG
+      {
+         int i;
+         printf("IF: ");
+         for(i=0; i<d->nInterface; i++)
+         {
+            printf("%d ", d->interface[i]);
+         }
+         printf("\n\n");
+         printf("CDR: ");
+         for(i=0; i<d->nCDRRes; i++)
+         {
+            printf("%d ", d->CDRRes[i]);
+         }
+         printf("\n\n");
+      }
+      if(d->startRes) blWritePDBRecord(stdout,d->startRes);
+      if(d->lastRes)  blWritePDBRecord(stdout,d->lastRes);
+#endif
+   }
+}
+
+
+/************************************************************************/
+/*>DOMAIN *NewDomain(PDBCHAIN *chain, DOMAIN **pDomains, ARENA *arena)
+   -------------------------------------------------------------------
+*//**
+   \param[in]     chain     The chain containing the domain
+   \param[in,out] pDomains  The list of domains
+   \param[in]     arena     Arena for the domains
+   \return                  The new domain
+
+   Adds an empty domain (allocated from the arena) to the end of the 
+   list of domains. Domains in the same chain are found together, so
+   the residue index is shared with the previous domain if it is in
+   the same chain.
+
+-  17.10.26 Split from MaskAndAssignDomain()   By: agent
+*/
+DOMAIN *NewDomain(PDBCHAIN *chain, DOMAIN **pDomains, ARENA *arena)
+{
+   DOMAIN *d, *prevD;
+
+   d = (DOMAIN *)ArenaAlloc(arena, sizeof(DOMAIN));
+   if(*pDomains == NULL)
+   {
+      *pDomains = d;
+      prevD     = NULL;
+   }
+   else
+   {
+      prevD = *pDomains;
+      LAST(prevD);
+      prevD->next = d;
+   }
+   d->next           = NULL;
+   d->arena          = arena;
+   d->resIndex       = ((prevD != NULL) && (prevD->chain == chain)) ?
+                       prevD->resIndex : BuildResidueIndex(chain, arena);
+   d->startSeqRes    = -1;
+   d->lastSeqRes     = -1;
+   d->chain          = chain;
+   d->pairIntDistSq  = 100000000.0;
+   d->pairCofGDistSq = 100000000.0;
+   d->domainNumber   = (prevD==NULL)?1:prevD->domainNumber+1;
+   d->pairedDomain   = NULL;
+   d->nCDRRes        = 0;
+   d->nInterface     = 0;
+   d->nHetAntigen    = 0;
+   d->maxHetAntigen  = 0;
+   d->hetAntigen     = NULL;
+   d->nAntigenChains = 0;
+   d->maxAntigenChains = 0;
+   d->antigenChains  = NULL;
+   d->newAgChainLabels = NULL;
+   d->keyBase        = 0;
+   d->nKeyBits       = 0;
+   d->CDRBits        = NULL;
+   d->IFBits         = NULL;
+
+   return(d);
+}
+
+
+/************************************************************************/
+DOMAIN *MaskAndAssignDomain(char *seq, PDBCHAIN *chain, TEMPLATE *template,
+                            char *seqAln, char *refAln, DOMAIN **pDomains,
+                            ARENA *arena)
+{
+   int      seqPos,
+            alnPos,
+            seqLen    = strlen(seq),
+            domSeqPos = 0;
+   DOMAIN   *d;
+   ALIGNMAP *map;
+
+   d   = NewDomain(chain, pDomains, arena);
+   map = BuildAlignMap(seqAln, refAln);
+
+   /* Each domain residue is aligned with a template residue            */
+   d->domSeq = (char *)ArenaAlloc(arena, map->refLen+1);
+
+#ifdef DEBUG_SET_CDR
+   printf("SEQ      : %s\n", seqAln);
+   printf("REF      : %s\n", refAln);
+#endif
+
+   SetChainAsLightOrHeavy(d, template);
+
+   /* Mask the sequence */
+   for(alnPos=0; alnPos<map->alignLen; alnPos++)
+   {
+      seqPos = map->seqPos[alnPos];
+      
+      /* If this is an aligned position */
+      if((seqPos >= 0) && (seqPos < seqLen) &&
+         (seqAln[alnPos] != 'X') &&
+         (map->refPos[alnPos] >= 0))
+      {
+         d->domSeq[domSeqPos++] = seq[seqPos];
+         seq[seqPos] = 'X';
+         if(d->startSeqRes < 0)
+            d->startSeqRes = seqPos;
+         if(seqPos > d->lastSeqRes)
+            d->lastSeqRes = seqPos;
+      }
+   }
+
+   d->domSeq[domSeqPos] = '\0';
+
+   SetIFResidues(d,          template, map);
+   SetCDRResidues(d,         template, map);
+   SetDomainKeyBits(d);
+   FreeAlignMap(map);
+#ifdef DEBUG
+   {
+      int i;
+      
+      printf("IF Residue numbers: \n");
+      for(i=0;i<d->nInterface; i++)
+         printf("%d ", d->interface[i]);
+      printf("\n");
+      printf("CDR Residue numbers: \n");
+      for(i=0;i<d->nCDRRes; i++)
+         printf("%d ", d->CDRRes[i]);
+      printf("\n");
+   }
+#endif
+   
+   SetDomainBoundaries(d);
+   return(d);
+}
+
+/************************************************************************/
+/*>RESINDEX *BuildResidueIndex(PDBCHAIN *chain, ARENA *arena)
+   ----------------------------------------------------------
+*//**
+   \param[in]   chain   The chain
+   \param[in]   arena   Arena for the index
+   \return              Index of the residues in the chain
+
+   Builds an array of the residues in a chain that appear in the 
+   sequence from GetSequenceForChain(), together with the CA, number
+   of atoms and bounding sphere of each, so that a sequence position 
+   can be turned into a residue directly
+
+-  17.10.26 Original   By: agent
+*/
+RESINDEX *BuildResidueIndex(PDBCHAIN *chain, ARENA *arena)
+{
+   RESINDEX   *index;
+   PDBRESIDUE *r;
+   int        nRes = 0;
+
+   index = (RESINDEX *)ArenaAlloc(arena, sizeof(RESINDEX));
+   index->chain = chain;
+
+   if((chain->extras == CHAINTYPE_PROT) ||
+      (chain->extras == CHAINTYPE_NUCL))
+   {
+      for(r=chain->residues; r!=NULL; NEXT(r))
+         nRes++;
+   }
+
+   index->residues = (PDBRESIDUE **)ArenaAlloc(arena, 
+                                               (nRes+1) * 
+                                               sizeof(PDBRESIDUE *));
+   index->CA       = (PDB **)ArenaAlloc(arena, (nRes+1) * sizeof(PDB *));
+   index->nAtoms   = (int *)ArenaAlloc(arena, (nRes+1) * sizeof(int));
+   index->bounds   = (BOUNDS *)ArenaAlloc(arena, 
+                                          (nRes+1) * sizeof(BOUNDS));
+   index->nRes     = 0;
+
+   if(nRes)
+   {
+      for(r=chain->residues; r!=NULL; NEXT(r))
+      {
+         if(IsStandardResidue(r))
+         {
+            index->residues[index->nRes] = r;
+            index->CA[index->nRes]       = RESCLASS(r)->CA;
+            index->nAtoms[index->nRes]   = RESCLASS(r)->nAtoms;
+            SetBounds(r->start, r->stop, &(index->bounds[index->nRes]));
+            index->nRes++;
+         }
+      }
+   }
+
+   return(index);
+}
+
+
+/************************************************************************/
+void SetDomainBoundaries(DOMAIN *domain)
+{
+   RESINDEX *index = domain->resIndex;
+   int      i,
+            k,
+            nCoor  = 0;
+   PDB      *ca;
+
+   domain->startRes = NULL;
+   domain->stopRes  = NULL;
+   domain->lastRes  = NULL;
+   
+   /* Given the integer sequence positions, find the pointers to
+      the PDB residues for these positions
+   */
+   if((domain->startSeqRes >= 0) && (domain->startSeqRes < index->nRes))
+      domain->startRes = index->residues[domain->startSeqRes]->start;
+   if((domain->lastSeqRes > domain->startSeqRes) &&
+      (domain->lastSeqRes < index->nRes))
+   {
+      domain->lastRes = index->residues[domain->lastSeqRes]->start;
+      domain->stopRes = index->residues[domain->lastSeqRes]->stop;
+   }
+   SetBounds(domain->startRes, domain->stopRes, &(domain->bounds));
+
+   /* Find the CofG of the domain                                       */
+   domain->CofG.x = domain->CofG.y = domain->CofG.z = 0.0;
+   nCoor          = 0;
+   
+   for(i=domain->startSeqRes; i<=domain->lastSeqRes; i++)
+   {
+      if((ca = index->CA[i]) != NULL)
+      {
+#ifdef FUBAR
+         fprintf(stderr, "Calc CofG %d: %s%d%s\n",
+                 domain->domainNumber, ca->chain, ca->resnum, ca->insert);
+#endif
+         domain->CofG.x += ca->x;
+         domain->CofG.y += ca->y;
+         domain->CofG.z += ca->z;
+         nCoor++;
+      }
+   }
+   
+   domain->CofG.x /= nCoor;
+   domain->CofG.y /= nCoor;
+   domain->CofG.z /= nCoor;
+
+   /* Find the CofG of the VH/VL interface residues. Each CA is counted
+      once for every atom in its residue
+   */
+   domain->IntCofG.x = domain->IntCofG.y = domain->IntCofG.z = 0.0;
+   nCoor  = 0;
+
+   for(i=0; i<=domain->lastSeqRes-domain->startSeqRes; i++)
+   {
+      if(ISINTERFACERES(domain, i) &&
+         ((ca = index->CA[domain->startSeqRes+i]) != NULL))
+      {
+         for(k=0; k<index->nAtoms[domain->startSeqRes+i]; k++)
+         {
+            domain->IntCofG.x += ca->x;
+            domain->IntCofG.y += ca->y;
+            domain->IntCofG.z += ca->z;
+            nCoor++;
+         }
+      }
+   }
+   domain->IntCofG.x /= nCoor;
+   domain->IntCofG.y /= nCoor;
+   domain->IntCofG.z /= nCoor;
+}
+
+
+/************************************************************************/
+void PairDomains(DOMAIN *domains)
+{
+   DOMAIN *d1, *d2;
+   
+   for(d1=domains; d1!=NULL; NEXT(d1))
+   {
+      for(d2=domains; d2!=NULL; NEXT(d2))
+      {
+         if(d1 != d2)
+         {
+            REAL distCofGSq;
+            VEC3F *c1, *c2;
+            c1 = &(d1->CofG);
+            c2 = &(d2->CofG);
+            
+            distCofGSq = DISTSQ(c1, c2);
+
+#ifdef FUBAR
+            fprintf(stderr, "Chain1 %s; CofG1 %.3f %.3f %.3f; \
+Chain2 %s; CofG2 %.3f %.3f %.3f; \
+Dist %.3f\n",
+                    d1->lastRes->chain,
+                    c1->x, c1->y, c1->z, 
+                    d2->startRes->chain,
+                    c2->x, c2->y, c2->z,
+                    sqrt(distCofGSq));
+#endif
+            if((distCofGSq < COFGDISTCUTSQ) && (distCofGSq > 1.0))
+            {
+               REAL distIntSq;
+               
+               c1 = &(d1->IntCofG);
+               c2 = &(d2->IntCofG);
+               
+               distIntSq = DISTSQ(c1, c2);
+
+#ifdef FUBAR
+               fprintf(stderr, "Chain1 %s; IntCofG1 %.3f %.3f %.3f; \
+Chain2 %s; IntCofG2 %.3f %.3f %.3f; \
+Dist %.3f\n",
+                       d1->lastRes->chain,
+                       c1->x, c1->y, c1->z, 
+                       d2->startRes->chain,
+                       c2->x, c2->y, c2->z,
+                       sqrt(distIntSq));
+#endif
+
+               if(distIntSq < INTDISTCUTSQ)
+               {
+                  if(distIntSq < distCofGSq)
+                  {
+                     if(((distCofGSq < d1->pairCofGDistSq) ||
+                         (distIntSq  < d1->pairIntDistSq)) &&
+                        ((distCofGSq < d2->pairCofGDistSq) ||
+                         (distIntSq  < d2->pairIntDistSq)))
+                     {
+                        d1->pairCofGDistSq = distCofGSq;
+                        d1->pairIntDistSq  = distIntSq;
+                        d2->pairCofGDistSq = distCofGSq;
+                        d2->pairIntDistSq  = distIntSq;
+                        d1->pairedDomain = d2;
+                        d2->pairedDomain = d1;
+
+                        if(gVerbose)
+                        {
+                           printf("***Paired domain %d with %d\n",
                                   d1->domainNumber, d2->domainNumber);
                         }
                      }
                   }
                }
                
-#ifdef DEBUG
-               printf("CofG Distance (domain %d to %d): %.3f\n",
-                      d1->domainNumber, d2->domainNumber,
-                      sqrt(distCofGSq));
-               printf("Interface Distance (domain %d to %d): %.3f\n\n",
-                      d1->domainNumber, d2->domainNumber,
-                      sqrt(distIntSq));
-#endif
+#ifdef DEBUG
+               printf("CofG Distance (domain %d to %d): %.3f\n",
+                      d1->domainNumber, d2->domainNumber,
+                      sqrt(distCofGSq));
+               printf("Interface Distance (domain %d to %d): %.3f\n\n",
+                      d1->domainNumber, d2->domainNumber,
+                      sqrt(distIntSq));
+#endif
+            }
+         }
+      }
+#ifdef DEBUG
+      printf("\n");
+#endif      
+   }
+}
+
+
+/************************************************************************/
+void WriteDomains(HEADERINDEX *headers, DOMAIN *domains, char *filestem)
+{
+   DOMAIN     *d, *pd;
+   static int domCount = 0;
+   int        i;
+   off_t      memberStart = 0;
+   
+   for(d=domains; d!=NULL; NEXT(d))
+      d->used = FALSE;
+
+   /* Keep the archive to ourselves while this entry is written         */
+   if((gArchive != NULL) && !LockArchive(gArchive, F_WRLCK))
+   {
+      fprintf(stderr,"Error (%s): Unable to lock output archive\n",
+              PROGNAME);
+      exit(1);
+   }
+   
+   for(d=domains; d!=NULL; NEXT(d))
+   {
+      if(!d->used)
+      {
+         FILE *fp;
+         char outFile[MAXBUFF+1],
+              complex[8];
+         BOOL written = FALSE;
+
+         /* Assume not a complex                                        */
+         complex[0] = '\0';
+
+         for(i=0;i<d->nAntigenChains;i++)
+         {
+            if(d->antigenChains[i]->extras == CHAINTYPE_PROT)
+            {
+               strncat(complex, "P", 7-strlen(complex));
+               break;
+            }
+         }
+         
+         for(i=0;i<d->nAntigenChains;i++)
+         {
+            if(d->antigenChains[i]->extras == CHAINTYPE_NUCL)
+            {
+               strncat(complex, "N", 7-strlen(complex));
+               break;
+            }
+         }
+         
+         if(d->nHetAntigen)
+            strncat(complex, "H", 7-strlen(complex));
+         
+         sprintf(outFile, "%s_%d%s.pdb", filestem, domCount++, complex);
+         outFile[MAXBUFF] = '\0';
+
+         if(gArchive != NULL)
+         {
+            fp          = gArchive->fp;
+            memberStart = ftello(fp);
+         }
+         else
+         {
+            fp = fopen(outFile, "w");
+         }
+         
+         if(fp!=NULL)
+         {
+            PDB *p;
+            char remark950Domain[100],
+                 remark950Partner[100],
+                 *remark950Antigen;
+            BOOL lowerCaseLight = FALSE,
+                 lowerCaseHeavy = FALSE;
+
+            
+            d->used = TRUE;
+            remark950Antigen = (char *)ArenaAlloc(d->arena,
+                                                  (d->nAntigenChains+1) *
+                                                  100);
+
+            /* Choose the new chain labels. The atoms are written with
+               these labels in place of their own
+            */
+            RelabelAntibodyChain(d,
+                                 &lowerCaseLight, &lowerCaseHeavy,
+                                 remark950Domain);
+            RelabelAntibodyChain(d->pairedDomain,
+                                 &lowerCaseLight, &lowerCaseHeavy,
+                                 remark950Partner);
+            RelabelAntigenChains(d, remark950Antigen);
+
+            fprintf(fp, "REMARK 950 CHAIN-TYPE  LABEL ORIGINAL\n");
+            fprintf(fp, remark950Domain);
+            fprintf(fp, remark950Partner);
+            fprintf(fp, remark950Antigen);
+
+            WriteSeqres(fp, headers, d);
+
+            /* Write this domain                                        */
+            WriteRelabelledAtoms(fp, d->startRes, d->stopRes,
+                                 d->newAbChainLabel);
+            fprintf(fp,"TER   \n");
+            
+            /* Write partner domain                                     */
+            if((pd = d->pairedDomain) != NULL)
+            {
+               pd->used = TRUE;
+               WriteRelabelledAtoms(fp, pd->startRes, pd->stopRes,
+                                    pd->newAbChainLabel);
+               fprintf(fp,"TER   \n");
+            }
+            
+            if(!gNoAntigen)
+            {
+               /* Write antigen chains                                  */
+#ifdef OLD
+               for(i=0; i<d->nAntigenChains; i++)
+               {
+                  PDBCHAIN *chain = d->antigenChains[i];
+                  for(p=chain->start; p!=chain->stop; NEXT(p))
+                  {
+                     blWritePDBRecord(fp, p);
+                  }
+                  fprintf(fp,"TER   \n");
+               }
+#endif
+               for(i=0; i<d->nAntigenChains; i++)
+               {
+                  PDBCHAIN *chain = d->antigenChains[i];
+
+                  /* A new label starts a new chain                     */
+                  if((i > 0) && 
+                     !CHAINMATCH(d->newAgChainLabels[i], 
+                                 d->newAgChainLabels[i-1]))
+                  {
+                     fprintf(fp,"TER   \n");
+                  }
+                  WriteRelabelledAtoms(fp, chain->start, chain->stop,
+                                       d->newAgChainLabels[i]);
+               }
+               if(d->nAntigenChains)
+                  fprintf(fp,"TER   \n");
+               
+               
+               /* Write any HET chains                                  */
+
+               /* Clear flags to say a residue has been written         */
+               for(i=0; i<d->nHetAntigen; i++)
+               {
+                  RESCLASS(d->hetAntigen[i])->written = FALSE;
+               }
+               if(pd!=NULL)
+               {
+                  for(i=0; i<pd->nHetAntigen; i++)
+                  {
+                     RESCLASS(pd->hetAntigen[i])->written = FALSE;
+                  }
+               }
+               
+               /* First domain                                          */
+               for(i=0; i<d->nHetAntigen; i++)
+               {
+                  PDBRESIDUE *res = d->hetAntigen[i];
+                  RESCLASS(res)->written = TRUE;
+                  fprintf(stderr,"Writing domain %d HET residue %s\n",
+                          d->domainNumber, res->resid);
+                  for(p=res->start; p!=res->stop; NEXT(p))
+                  {
+                     blWritePDBRecord(fp, p);
+                  }
+               }
+               if(d->nHetAntigen)
+                  fprintf(fp,"TER   \n");
+
+               /* Partner domain                                        */
+               if(pd!=NULL)
+               {
+                  for(i=0; i<pd->nHetAntigen; i++)
+                  {
+                     PDBRESIDUE *res = pd->hetAntigen[i];
+                     if(!RESCLASS(res)->written)
+                     {
+                        fprintf(stderr,
+                                "Writing domain %d HET residue %s\n",
+                                pd->domainNumber, res->resid);
+                        written = TRUE;
+                        for(p=res->start; p!=res->stop; NEXT(p))
+                        {
+                           blWritePDBRecord(fp, p);
+                        }
+                     }
+                  }
+                  if(written)
+                     fprintf(fp,"TER   \n");
+               }
+               
+            }
+
+            if(gArchive != NULL)
+            {
+               fprintf(gArchive->index, "%s %ld %ld\n", outFile,
+                       (long)memberStart, 
+                       (long)(ftello(fp) - memberStart));
+            }
+            else
+            {
+               fclose(fp);
+            }
+         }
+      }
+   }
+
+   if(gArchive != NULL)
+      LockArchive(gArchive, F_UNLCK);
+}
+
+/************************************************************************/
+/*>void SetBounds(PDB *start, PDB *stop, BOUNDS *bounds)
+   -----------------------------------------------------
+*//**
+   \param[in]   start    First atom
+   \param[in]   stop     Atom after the last one
+   \param[out]  bounds   Bounding sphere of the atoms
+
+   Finds a sphere enclosing a set of atoms, centred on their centre of
+   geometry
+
+-  17.10.26 Original   By: agent
+*/
+void SetBounds(PDB *start, PDB *stop, BOUNDS *bounds)
+{
+   PDB  *p;
+   REAL distSq,
+        maxDistSq = 0.0;
+
+   bounds->centre.x = bounds->centre.y = bounds->centre.z = 0.0;
+   bounds->radius   = 0.0;
+   bounds->nAtoms   = 0;
+
+   for(p=start; p!=stop; NEXT(p))
+   {
+      bounds->centre.x += p->x;
+      bounds->centre.y += p->y;
+      bounds->centre.z += p->z;
+      bounds->nAtoms++;
+   }
+   if(bounds->nAtoms == 0)
+      return;
+
+   bounds->centre.x /= bounds->nAtoms;
+   bounds->centre.y /= bounds->nAtoms;
+   bounds->centre.z /= bounds->nAtoms;
+
+   for(p=start; p!=stop; NEXT(p))
+   {
+      distSq = DISTSQ(p, &(bounds->centre));
+      if(distSq > maxDistSq)
+         maxDistSq = distSq;
+   }
+   bounds->radius = sqrt(maxDistSq);
+}
+
+
+/************************************************************************/
+/*>BOUNDS *BuildChainBounds(PDBSTRUCT *pdbs, ARENA *arena)
+   -------------------------------------------------------
+*//**
+   \param[in]   pdbs    PDB structure
+   \param[in]   arena   Arena for the bounding spheres
+   \return              Bounding sphere of each chain, in the order of
+                        the chains
+
+-  17.10.26 Original   By: agent
+*/
+BOUNDS *BuildChainBounds(PDBSTRUCT *pdbs, ARENA *arena)
+{
+   PDBCHAIN *chain;
+   BOUNDS   *chainBounds;
+   int      nChains = 0;
+
+   for(chain=pdbs->chains; chain!=NULL; NEXT(chain))
+      nChains++;
+
+   chainBounds = (BOUNDS *)ArenaAlloc(arena, 
+                                      (nChains+1) * sizeof(BOUNDS));
+   for(chain=pdbs->chains, nChains=0; chain!=NULL; NEXT(chain), nChains++)
+      SetBounds(chain->start, chain->stop, &(chainBounds[nChains]));
+
+   return(chainBounds);
+}
+
+
+/************************************************************************/
+/*>BOOL BoundsApart(BOUNDS *bounds1, BOUNDS *bounds2)
+   --------------------------------------------------
+*//**
+   \param[in]   bounds1   A bounding sphere
+   \param[in]   bounds2   Another bounding sphere
+   \return                Are all atoms in one sphere beyond the contact 
+                          distance from all atoms in the other?
+
+-  17.10.26 Original   By: agent
+*/
+BOOL BoundsApart(BOUNDS *bounds1, BOUNDS *bounds2)
+{
+   REAL reach = bounds1->radius + bounds2->radius + 
+                sqrt(CONTACTDISTSQ) + BOUNDSSLACK;
+
+   return(DISTSQ(&(bounds1->centre), &(bounds2->centre)) > reach * reach);
+}
+
+
+/************************************************************************/
+/*>BOOL CullBounds(BOUNDS *bounds1, BOUNDS *bounds2)
+   -------------------------------------------------
+*//**
+   \param[in]   bounds1   A bounding sphere
+   \param[in]   bounds2   Another bounding sphere
+   \return                Can the atom pairs between the spheres be
+                          skipped?
+
+   As BoundsApart(), but adds the atom pairs that are skipped to 
+   gPairsCulled
+
+-  17.10.26 Original   By: agent
+*/
+BOOL CullBounds(BOUNDS *bounds1, BOUNDS *bounds2)
+{
+   if(BoundsApart(bounds1, bounds2))
+   {
+      gPairsCulled += (ULONG)bounds1->nAtoms * (ULONG)bounds2->nAtoms;
+      return(TRUE);
+   }
+   return(FALSE);
+}
+
+
+/************************************************************************/
+BOOL FlagProteinAntigens(DOMAIN *domains, PDBSTRUCT *pdbs,
+                         CONTACTMAP *map)
+{
+   DOMAIN    *d;
+   SEQCHECKS *checks;
+   BOOL      foundAntigen = FALSE;
+
+   printf("\n***Looking for non-het antigens\n");
+
+   checks = CreateSeqChecks(pdbs, domains->arena);
+
+   for(d=domains; d!=NULL; NEXT(d))
+   {
+      d->used = FALSE;
+   }
+   
+   for(d=domains; d!=NULL; NEXT(d))
+   {
+      if(!d->used)
+      {
+         d->used = TRUE;
+         if(d->pairedDomain != NULL)
+            d->pairedDomain->used = TRUE;
+         
+         foundAntigen |= CheckAntigenContacts(d, pdbs, map, checks);
+      }
+   }
+   return(foundAntigen);
+}
+
+
+/************************************************************************/
+/* 17.10.26 Uses the residue classes from ClassifyResidues(). The type
+            comes from the first residue with an ATOM record   By: agent
+*/
+void SetChainAsAtomOrHetatm(PDBCHAIN *chains)
+{
+   PDBCHAIN   *c;
+   PDBRESIDUE *r;
+
+   for(c=chains; c!=NULL; NEXT(c))
+   {
+      c->extras = CHAINTYPE_HET;
+      for(r=c->residues; r!=NULL; NEXT(r))
+      {
+         if(RESCLASS(r)->flags & RES_HASATOM)
+         {
+            if(RESCLASS(r)->flags & RES_NUCLEOTIDE)
+            {
+               c->extras = CHAINTYPE_NUCL;
+            }
+            else
+            {
+               c->extras = CHAINTYPE_PROT;
+            }
+            
+            break;
+         }
+      }
+   }
+}
+
+
+/************************************************************************/
+BOOL InIntArray(int value, int *array, int arrayLen)
+{
+   int i;
+
+   for(i=0; i<arrayLen; i++)
+   {
+      if(array[i] == value)
+         return(TRUE);
+   }
+
+   return(FALSE);
+}
+
+
+/************************************************************************/
+/*>ATOMGRID *BuildAtomGrid(PDBSTRUCT *pdbs, ARENA *arena)
+   ------------------------------------------------------
+*//**
+   \param[in]   pdbs    PDB structure
+   \param[in]   arena   Arena for the grid
+   \return              Grid of all the atoms
+
+   Bins all the atoms into cells the size of the contact distance. The
+   cells are made larger if a very large structure would need more than
+   MAXGRIDCELLS. The atoms are counting-sorted by cell so each cell is a
+   contiguous run, and their coordinates are copied into single 
+   precision arrays for the contact kernels. The residues are numbered
+   in chain order and the standard residues of the protein and nucleic
+   acid chains are flagged.
+
+-  17.10.26 Original   By: agent
+-  17.10.26 Now includes all chains   By: agent
+*/
+ATOMGRID *BuildAtomGrid(PDBSTRUCT *pdbs, ARENA *arena)
+{
+   ATOMGRID   *grid;
+   PDBCHAIN   *chain;
+   PDBRESIDUE *r;
+   PDB        *p;
+   int        nAtoms = 0,
+              nCells,
+              resNum,
+              chainNum,
+              cell,
+              i,
+              *atomCell,
+              *fill;
+   REAL       maxX = 0.0,
+              maxY = 0.0,
+              maxZ = 0.0;
+
+   grid = (ATOMGRID *)ArenaAlloc(arena, sizeof(ATOMGRID));
+   grid->minX = grid->minY = grid->minZ = 0.0;
+
+   /* Find the bounding box and count the atoms, residues and chains    */
+   for(chain=pdbs->chains; chain!=NULL; NEXT(chain))
+   {
+      for(r=chain->residues; r!=NULL; NEXT(r))
+      {
+         for(p=r->start; p!=r->stop; NEXT(p))
+         {
+            if(nAtoms == 0)
+            {
+               grid->minX = maxX = p->x;
+               grid->minY = maxY = p->y;
+               grid->minZ = maxZ = p->z;
             }
+            else
+            {
+               grid->minX = MIN(grid->minX, p->x);
+               grid->minY = MIN(grid->minY, p->y);
+               grid->minZ = MIN(grid->minZ, p->z);
+               maxX       = MAX(maxX, p->x);
+               maxY       = MAX(maxY, p->y);
+               maxZ       = MAX(maxZ, p->z);
+            }
+            nAtoms++;
+         }
+         grid->nRes++;
+      }
+      grid->nChains++;
+   }
+
+   /* Size the cells                                                    */
+   grid->cellSize = sqrt(CONTACTDISTSQ);
+   do
+   {
+      grid->nx = (int)((maxX - grid->minX) / grid->cellSize) + 1;
+      grid->ny = (int)((maxY - grid->minY) / grid->cellSize) + 1;
+      grid->nz = (int)((maxZ - grid->minZ) / grid->cellSize) + 1;
+      if((REAL)grid->nx * grid->ny * grid->nz <= MAXGRIDCELLS)
+         break;
+      grid->cellSize *= 2.0;
+   }  while(TRUE);
+   nCells = grid->nx * grid->ny * grid->nz;
+
+   grid->atoms       = (PDB **)ArenaAlloc(arena, 
+                                          (nAtoms+1) * sizeof(PDB *));
+   grid->x           = (float *)ArenaAlloc(arena, 
+                                           (nAtoms+1) * sizeof(float));
+   grid->y           = (float *)ArenaAlloc(arena, 
+                                           (nAtoms+1) * sizeof(float));
+   grid->z           = (float *)ArenaAlloc(arena, 
+                                           (nAtoms+1) * sizeof(float));
+   grid->hits        = (int *)ArenaAlloc(arena, (nAtoms+1) * sizeof(int));
+   grid->atomRes     = (int *)ArenaAlloc(arena, (nAtoms+1) * sizeof(int));
+   grid->cellStart   = (int *)ArenaAlloc(arena, (nCells+1) * sizeof(int));
+   grid->resStamp    = (int *)ArenaAlloc(arena, 
+                                         (grid->nRes+1) * sizeof(int));
+   grid->resChain    = (PDBCHAIN **)ArenaAlloc(arena, 
+                                               (grid->nRes+1) * 
+                                               sizeof(PDBCHAIN *));
+   grid->residues    = (PDBRESIDUE **)ArenaAlloc(arena, 
+                                                 (grid->nRes+1) * 
+                                                 sizeof(PDBRESIDUE *));
+   grid->resStandard = (BOOL *)ArenaAlloc(arena, 
+                                          (grid->nRes+1) * sizeof(BOOL));
+   grid->chainStart  = (int *)ArenaAlloc(arena, 
+                                         (grid->nChains+1) * sizeof(int));
+   atomCell          = (int *)ArenaAlloc(arena, (nAtoms+1) * sizeof(int));
+   fill              = (int *)ArenaAlloc(arena, (nCells+1) * sizeof(int));
+   grid->stamp       = 0;
+
+   /* Number the residues and count the atoms in each cell              */
+   i        = 0;
+   resNum   = 0;
+   chainNum = 0;
+   for(chain=pdbs->chains; chain!=NULL; NEXT(chain))
+   {
+      grid->chainStart[chainNum++] = resNum;
+      for(r=chain->residues; r!=NULL; NEXT(r))
+      {
+         grid->resChain[resNum]    = chain;
+         grid->residues[resNum]    = r;
+         grid->resStandard[resNum] = 
+            ((chain->extras == CHAINTYPE_PROT) ||
+             (chain->extras == CHAINTYPE_NUCL)) && IsStandardResidue(r);
+         resNum++;
+         for(p=r->start; p!=r->stop; NEXT(p))
+         {
+            atomCell[i] = 
+               (GridCoord(p->x, grid->minX, grid->cellSize, grid->nx) *
+                grid->ny +
+                GridCoord(p->y, grid->minY, grid->cellSize, grid->ny)) *
+               grid->nz +
+               GridCoord(p->z, grid->minZ, grid->cellSize, grid->nz);
+            grid->cellStart[atomCell[i]+1]++;
+            i++;
          }
       }
-#ifdef DEBUG
-      printf("\n");
-#endif      
    }
+   grid->chainStart[chainNum] = resNum;
+
+   for(cell=0; cell<nCells; cell++)
+   {
+      grid->cellStart[cell+1] += grid->cellStart[cell];
+      fill[cell]               = grid->cellStart[cell];
+   }
+
+   /* Place the atoms in their cells                                    */
+   i      = 0;
+   resNum = 0;
+   for(chain=pdbs->chains; chain!=NULL; NEXT(chain))
+   {
+      for(r=chain->residues; r!=NULL; NEXT(r))
+      {
+         for(p=r->start; p!=r->stop; NEXT(p))
+         {
+            cell                = fill[atomCell[i++]]++;
+            grid->atoms[cell]   = p;
+            grid->x[cell]       = (float)(p->x - grid->minX);
+            grid->y[cell]       = (float)(p->y - grid->minY);
+            grid->z[cell]       = (float)(p->z - grid->minZ);
+            grid->atomRes[cell] = resNum;
+         }
+         resNum++;
+      }
+   }
+
+   return(grid);
 }
 
 
 /************************************************************************/
-void WriteDomains(WHOLEPDB *wpdb, DOMAIN *domains, char *filestem)
+/*>int GridCoord(REAL coord, REAL min, REAL cellSize, int nCells)
+   --------------------------------------------------------------
+*//**
+   \param[in]   coord      Coordinate
+   \param[in]   min        Minimum coordinate of the grid
+   \param[in]   cellSize   Size of a grid cell
+   \param[in]   nCells     Number of cells along this axis
+   \return                 Cell along this axis (clamped to the grid)
+
+-  17.10.26 Original   By: agent
+*/
+int GridCoord(REAL coord, REAL min, REAL cellSize, int nCells)
 {
-   DOMAIN     *d, *pd;
-   static int domCount = 0;
-   int        i;
-   
-   for(d=domains; d!=NULL; NEXT(d))
-      d->used = FALSE;
-   
-   for(d=domains; d!=NULL; NEXT(d))
+   REAL cell = (coord - min) / cellSize;
+
+   if(cell < 0.0)
+      return(0);
+   if(cell >= (REAL)(nCells - 1))
+      return(nCells - 1);
+   return((int)cell);
+}
+
+
+/************************************************************************/
+/*>int SelectContactEngine(void)
+   -----------------------------
+*//**
+   \return   Contact kernel to use (CONTACT_xxx)
+
+   Chooses the widest contact distance kernel that the CPU supports
+
+-  17.10.26 Original   By: agent
+*/
+int SelectContactEngine(void)
+{
+#ifdef HAVE_X86_SIMD
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx512f"))
+      return(CONTACT_AVX512);
+   if(__builtin_cpu_supports("avx2"))
+      return(CONTACT_AVX2);
+#endif
+   return(CONTACT_SCALAR);
+}
+
+
+/************************************************************************/
+/*>static int FindCloseAtomsScalar(ATOMGRID *grid, 
+                                   float px, float py, float pz,
+                                   int start, int stop, int *hits)
+   ---------------------------------------------------------------
+*//**
+   \param[in]   grid         Grid of atoms
+   \param[in]   px,py,pz     Coordinates of an atom relative to the grid
+                             minimum
+   \param[in]   start        First grid atom to test
+   \param[in]   stop         Grid atom after the last one to test
+   \param[out]  hits         Grid atoms within the contact distance 
+                             (plus CONTACTSLACKSQ)
+   \return                   Number of hits
+
+   Scalar contact kernel. Also does the tails for the SIMD kernels.
+
+-  17.10.26 Original   By: agent
+*/
+static int FindCloseAtomsScalar(ATOMGRID *grid, 
+                                float px, float py, float pz,
+                                int start, int stop, int *hits)
+{
+   float cutSq = (float)(CONTACTDISTSQ + CONTACTSLACKSQ),
+         dx, dy, dz;
+   int   nHits = 0,
+         i;
+
+   for(i=start; i<stop; i++)
    {
-      if(!d->used)
+      dx = grid->x[i] - px;
+      dy = grid->y[i] - py;
+      dz = grid->z[i] - pz;
+      if(dx*dx + dy*dy + dz*dz < cutSq)
+         hits[nHits++] = i;
+   }
+   return(nHits);
+}
+
+
+#ifdef HAVE_X86_SIMD
+/************************************************************************/
+/*>static int FindCloseAtomsAVX2(ATOMGRID *grid, 
+                                 float px, float py, float pz,
+                                 int start, int stop, int *hits)
+   -------------------------------------------------------------
+*//**
+   AVX2 version of FindCloseAtomsScalar(). Tests 8 atoms at a time.
+
+-  17.10.26 Original   By: agent
+*/
+__attribute__((target("avx2")))
+static int FindCloseAtomsAVX2(ATOMGRID *grid, 
+                              float px, float py, float pz,
+                              int start, int stop, int *hits)
+{
+   __m256 vCut = _mm256_set1_ps((float)(CONTACTDISTSQ + CONTACTSLACKSQ)),
+          vPx  = _mm256_set1_ps(px),
+          vPy  = _mm256_set1_ps(py),
+          vPz  = _mm256_set1_ps(pz),
+          dx, dy, dz, d2;
+   int    nHits = 0,
+          i,
+          mask;
+
+   for(i=start; i+8<=stop; i+=8)
+   {
+      dx   = _mm256_sub_ps(_mm256_loadu_ps(grid->x+i), vPx);
+      dy   = _mm256_sub_ps(_mm256_loadu_ps(grid->y+i), vPy);
+      dz   = _mm256_sub_ps(_mm256_loadu_ps(grid->z+i), vPz);
+      d2   = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                         _mm256_mul_ps(dy, dy)),
+                           _mm256_mul_ps(dz, dz));
+      mask = _mm256_movemask_ps(_mm256_cmp_ps(d2, vCut, _CMP_LT_OQ));
+      while(mask)
       {
-         FILE *fp;
-         char outFile[MAXBUFF+1],
-              complex[8];
-         BOOL written = FALSE;
+         hits[nHits++] = i + __builtin_ctz(mask);
+         mask &= mask - 1;
+      }
+   }
 
-         /* Assume not a complex                                        */
-         complex[0] = '\0';
+   return(nHits + FindCloseAtomsScalar(grid, px, py, pz, i, stop, 
+                                       hits+nHits));
+}
 
-         for(i=0;i<d->nAntigenChains;i++)
-         {
-            if(d->antigenChains[i]->extras == CHAINTYPE_PROT)
-            {
-               strncat(complex, "P", 7-strlen(complex));
-               break;
-            }
-         }
-         
-         for(i=0;i<d->nAntigenChains;i++)
-         {
-            if(d->antigenChains[i]->extras == CHAINTYPE_NUCL)
-            {
-               strncat(complex, "N", 7-strlen(complex));
-               break;
-            }
-         }
-         
-         if(d->nHetAntigen)
-            strncat(complex, "H", 7-strlen(complex));
-         
-         sprintf(outFile, "%s_%d%s.pdb", filestem, domCount++, complex);
-         outFile[MAXBUFF] = '\0';
 
-         if((fp = fopen(outFile, "w"))!=NULL)
-         {
-            PDB *pdb1, *pdb2, *pdb3, *p;
-            char remark950Domain[100],
-                 remark950Partner[100],
-                 remark950Antigen[MAXANTIGEN * 100];
-            BOOL lowerCaseLight = FALSE,
-                 lowerCaseHeavy = FALSE;
+/************************************************************************/
+/*>static int FindCloseAtomsAVX512(ATOMGRID *grid, 
+                                   float px, float py, float pz,
+                                   int start, int stop, int *hits)
+   ---------------------------------------------------------------
+*//**
+   AVX-512 version of FindCloseAtomsScalar(). Tests 16 atoms at a time.
 
-            
-            d->used = TRUE;
+-  17.10.26 Original   By: agent
+*/
+__attribute__((target("avx512f")))
+static int FindCloseAtomsAVX512(ATOMGRID *grid, 
+                                float px, float py, float pz,
+                                int start, int stop, int *hits)
+{
+   __m512    vCut = _mm512_set1_ps((float)(CONTACTDISTSQ + 
+                                           CONTACTSLACKSQ)),
+             vPx  = _mm512_set1_ps(px),
+             vPy  = _mm512_set1_ps(py),
+             vPz  = _mm512_set1_ps(pz),
+             dx, dy, dz, d2;
+   __mmask16 mask;
+   int       nHits = 0,
+             i,
+             bits;
+
+   for(i=start; i+16<=stop; i+=16)
+   {
+      dx   = _mm512_sub_ps(_mm512_loadu_ps(grid->x+i), vPx);
+      dy   = _mm512_sub_ps(_mm512_loadu_ps(grid->y+i), vPy);
+      dz   = _mm512_sub_ps(_mm512_loadu_ps(grid->z+i), vPz);
+      d2   = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx),
+                                         _mm512_mul_ps(dy, dy)),
+                           _mm512_mul_ps(dz, dz));
+      mask = _mm512_cmp_ps_mask(d2, vCut, _CMP_LT_OQ);
+      for(bits=(int)mask; bits; bits &= bits - 1)
+         hits[nHits++] = i + __builtin_ctz(bits);
+   }
 
-            pdb1 = RelabelAntibodyChain(d,
-                                        &lowerCaseLight, &lowerCaseHeavy,
-                                        remark950Domain);
-            pdb2 = RelabelAntibodyChain(d->pairedDomain,
-                                        &lowerCaseLight, &lowerCaseHeavy,
-                                        remark950Partner);
-            pdb3 = RelabelAntigenChains(d,
-                                        remark950Antigen);
+   return(nHits + FindCloseAtomsAVX2(grid, px, py, pz, i, stop, 
+                                     hits+nHits));
+}
+#endif
 
-            fprintf(fp, "REMARK 950 CHAIN-TYPE  LABEL ORIGINAL\n");
-            fprintf(fp, remark950Domain);
-            fprintf(fp, remark950Partner);
-            fprintf(fp, remark950Antigen);
 
-            WriteSeqres(fp, wpdb, d);
+/************************************************************************/
+/*>int FindCloseAtoms(ATOMGRID *grid, float px, float py, float pz,
+                      int start, int stop)
+   ----------------------------------------------------------------
+*//**
+   \param[in,out] grid         Grid of atoms. hits is filled in
+   \param[in]     px,py,pz     Coordinates of an atom relative to the
+                               grid minimum
+   \param[in]     start        First grid atom to test
+   \param[in]     stop         Grid atom after the last one to test
+   \return                     Number of grid atoms within the contact
+                               distance (plus CONTACTSLACKSQ)
+
+   Runs the contact kernel chosen by SelectContactEngine() over a run of
+   grid atoms. The kernels work in single precision so the hits must be
+   confirmed with DISTSQ().
+
+-  17.10.26 Original   By: agent
+*/
+int FindCloseAtoms(ATOMGRID *grid, float px, float py, float pz,
+                   int start, int stop)
+{
+   switch(gContactEngine)
+   {
+#ifdef HAVE_X86_SIMD
+   case CONTACT_AVX512:
+      return(FindCloseAtomsAVX512(grid, px, py, pz, start, stop,
+                                  grid->hits));
+   case CONTACT_AVX2:
+      return(FindCloseAtomsAVX2(grid, px, py, pz, start, stop,
+                                grid->hits));
+#endif
+   default:
+      break;
+   }
+   return(FindCloseAtomsScalar(grid, px, py, pz, start, stop, 
+                               grid->hits));
+}
 
-            /* Write this domain                                        */
-            for(p=pdb1; p!=NULL; NEXT(p))
-            {
-               blWritePDBRecord(fp, p);
-            }
-            fprintf(fp,"TER   \n");
-            FREELIST(pdb1, PDB);
-            
-            /* Write partner domain                                     */
-            if((pd = d->pairedDomain) != NULL)
-            {
-               pd->used = TRUE;
-               for(p=pdb2; p!=NULL; NEXT(p))
-               {
-                  blWritePDBRecord(fp, p);
-               }
-               fprintf(fp,"TER   \n");
-               FREELIST(pdb2, PDB);
-            }
+
+/************************************************************************/
+/*>int FindResidueContacts(ATOMGRID *grid, PDBRESIDUE *res, 
+                           PDBCHAIN *chain, BOOL nonStandardOnly,
+                           int *partners)
+   ----------------------------------------------------------------
+*//**
+   \param[in,out] grid              Grid of atoms
+   \param[in]     res               A residue
+   \param[in]     chain             A chain
+   \param[in]     nonStandardOnly   Only look for non-standard residues
+                                    in the chain
+   \param[out]    partners          Numbers of the residues in the chain
+                                    that contact the residue
+   \return                          Number of residues found
+
+   Finds the residues in a chain having any atom within the contact
+   distance of any atom of a residue, searching only the cells around
+   each atom of the residue. Each residue is found once. The SIMD 
+   kernels shortlist the atoms in single precision and the distance is
+   then checked with DISTSQ() so the contacts are exactly those found
+   in double precision.
+
+-  17.10.26 Original   By: agent
+*/
+int FindResidueContacts(ATOMGRID *grid, PDBRESIDUE *res, 
+                        PDBCHAIN *chain, BOOL nonStandardOnly,
+                        int *partners)
+{
+   PDB *p, *q;
+   int nPartners = 0,
+       ix, iy, iz,
+       x, y,
+       row,
+       start,
+       stop,
+       nHits,
+       resNum,
+       i;
+
+   grid->stamp++;
+   for(p=res->start; p!=res->stop; NEXT(p))
+   {
+      ix = GridCoord(p->x, grid->minX, grid->cellSize, grid->nx);
+      iy = GridCoord(p->y, grid->minY, grid->cellSize, grid->ny);
+      iz = GridCoord(p->z, grid->minZ, grid->cellSize, grid->nz);
+
+      for(x=MAX(ix-1, 0); x<=MIN(ix+1, grid->nx-1); x++)
+      {
+         for(y=MAX(iy-1, 0); y<=MIN(iy+1, grid->ny-1); y++)
+         {
+            /* The neighbouring cells along z are one run of atoms      */
+            row   = (x * grid->ny + y) * grid->nz;
+            start = grid->cellStart[row + MAX(iz-1, 0)];
+            stop  = grid->cellStart[row + MIN(iz+1, grid->nz-1) + 1];
+            nHits = FindCloseAtoms(grid, 
+                                   (float)(p->x - grid->minX),
+                                   (float)(p->y - grid->minY),
+                                   (float)(p->z - grid->minZ),
+                                   start, stop);
+            gPairsTested += stop - start;
             
-            if(!gNoAntigen)
+            for(i=0; i<nHits; i++)
             {
-               PDB *prev;
-               
-               /* Write antigen chains                                  */
-#ifdef OLD
-               for(i=0; i<d->nAntigenChains; i++)
+               resNum = grid->atomRes[grid->hits[i]];
+               if((grid->resChain[resNum] == chain) &&
+                  (grid->resStamp[resNum] != grid->stamp) &&
+                  !(nonStandardOnly && grid->resStandard[resNum]))
                {
-                  PDBCHAIN *chain = d->antigenChains[i];
-                  for(p=chain->start; p!=chain->stop; NEXT(p))
+                  q = grid->atoms[grid->hits[i]];
+                  if(DISTSQ(p,q) < CONTACTDISTSQ)
                   {
-                     blWritePDBRecord(fp, p);
-                  }
-                  fprintf(fp,"TER   \n");
-               }
+#ifdef DEBUG
+                     printf("Contact %s%d%-s.%-s with %s%d%-s.%-s \
+(%.3f)\n",
+                            p->chain, p->resnum, p->insert, p->atnam,
+                            q->chain, q->resnum, q->insert, q->atnam,
+                            sqrt(DISTSQ(p,q)));
 #endif
-               if(pdb3!=NULL)
-               {
-                  prev = pdb3;
-                  for(p=pdb3; p!=NULL; NEXT(p))
-                  {
-                     if(!CHAINMATCH(p->chain, prev->chain))
-                     {
-                        fprintf(fp,"TER   \n");
-                     }
-                     blWritePDBRecord(fp, p);
-                     prev=p;
+                     grid->resStamp[resNum] = grid->stamp;
+                     partners[nPartners++]  = resNum;
                   }
-                  fprintf(fp,"TER   \n");
                }
-               
-               
-               /* Write any HET chains                                  */
+            }
+         }
+      }
+   }
 
-               /* Clear flags to say a residue has been written         */
-               for(i=0; i<d->nHetAntigen; i++)
-               {
-                  PDBRESIDUE *res = d->hetAntigen[i];
-                  res->extras = RES_WRITTEN_NO;
-               }
-               if(pd!=NULL)
-               {
-                  for(i=0; i<pd->nHetAntigen; i++)
-                  {
-                     PDBRESIDUE *res = pd->hetAntigen[i];
-                     res->extras = RES_WRITTEN_NO;
-                  }
-               }
-               
-               /* First domain                                          */
-               for(i=0; i<d->nHetAntigen; i++)
-               {
-                  PDBRESIDUE *res = d->hetAntigen[i];
-                  res->extras = RES_WRITTEN_YES;
-                  fprintf(stderr,"Writing domain %d HET residue %s\n",
-                          d->domainNumber, res->resid);
-                  for(p=res->start; p!=res->stop; NEXT(p))
-                  {
-                     blWritePDBRecord(fp, p);
-                  }
-               }
-               if(d->nHetAntigen)
-                  fprintf(fp,"TER   \n");
+   return(nPartners);
+}
 
-               /* Partner domain                                        */
-               if(pd!=NULL)
+
+/************************************************************************/
+/*>REAL AtomCoord(PDB *p, int axis)
+   --------------------------------
+*//**
+   \param[in]   p      An atom
+   \param[in]   axis   0, 1 or 2
+   \return             x, y or z coordinate
+
+-  17.10.26 Original   By: agent
+*/
+REAL AtomCoord(PDB *p, int axis)
+{
+   return((axis == 0) ? p->x : ((axis == 1) ? p->y : p->z));
+}
+
+
+/************************************************************************/
+/*>static int CompareKDAtomsX(const void *a, const void *b)
+   --------------------------------------------------------
+*//**
+   qsort() comparisons of KDATOMs along x, y and z
+
+-  17.10.26 Original   By: agent
+*/
+static int CompareKDAtomsX(const void *a, const void *b)
+{
+   REAL d = ((KDATOM *)a)->atom->x - ((KDATOM *)b)->atom->x;
+   return((d < 0.0) ? -1 : ((d > 0.0) ? 1 : 0));
+}
+static int CompareKDAtomsY(const void *a, const void *b)
+{
+   REAL d = ((KDATOM *)a)->atom->y - ((KDATOM *)b)->atom->y;
+   return((d < 0.0) ? -1 : ((d > 0.0) ? 1 : 0));
+}
+static int CompareKDAtomsZ(const void *a, const void *b)
+{
+   REAL d = ((KDATOM *)a)->atom->z - ((KDATOM *)b)->atom->z;
+   return((d < 0.0) ? -1 : ((d > 0.0) ? 1 : 0));
+}
+
+
+/************************************************************************/
+/*>void BuildKDNode(KDTREE *tree, int lo, int hi)
+   ----------------------------------------------
+*//**
+   \param[in,out] tree   The KD-tree
+   \param[in]     lo     First atom in the range
+   \param[in]     hi     Atom after the last one in the range
+
+   Sorts a range of atoms along its widest axis so that the middle atom
+   splits it, and then does the same for the two halves
+
+-  17.10.26 Original   By: agent
+*/
+void BuildKDNode(KDTREE *tree, int lo, int hi)
+{
+   int  mid = (lo + hi) / 2,
+        axis,
+        i;
+   REAL extent[3],
+        min[3],
+        max[3];
+
+   if(hi - lo < 2)
+   {
+      if(hi > lo)
+         tree->axis[lo] = 0;
+      return;
+   }
+
+   for(axis=0; axis<3; axis++)
+      min[axis] = max[axis] = AtomCoord(tree->atoms[lo].atom, axis);
+   for(i=lo+1; i<hi; i++)
+   {
+      for(axis=0; axis<3; axis++)
+      {
+         REAL c = AtomCoord(tree->atoms[i].atom, axis);
+         min[axis] = MIN(min[axis], c);
+         max[axis] = MAX(max[axis], c);
+      }
+   }
+   for(axis=0; axis<3; axis++)
+      extent[axis] = max[axis] - min[axis];
+   axis = (extent[0] >= extent[1]) ? 0 : 1;
+   if(extent[2] > extent[axis])
+      axis = 2;
+
+   qsort(tree->atoms+lo, hi-lo, sizeof(KDATOM),
+         (axis == 0) ? CompareKDAtomsX : 
+         ((axis == 1) ? CompareKDAtomsY : CompareKDAtomsZ));
+   tree->axis[mid] = (UBYTE)axis;
+
+   BuildKDNode(tree, lo, mid);
+   BuildKDNode(tree, mid+1, hi);
+}
+
+
+/************************************************************************/
+/*>KDTREE *BuildCDRTree(DOMAIN *domains, ARENA *arena)
+   ---------------------------------------------------
+*//**
+   \param[in]   domains   List of domains
+   \param[in]   arena     Arena for the tree
+   \return                KD-tree over the CDR atoms of all the domains
+
+   Each atom records its domain and residue so that a query gives the
+   CDR residues that are contacted
+
+-  17.10.26 Original   By: agent
+*/
+KDTREE *BuildCDRTree(DOMAIN *domains, ARENA *arena)
+{
+   KDTREE     *tree;
+   DOMAIN     *d;
+   PDBRESIDUE *r;
+   PDB        *p;
+   int        resnum,
+              pass;
+
+   tree = (KDTREE *)ArenaAlloc(arena, sizeof(KDTREE));
+
+   /* Count the CDR atoms and then store them                           */
+   for(pass=0; pass<2; pass++)
+   {
+      tree->nAtoms = 0;
+      tree->nRes   = 0;
+      for(d=domains; d!=NULL; NEXT(d))
+      {
+         for(resnum=0; resnum<=d->lastSeqRes-d->startSeqRes; resnum++)
+         {
+            if(ISCDRRES(d, resnum))
+            {
+               r = d->resIndex->residues[d->startSeqRes+resnum];
+               for(p=r->start; p!=r->stop; NEXT(p))
                {
-                  for(i=0; i<pd->nHetAntigen; i++)
+                  if(pass)
                   {
-                     PDBRESIDUE *res = pd->hetAntigen[i];
-                     if(res->extras == RES_WRITTEN_NO)
+                     KDATOM *a = &(tree->atoms[tree->nAtoms]);
+                     a->atom   = p;
+                     a->domain = d;
+                     a->resnum = resnum;
+                     a->resId  = tree->nRes;
+
+                     if(tree->nAtoms == 0)
                      {
-                        fprintf(stderr,
-                                "Writing domain %d HET residue %s\n",
-                                pd->domainNumber, res->resid);
-                        written = TRUE;
-                        for(p=res->start; p!=res->stop; NEXT(p))
-                        {
-                           blWritePDBRecord(fp, p);
-                        }
+                        tree->min.x = tree->max.x = p->x;
+                        tree->min.y = tree->max.y = p->y;
+                        tree->min.z = tree->max.z = p->z;
                      }
+                     tree->min.x = MIN(tree->min.x, p->x);
+                     tree->min.y = MIN(tree->min.y, p->y);
+                     tree->min.z = MIN(tree->min.z, p->z);
+                     tree->max.x = MAX(tree->max.x, p->x);
+                     tree->max.y = MAX(tree->max.y, p->y);
+                     tree->max.z = MAX(tree->max.z, p->z);
                   }
-                  if(written)
-                     fprintf(fp,"TER   \n");
+                  tree->nAtoms++;
                }
-               
+               tree->nRes++;
             }
-            
-            fclose(fp);
          }
       }
+
+      if(!pass)
+      {
+         tree->atoms    = (KDATOM *)ArenaAlloc(arena, (tree->nAtoms+1) * 
+                                               sizeof(KDATOM));
+         tree->axis     = (UBYTE *)ArenaAlloc(arena, tree->nAtoms+1);
+         tree->resStamp = (int *)ArenaAlloc(arena, (tree->nRes+1) * 
+                                            sizeof(int));
+      }
    }
+
+   tree->stamp = 0;
+   BuildKDNode(tree, 0, tree->nAtoms);
+   return(tree);
 }
 
+
 /************************************************************************/
-BOOL FlagProteinAntigens(DOMAIN *domains, PDBSTRUCT *pdbs)
+/*>void SearchKDNode(KDTREE *tree, int lo, int hi, PDB *p, 
+                     CONTACT *hits, int *nHits)
+   -------------------------------------------------------
+*//**
+   \param[in,out] tree    The KD-tree
+   \param[in]     lo      First atom in the range
+   \param[in]     hi      Atom after the last one in the range
+   \param[in]     p       Query atom
+   \param[out]    hits    CDR residues within the contact distance
+   \param[in,out] nHits   Number of hits
+
+   Radius search of a range of the KD-tree. Only visits a half of the 
+   range if it could be within the contact distance. Each CDR residue
+   is reported once per query.
+
+-  17.10.26 Original   By: agent
+*/
+void SearchKDNode(KDTREE *tree, int lo, int hi, PDB *p, CONTACT *hits,
+                  int *nHits)
 {
-   DOMAIN *d;
-   BOOL   foundAntigen = FALSE;
+   int    mid;
+   KDATOM *a;
+   REAL   diff;
 
-   printf("\n***Looking for non-het antigens\n");
+   while(hi > lo)
+   {
+      mid = (lo + hi) / 2;
+      a   = &(tree->atoms[mid]);
 
-   for(d=domains; d!=NULL; NEXT(d))
+      gPairsTested++;
+      if((tree->resStamp[a->resId] != tree->stamp) &&
+         (DISTSQ(p, a->atom) < CONTACTDISTSQ))
+      {
+         tree->resStamp[a->resId] = tree->stamp;
+         hits[*nHits].domain      = a->domain;
+         hits[*nHits].resnum      = a->resnum;
+         hits[*nHits].isCDR       = TRUE;
+         (*nHits)++;
+      }
+
+      if(hi - lo == 1)
+         return;
+
+      diff = AtomCoord(p, tree->axis[mid]) - AtomCoord(a->atom, 
+                                                       tree->axis[mid]);
+      if(diff <= 0.0)
+      {
+         /* Search the right half if it is in reach, then the left     */
+         if(diff * diff < CONTACTDISTSQ)
+            SearchKDNode(tree, mid+1, hi, p, hits, nHits);
+         hi = mid;
+      }
+      else
+      {
+         if(diff * diff < CONTACTDISTSQ)
+            SearchKDNode(tree, lo, mid, p, hits, nHits);
+         lo = mid + 1;
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>int FindCDRContacts(KDTREE *tree, PDBRESIDUE *res, CONTACT *hits)
+   -----------------------------------------------------------------
+*//**
+   \param[in,out] tree   KD-tree over the CDR atoms
+   \param[in]     res    A residue
+   \param[out]    hits   CDR residues that contact the residue
+   \return               Number of hits
+
+   Finds the CDR residues of any domain that contact a residue. The 
+   residue is discarded straight away if its bounding box is beyond the
+   contact distance from the box round all the CDR atoms.
+
+-  17.10.26 Original   By: agent
+*/
+int FindCDRContacts(KDTREE *tree, PDBRESIDUE *res, CONTACT *hits)
+{
+   PDB   *p;
+   VEC3F min, max;
+   REAL  reach = sqrt(CONTACTDISTSQ);
+   int   nHits = 0,
+         nAtoms = 0;
+
+   if((tree->nAtoms == 0) || (res->start == res->stop))
+      return(0);
+
+   min.x = max.x = res->start->x;
+   min.y = max.y = res->start->y;
+   min.z = max.z = res->start->z;
+   for(p=res->start; p!=res->stop; NEXT(p))
    {
-      d->used = FALSE;
+      nAtoms++;
+      min.x = MIN(min.x, p->x);
+      min.y = MIN(min.y, p->y);
+      min.z = MIN(min.z, p->z);
+      max.x = MAX(max.x, p->x);
+      max.y = MAX(max.y, p->y);
+      max.z = MAX(max.z, p->z);
    }
-   
-   for(d=domains; d!=NULL; NEXT(d))
+
+   if((min.x > tree->max.x + reach) || (max.x < tree->min.x - reach) ||
+      (min.y > tree->max.y + reach) || (max.y < tree->min.y - reach) ||
+      (min.z > tree->max.z + reach) || (max.z < tree->min.z - reach))
    {
-      if(!d->used)
+      gPairsCulled += (ULONG)nAtoms * (ULONG)tree->nAtoms;
+      return(0);
+   }
+
+   tree->stamp++;
+   for(p=res->start; p!=res->stop; NEXT(p))
+      SearchKDNode(tree, 0, tree->nAtoms, p, hits, &nHits);
+
+   return(nHits);
+}
+
+
+/************************************************************************/
+/*>void GrowContacts(CONTACT **found, int **foundRes, int *maxFound,
+                     int needed)
+   -----------------------------------------------------------------
+*//**
+   \param[in,out] found      Contacts found so far
+   \param[in,out] foundRes   Residue contacted by each
+   \param[in,out] maxFound   Space in the arrays
+   \param[in]     needed     Space needed
+
+   Makes sure that the arrays of contacts can hold the number needed
+
+-  17.10.26 Original   By: agent
+*/
+void GrowContacts(CONTACT **found, int **foundRes, int *maxFound,
+                  int needed)
+{
+   if(needed > *maxFound)
+   {
+      *maxFound = 2 * needed;
+      if(((*found = (CONTACT *)realloc(*found, *maxFound * 
+                                       sizeof(CONTACT)))==NULL) ||
+         ((*foundRes = (int *)realloc(*foundRes, *maxFound * 
+                                      sizeof(int)))==NULL))
       {
-         d->used = TRUE;
-         if(d->pairedDomain != NULL)
-            d->pairedDomain->used = TRUE;
-         
-         foundAntigen |= CheckAntigenContacts(d, pdbs);
+         fprintf(stderr,"Error (%s): No memory for contacts\n",
+                 PROGNAME);
+         exit(1);
       }
    }
-   return(foundAntigen);
 }
 
 
 /************************************************************************/
-void SetChainAsAtomOrHetatm(PDBCHAIN *chains)
+/*>CONTACTMAP *BuildContactMap(DOMAIN *domains, PDBSTRUCT *pdbs,
+                               BOUNDS *chainBounds, ARENA *arena)
+   -------------------------------------------------------------
+*//**
+   \param[in]   domains       List of domains
+   \param[in]   pdbs          PDB structure
+   \param[in]   chainBounds   Bounding sphere of each chain
+   \param[in]   arena         Arena for the map
+   \return                    Contacts made by the domains
+
+   Finds every pair of an antibody domain residue and a residue of any
+   other protein or nucleic acid chain in contact, in a single sweep 
+   over the domains and chains. Within the domain's own chain only the
+   non-standard residues are considered. Each contact is tagged with 
+   whether the domain residue is in a CDR. A domain, or a domain 
+   residue, is skipped for a chain if their bounding spheres are too far
+   apart.
+
+   Only CDR contacts matter for HET chains, so each HET residue is 
+   instead looked up in a KD-tree of the CDR atoms of all the domains.
+
+   The contacts are counting-sorted by the residue contacted so that the
+   antigen flagging can find them directly.
+
+-  17.10.26 Original   By: agent
+*/
+CONTACTMAP *BuildContactMap(DOMAIN *domains, PDBSTRUCT *pdbs,
+                            BOUNDS *chainBounds, ARENA *arena)
 {
-   PDBCHAIN *c;
-   PDB      *p;
-
-   for(c=chains; c!=NULL; NEXT(c))
+   CONTACTMAP *map;
+   ATOMGRID   *grid;
+   KDTREE     *tree;
+   DOMAIN     *d;
+   PDBCHAIN   *chain;
+   PDBRESIDUE *r;
+   CONTACT    *found      = NULL,
+              *hits;
+   int        *foundRes   = NULL,
+              *partners,
+              *fill,
+              nFound      = 0,
+              maxFound    = 0,
+              chainNum,
+              resnum,
+              resNum,
+              nPartners,
+              nHits,
+              i;
+
+   grid     = BuildAtomGrid(pdbs, arena);
+   tree     = BuildCDRTree(domains, arena);
+   partners = (int *)ArenaAlloc(arena, (grid->nRes+1) * sizeof(int));
+   hits     = (CONTACT *)ArenaAlloc(arena, 
+                                    (tree->nRes+1) * sizeof(CONTACT));
+
+   /* Find the contacts                                                 */
+   for(d=domains; d!=NULL; NEXT(d))
    {
-      c->extras = CHAINTYPE_HET;
-      for(p=c->start; p!=c->stop; NEXT(p))
-      {
-         if(!strncmp(p->record_type, "ATOM  ", 6))
-         {
-            if(!strncmp(p->resnam, "  U", 3) ||
-               !strncmp(p->resnam, "  A", 3) ||
-               !strncmp(p->resnam, "  C", 3) ||
-               !strncmp(p->resnam, "  G", 3) ||
-               !strncmp(p->resnam, " DT", 3) ||
-               !strncmp(p->resnam, " DA", 3) ||
-               !strncmp(p->resnam, " DC", 3) ||
-               !strncmp(p->resnam, " DG", 3))
+      RESINDEX *index = d->resIndex;
+      
+      for(chain=pdbs->chains, chainNum=0; 
+          chain!=NULL; 
+          NEXT(chain), chainNum++)
+      {
+         if((chain->extras == CHAINTYPE_HET) ||
+            CullBounds(&(d->bounds), &(chainBounds[chainNum])))
+            continue;
+
+         for(resnum=0; resnum<=d->lastSeqRes-d->startSeqRes; resnum++)
+         {
+            if(CullBounds(&(index->bounds[d->startSeqRes+resnum]),
+                          &(chainBounds[chainNum])))
+               continue;
+
+            nPartners = FindResidueContacts(grid, 
+                                            index->residues[d->startSeqRes
+                                                            + resnum],
+                                            chain, (chain == d->chain),
+                                            partners);
+            GrowContacts(&found, &foundRes, &maxFound, 
+                         nFound + nPartners);
+            for(i=0; i<nPartners; i++)
             {
-               c->extras = CHAINTYPE_NUCL;
+               found[nFound].domain = d;
+               found[nFound].resnum = resnum;
+               found[nFound].isCDR  = ISCDRRES(d, resnum);
+               foundRes[nFound++]   = partners[i];
             }
-            else
+         }
+      }
+   }
+
+   /* Find the CDR contacts of the HET chains                           */
+   for(chain=pdbs->chains, chainNum=0; 
+       chain!=NULL; 
+       NEXT(chain), chainNum++)
+   {
+      if(chain->extras == CHAINTYPE_HET)
+      {
+         for(r=chain->residues, resNum=grid->chainStart[chainNum];
+             r!=NULL;
+             NEXT(r), resNum++)
+         {
+            nHits = FindCDRContacts(tree, r, hits);
+            GrowContacts(&found, &foundRes, &maxFound, nFound + nHits);
+            for(i=0; i<nHits; i++)
             {
-               c->extras = CHAINTYPE_PROT;
+               found[nFound]      = hits[i];
+               foundRes[nFound++] = resNum;
             }
-            
-            break;
          }
       }
    }
+
+   /* Group them by the residue contacted                               */
+   map             = (CONTACTMAP *)ArenaAlloc(arena, sizeof(CONTACTMAP));
+   map->residues   = grid->residues;
+   map->chainStart = grid->chainStart;
+   map->nRes       = grid->nRes;
+   map->nChains    = grid->nChains;
+   map->nContacts  = nFound;
+   map->contacts   = (CONTACT *)ArenaAlloc(arena, 
+                                           (nFound+1) * sizeof(CONTACT));
+   map->resStart   = (int *)ArenaAlloc(arena, (map->nRes+1) * sizeof(int));
+   fill            = (int *)ArenaAlloc(arena, (map->nRes+1) * sizeof(int));
+
+   for(i=0; i<nFound; i++)
+      map->resStart[foundRes[i]+1]++;
+   for(i=0; i<map->nRes; i++)
+   {
+      map->resStart[i+1] += map->resStart[i];
+      fill[i]             = map->resStart[i];
+   }
+   for(i=0; i<nFound; i++)
+      map->contacts[fill[foundRes[i]]++] = found[i];
+
+   FREE(found);
+   FREE(foundRes);
+
+   return(map);
 }
 
 
 /************************************************************************/
-BOOL InIntArray(int value, int *array, int arrayLen)
+/*>void CountMappedContacts(CONTACTMAP *map, DOMAIN *domain, int chainNum,
+                            int *nCDRContacts, int *nFWContacts)
+   -----------------------------------------------------------------------
+*//**
+   \param[in]     map            Contacts made by the domains
+   \param[in]     domain         The domain
+   \param[in]     chainNum       Number of a potential antigen chain
+   \param[in,out] nCDRContacts   Incremented by the CDR contacts
+   \param[in,out] nFWContacts    Incremented by the framework contacts
+
+   Counts the residue contacts between a domain and a chain, split into
+   those made by CDR and framework residues
+
+-  17.10.26 Original   By: agent
+*/
+void CountMappedContacts(CONTACTMAP *map, DOMAIN *domain, int chainNum,
+                         int *nCDRContacts, int *nFWContacts)
+{
+   int resNum,
+       i;
+
+   for(resNum=map->chainStart[chainNum]; 
+       resNum<map->chainStart[chainNum+1]; 
+       resNum++)
+   {
+      for(i=map->resStart[resNum]; i<map->resStart[resNum+1]; i++)
+      {
+         if(map->contacts[i].domain == domain)
+         {
+            if(map->contacts[i].isCDR)
+               (*nCDRContacts)++;
+            else
+               (*nFWContacts)++;
+         }
+      }
+   }
+}
+
+
+/************************************************************************/
+/*>BOOL HasCDRContact(CONTACTMAP *map, int resNum, DOMAIN *domain)
+   ---------------------------------------------------------------
+*//**
+   \param[in]   map      Contacts made by the domains
+   \param[in]   resNum   Number of a residue
+   \param[in]   domain   The domain
+   \return               Does a CDR residue of the domain contact the
+                         residue?
+
+-  17.10.26 Original   By: agent
+*/
+BOOL HasCDRContact(CONTACTMAP *map, int resNum, DOMAIN *domain)
 {
    int i;
 
-   for(i=0; i<arrayLen; i++)
+   for(i=map->resStart[resNum]; i<map->resStart[resNum+1]; i++)
    {
-      if(array[i] == value)
+      if((map->contacts[i].domain == domain) && map->contacts[i].isCDR)
          return(TRUE);
    }
-
    return(FALSE);
 }
 
 
 /************************************************************************/
-BOOL RegionsMakeContact(PDB *start1, PDB *stop1, PDB *start2, PDB *stop2)
+/*>void PrintContactMap(FILE *fp, CONTACTMAP *map)
+   -----------------------------------------------
+*//**
+   \param[in]   fp    Output file
+   \param[in]   map   Contacts made by the domains
+
+   Writes each contact as the domain number, the domain residue, CDR or
+   FW, and the residue that it contacts
+
+-  17.10.26 Original   By: agent
+*/
+void PrintContactMap(FILE *fp, CONTACTMAP *map)
 {
-   PDB *p, *q;
-   
-   for(p=start1; p!=stop1; NEXT(p))
+   int resNum,
+       i;
+
+   for(resNum=0; resNum<map->nRes; resNum++)
    {
-      for(q=start2; q!=stop2; NEXT(q))
+      PDBRESIDUE *r = map->residues[resNum];
+      
+      for(i=map->resStart[resNum]; i<map->resStart[resNum+1]; i++)
       {
-         if(DISTSQ(p,q) < CONTACTDISTSQ)
-         {
-#ifdef DEBUG
-            printf("Contact %s%d%-s.%-s with %s%d%-s.%-s (%.3f)\n",
-                   p->chain, p->resnum, p->insert, p->atnam,
-                   q->chain, q->resnum, q->insert, q->atnam,
-                   sqrt(DISTSQ(p,q)));
-#endif
-            return(TRUE);
-
-         }
+         CONTACT *c = &(map->contacts[i]);
+         PDB     *p = c->domain->resIndex->residues[c->domain->startSeqRes
+                                                    + c->resnum]->start;
+         
+         fprintf(fp, "CONTACT %d %s%d%s %s %s%d%s %s\n",
+                 c->domain->domainNumber, 
+                 p->chain, p->resnum, p->insert, 
+                 (c->isCDR ? "CDR" : "FW "),
+                 r->start->chain, r->start->resnum, r->start->insert,
+                 r->start->resnam);
       }
    }
-
-   return(FALSE);
 }
 
 
 /************************************************************************/
-BOOL CheckAntigenContacts(DOMAIN *domain, PDBSTRUCT *pdbs)
+BOOL CheckAntigenContacts(DOMAIN *domain, PDBSTRUCT *pdbs,
+                          CONTACTMAP *map, SEQCHECKS *checks)
 {
-   PDB      *p, *q,
-            *nextResP, *nextResQ;
    PDBCHAIN *chain;
    int      nCDRContacts  = 0,
-            nFWContacts   = 0;
+            nFWContacts   = 0,
+            chainNum;
    DOMAIN   *pairedDomain = domain->pairedDomain;
    BOOL     foundAntigen  = FALSE;
    
@@ -1606,7 +8319,9 @@ BOOL CheckAntigenContacts(DOMAIN *domain, PDBSTRUCT *pdbs)
       pairedDomain->nAntigenChains = 0;
 
    /* Go through each of the ATOM chains                                */
-   for(chain=pdbs->chains; chain!=NULL; NEXT(chain))
+   for(chain=pdbs->chains, chainNum=0; 
+       chain!=NULL; 
+       NEXT(chain), chainNum++)
    {
       if((chain->extras == CHAINTYPE_PROT) ||
          (chain->extras == CHAINTYPE_NUCL))
@@ -1620,8 +8335,6 @@ BOOL CheckAntigenContacts(DOMAIN *domain, PDBSTRUCT *pdbs)
             ((pairedDomain == NULL) ||
              (chain != pairedDomain->chain)))
          {
-            int resnum = 0;
-
             if(gVerbose)
             {
                printf("Checking domain %d (chain %s) against chain %s\n",
@@ -1629,55 +8342,10 @@ BOOL CheckAntigenContacts(DOMAIN *domain, PDBSTRUCT *pdbs)
                       chain->chain);
             }
 
-            /* Now check whether the sequence of this chain matches
-               that of the domain or of the paired domain. If so this 
-               must be crystal packing rather than an antigen interaction.
-            */
-            if(DomainSequenceMatchesChainSequence(domain, chain))
-            {
-               printf("Crystal packing: Chain %s <=> Domain %d \
-(chain %s)\n",
-                      chain->chain, domain->domainNumber,
-                      domain->chain->chain);
-               continue;
-            }
-            
-            if(DomainSequenceMatchesChainSequence(pairedDomain, chain))
-            {
-               printf("Crystal packing: Chain %s <=> Domain %d \
-(chain %s)\n",
-                      chain->chain, pairedDomain->domainNumber,
-                      pairedDomain->chain->chain);
-               continue;
-            }
-
             /************************************************************/
             /* Check this domain for contacts a residue at a time       */
-            for(p=domain->startRes; p!=domain->stopRes; p=nextResP)
-            {
-               nextResP = blFindNextResidue(p);
-               
-               for(q=chain->start; q!=chain->stop; q=nextResQ)
-               {
-                  nextResQ = blFindNextResidue(q);
-                  
-                  if(RegionsMakeContact(p, nextResP, q, nextResQ))
-                  {
-                     /* If this is a CDR residue                        */
-                     if(InIntArray(resnum,
-                                   domain->CDRRes,
-                                   domain->nCDRRes))
-                     {
-                        nCDRContacts++;
-                     }
-                     else
-                     {
-                        nFWContacts++;
-                     }
-                  }
-               }
-               resnum++;
-            }
+            CountMappedContacts(map, domain, chainNum, 
+                                &nCDRContacts, &nFWContacts);
 
 #ifdef DEBUG_AG_CONTACTS
             printf("Domain %d (chain %s) makes %d CDR and %d FW \
@@ -1690,14 +8358,15 @@ contacts with chain %s\n",
 
             if(nCDRContacts >= MINAGCONTACTS)
             {
+               if(IsCrystalPacking(domain, chain, chainNum, checks))
+                  continue;
+               
                if((nCDRContacts > nFWContacts) || (nCDRContacts >= MINAGCONTOK))
                {
                   foundAntigen = TRUE;
-                  if(domain->nAntigenChains < MAXANTIGEN)
-                     domain->antigenChains[domain->nAntigenChains++] = chain;
-                  if((pairedDomain != NULL) &&
-                     (pairedDomain->nAntigenChains < MAXANTIGEN))
-                     pairedDomain->antigenChains[pairedDomain->nAntigenChains++] = chain;
+                  AddAntigenChain(domain, chain);
+                  if(pairedDomain != NULL)
+                     AddAntigenChain(pairedDomain, chain);
                   goto break1;
                }
                else if(gVerbose)
@@ -1716,35 +8385,8 @@ chain %s\n",
                       pairedDomain->domainNumber,
                       pairedDomain->chain->chain, chain->chain);
 #endif
-               resnum = 0;
-               for(p=pairedDomain->startRes;
-                   p!=pairedDomain->stopRes;
-                   p=nextResP)
-               {
-                  nextResP = blFindNextResidue(p);
-                  
-                  for(q=chain->start; q!=chain->stop; q=nextResQ)
-                  {
-                     nextResQ = blFindNextResidue(q);
-                     
-                     if(RegionsMakeContact(p, nextResP, q, nextResQ))
-                     {
-                        /* If this is a CDR residue                     */
-                        if(InIntArray(resnum,
-                                      pairedDomain->CDRRes,
-                                      pairedDomain->nCDRRes))
-                        {
-                           nCDRContacts++;
-                        }
-                        else
-                        {
-                           nFWContacts++;
-                        }
-                     }
-                  }
-                     
-                  resnum++;
-               }
+               CountMappedContacts(map, pairedDomain, chainNum,
+                                   &nCDRContacts, &nFWContacts);
 
 #ifdef DEBUG_AG_CONTACTS
                printf("Adding domain %d (chain %s) makes %d CDR and \
@@ -1755,15 +8397,15 @@ chain %s\n",
 #endif
                if(nCDRContacts >= MINAGCONTACTS)
                {
+                  if(IsCrystalPacking(domain, chain, chainNum, checks))
+                     continue;
+                  
                   if((nCDRContacts > nFWContacts) || (nCDRContacts >= MINAGCONTOK))
                   {
                      foundAntigen = TRUE;
-                     if(domain->nAntigenChains < MAXANTIGEN)
-                        domain->antigenChains[domain->nAntigenChains++] =
-                           chain;
-                     if((pairedDomain != NULL) &&
-                        (pairedDomain->nAntigenChains < MAXANTIGEN))
-                        pairedDomain->antigenChains[pairedDomain->nAntigenChains++] = chain;
+                     AddAntigenChain(domain, chain);
+                     if(pairedDomain != NULL)
+                        AddAntigenChain(pairedDomain, chain);
                      goto break1;
                   }
                   else
@@ -1782,6 +8424,49 @@ chain %s\n",
 }
 
 
+/************************************************************************/
+/*>BOOL IsCrystalPacking(DOMAIN *domain, PDBCHAIN *chain, int chainNum,
+                         SEQCHECKS *checks)
+   --------------------------------------------------------------------
+*//**
+   \param[in]     domain     A domain
+   \param[in]     chain      A chain that it contacts
+   \param[in]     chainNum   Position of the chain in the entry
+   \param[in,out] checks     Checks done so far for the entry
+   \return                   Is the contact crystal packing?
+
+   If the sequence of the chain matches that of the domain or of the
+   paired domain, the contact must be crystal packing rather than an
+   antigen interaction. Only called for chains that make enough
+   contacts to be an antigen.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL IsCrystalPacking(DOMAIN *domain, PDBCHAIN *chain, int chainNum,
+                      SEQCHECKS *checks)
+{
+   DOMAIN *pairedDomain = domain->pairedDomain;
+   
+   if(DomainSequenceMatchesChainSequence(domain, chain, chainNum, checks))
+   {
+      printf("Crystal packing: Chain %s <=> Domain %d (chain %s)\n",
+             chain->chain, domain->domainNumber, domain->chain->chain);
+      return(TRUE);
+   }
+   
+   if(DomainSequenceMatchesChainSequence(pairedDomain, chain, chainNum,
+                                         checks))
+   {
+      printf("Crystal packing: Chain %s <=> Domain %d (chain %s)\n",
+             chain->chain, pairedDomain->domainNumber,
+             pairedDomain->chain->chain);
+      return(TRUE);
+   }
+
+   return(FALSE);
+}
+
+
 void GetSequenceForChainSeqres(WHOLEPDB *wpdb, PDBCHAIN *chain,
                                char *sequence)
 {
@@ -1859,21 +8544,24 @@ void GetSequenceForChainSeqres(WHOLEPDB *wpdb, PDBCHAIN *chain,
    }
    else
    {
-      GetSequenceForChain(wpdb, chain, sequence);
+      GetSequenceForChain(chain, sequence);
    }
 }
    
    
 /************************************************************************/
-void FlagHetAntigenChains(DOMAIN *domains, PDBSTRUCT *pdbs)
+void FlagHetAntigenChains(DOMAIN *domains, PDBSTRUCT *pdbs,
+                          CONTACTMAP *map)
 {
    DOMAIN   *d;
    PDBCHAIN *c;
+   int      chainNum,
+            resNum;
    
    printf("\n***Looking for HET antigen chains\n");
 
    /* Step through the chains                                           */
-   for(c=pdbs->chains; c!=NULL; NEXT(c))
+   for(c=pdbs->chains, chainNum=0; c!=NULL; NEXT(c), chainNum++)
    {
       /* If it's a HET chain                                            */
       if(c->extras == CHAINTYPE_HET)
@@ -1881,69 +8569,34 @@ void FlagHetAntigenChains(DOMAIN *domains, PDBSTRUCT *pdbs)
          PDBRESIDUE *r;
 
          /* Go through the residues in this HET chain                   */
-         for(r=c->residues; r!=NULL; NEXT(r))
+         for(r=c->residues, resNum=map->chainStart[chainNum]; 
+             r!=NULL; 
+             NEXT(r), resNum++)
          {
-            /* If it isn't a water and it has more than 3 atoms         */
-            if(!ISWATER(r) && (CountResidueAtoms(r) >= MINHETATOMS))
+            /* If it contacts a domain, isn't a water and it has enough 
+               atoms
+            */
+            if((map->resStart[resNum] < map->resStart[resNum+1]) &&
+               !(RESCLASS(r)->flags & RES_WATER) &&
+               (CountResidueAtoms(r) >= MINHETATOMS))
             {
                /* Go through the antibody domains                       */
                for(d=domains; d!=NULL; NEXT(d))
                {
-                  PDB *pc, *pd, *pdRes, *nextResP;
-                  int resnum = 0;
-
-                  /* Go through the atoms in this non-water HET residue */
-                  for(pc=r->start; pc!=r->stop; NEXT(pc))
+                  /* If it contacts a CDR residue of this domain        */
+                  if(HasCDRContact(map, resNum, d))
                   {
-                     /* Go through the residues in this antibody domain */
-                     for(pdRes=d->startRes;
-                         pdRes!=d->stopRes;
-                         pdRes=nextResP)
-                     {
-                        nextResP = blFindNextResidue(pdRes);
-                        resnum++;
-                        
-                        /* If this is a CDR residue                     */
-                        if(InIntArray(resnum, d->CDRRes, d->nCDRRes))
-                        {
-                           for(pd=pdRes; pd!=nextResP; NEXT(pd))
-                           {
-                              /* If this atom is close enough to the HET 
-                                 residue 
-                              */
-                              if(DISTSQ(pc, pd) < CONTACTDISTSQ)
-                              {
-                                 printf("HET group %s%d%s contacts \
-Domain %d\n",
-                                        pc->chain, pc->resnum, pc->insert,
-                                        d->domainNumber);
-#ifdef DEBUG
-                                 printf("%s%d%s.%s contacts %s%d%s.%s\n",
-                                        pc->chain, pc->resnum,
-                                        pc->insert, pc->atnam,
-                                        pd->chain, pd->resnum,
-                                        pd->insert, pd->atnam);
-#endif
-                                 /* Flag this HET residue as making 
-                                    contact   
-                                 */
-                                 if(d->nHetAntigen < MAXHETANTIGEN)
-                                 {
-                                    d->hetAntigen[d->nHetAntigen++] = r;
+                     printf("HET group %s%d%s contacts Domain %d\n",
+                            r->start->chain, r->start->resnum, 
+                            r->start->insert, d->domainNumber);
+
+                     /* Flag this HET residue as making contact         */
+                     AddHetAntigen(d, r);
 #ifdef DEBUG
-                                    printf("Stored domain %d residue \
-%s\n",
-                                           d->domainNumber, r->resid);
+                     printf("Stored domain %d residue %s\n",
+                            d->domainNumber, r->resid);
 #endif
-                                 }
-                                 goto lastatom;
-                              }  /* In distance range                   */
-                           }  /* Step through atoms in this residue     */
-                        } /* Is a CDR residue                           */
-                     } /* Step through residues in this domain          */
-                  }  /* step through atoms in the non-water HET residue */
-               lastatom:
-                  continue;
+                  }
                }  /* step through domains                               */
             }  /* not water                                             */
          }  /* step through residues in this HET chain                  */
@@ -1953,88 +8606,55 @@ Domain %d\n",
 
 
 /************************************************************************/
-void FlagHetAntigenResidues(WHOLEPDB *wpdb, DOMAIN *domains,
-                            PDBSTRUCT *pdbs)
+void FlagHetAntigenResidues(HETTABLE *hets, DOMAIN *domains,
+                            PDBSTRUCT *pdbs, CONTACTMAP *map)
 {
    DOMAIN   *d;
    PDBCHAIN *c;
+   int      chainNum,
+            resNum;
    
    printf("\n***Looking for HET antigen residues\n");
 
    /* Step through the chains                                           */
-   for(c=pdbs->chains; c!=NULL; NEXT(c))
+   for(c=pdbs->chains, chainNum=0; c!=NULL; NEXT(c), chainNum++)
    {
       /* If it's not a HET chain                                        */
       if(c->extras != CHAINTYPE_HET)
       {
          PDBRESIDUE *r;
          /* Go through the residues in this non-HET chain               */
-         for(r=c->residues; r!=NULL; NEXT(r))
+         for(r=c->residues, resNum=map->chainStart[chainNum]; 
+             r!=NULL; 
+             NEXT(r), resNum++)
          {
-            /* If it's a HETATM group and has no peptide backbone and 
-               isn't just an ion
+            /* If it contacts a domain, is a HETATM group and has no 
+               peptide backbone and isn't just an ion
             */
-            if(IsNonPeptideHet(wpdb,r))
+            if((map->resStart[resNum] < map->resStart[resNum+1]) &&
+               IsNonPeptideHet(hets,r))
             {
-               if(!ISWATER(r)) /* If it isn't a water                   */
+               /* If it isn't a water                                   */
+               if(!(RESCLASS(r)->flags & RES_WATER))
                {
                   /* Go through the antibody domains                    */
                   for(d=domains; d!=NULL; NEXT(d))
                   {
-                     PDB *pc, *pd, *pdRes, *nextResP;
-                     int resnum = 0;
-                     /* Go through the atoms in this non-water, 
-                        non-peptide HET residue 
-                     */
-                     for(pc=r->start; pc!=r->stop; NEXT(pc))
+                     /* If it contacts a CDR residue of this domain     */
+                     if(HasCDRContact(map, resNum, d))
                      {
-                        /* Go through the residues in this antibody domain */
-                        for(pdRes=d->startRes;
-                            pdRes!=d->stopRes;
-                            pdRes=nextResP)
-                        {
-                           nextResP = blFindNextResidue(pdRes);
-                           resnum++;
-                           
-                           /* If this is a CDR residue                     */
-                           if(InIntArray(resnum, d->CDRRes, d->nCDRRes))
-                           {
-                              
-                              for(pd=pdRes; pd!=nextResP; NEXT(pd))
-                              {
-                                 /* If this atom is close enough to the HET 
-                                    residue 
-                                 */
-                                 if(DISTSQ(pc, pd) < CONTACTDISTSQ)
-                                 {
 #ifdef DEBUG
-                                    printf("HET group %s%d%s contacts Domain \
-%d\n",
-                                           pc->chain, pc->resnum, pc->insert,
-                                           d->domainNumber);
-                                    printf("%s%d%s.%s contacts %s%d%s.%s\n",
-                                           pc->chain, pc->resnum,
-                                           pc->insert, pc->atnam,
-                                           pd->chain, pd->resnum,
-                                           pd->insert, pd->atnam);
+                        printf("HET group %s%d%s contacts Domain %d\n",
+                               r->start->chain, r->start->resnum, 
+                               r->start->insert, d->domainNumber);
 #endif
-                                    /* Flag this HET residue as making contact*/
-                                    if(d->nHetAntigen < MAXHETANTIGEN)
-                                    {
-                                       d->hetAntigen[d->nHetAntigen++] = r;
+                        /* Flag this HET residue as making contact      */
+                        AddHetAntigen(d, r);
 #ifdef DEBUG
-                                       printf("Stored domain %d residue %s\n",
-                                              d->domainNumber, r->resid);
+                        printf("Stored domain %d residue %s\n",
+                               d->domainNumber, r->resid);
 #endif
-                                    }
-                                    goto lastatom;
-                                 }  /* In range                               */
-                              }  /* Step through atoms in this antibody residue*/
-                           }  /* If it's a CDR residue */
-                        }  /* Step through residues in this antibody domain*/
-                     }  /* step through atoms in the non-water HET res  */
-                  lastatom:
-                     continue;
+                     }
                   }  /* step through domains                            */
                }  /* not water                                          */
             }  /* Is a non-peptide HET                                  */
@@ -2045,73 +8665,166 @@ void FlagHetAntigenResidues(WHOLEPDB *wpdb, DOMAIN *domains,
 
 int CountResidueAtoms(PDBRESIDUE *res)
 {
-   PDB *p;
-   int nAtoms = 0;
+   return(RESCLASS(res)->nAtoms);
+}
+
+
+/************************************************************************/
+/*>HETENTRY *FindHetEntry(HETTABLE *hets, char *resnam, BOOL create)
+   -----------------------------------------------------------------
+*//**
+   \param[in,out] hets     HET group table
+   \param[in]     resnam   Residue name (3 columns, as in the PDB file)
+   \param[in]     create   Add an entry if there isn't one
+   \return                 Entry for the residue (or NULL)
+
+   Names are compared without spaces so that right-justified names in
+   the header match those in the coordinates.
+
+-  17.10.26 Original   By: agent
+*/
+HETENTRY *FindHetEntry(HETTABLE *hets, char *resnam, BOOL create)
+{
+   HETENTRY *h;
+   char     name[8];
+   int      i, 
+            nChars = 0,
+            bucket;
+
+   for(i=0; (i<3) && resnam[i]; i++)
+   {
+      if(resnam[i] != ' ')
+         name[nChars++] = resnam[i];
+   }
+   name[nChars] = '\0';
    
+   bucket = HashBytes(2166136261UL, name, nChars) % HETHASHSIZE;
+   for(h=hets->buckets[bucket]; h!=NULL; NEXT(h))
+   {
+      if(!strcmp(h->resnam, name))
+         return(h);
+   }
+
+   if(!create)
+      return(NULL);
    
-   /* Step through atoms in this residue                                */
-   for(p=res->start; p!=res->stop; NEXT(p))
+   if((h = (HETENTRY *)malloc(sizeof(HETENTRY)))==NULL)
+   {
+      fprintf(stderr,"Error (%s): No memory for HET groups\n", PROGNAME);
+      exit(1);
+   }
+   strcpy(h->resnam, name);
+   h->flags              = 0;
+   h->next               = hets->buckets[bucket];
+   hets->buckets[bucket] = h;
+
+   return(h);
+}
+
+
+/************************************************************************/
+/*>HETTABLE *BuildHetTable(WHOLEPDB *wpdb)
+   ---------------------------------------
+*//**
+   \param[in]   wpdb    The entry
+   \return              Classification of its HET groups
+
+   Reads the HETNAM records once for the entry. A group is an ion if 
+   its HETNAM contains ' ION'. The MODRES records are read with
+   blGetModresWholePDB() and kept for the SEQRES code. FORMUL records
+   only give formulae so are not needed.
+
+-  17.10.26 Original   By: agent
+*/
+HETTABLE *BuildHetTable(WHOLEPDB *wpdb)
+{
+   HETTABLE   *hets;
+   HETENTRY   *h;
+   STRINGLIST *s;
+   int        i;
+
+   if((hets = (HETTABLE *)malloc(sizeof(HETTABLE)))==NULL)
+   {
+      fprintf(stderr,"Error (%s): No memory for HET groups\n", PROGNAME);
+      exit(1);
+   }
+   for(i=0; i<HETHASHSIZE; i++)
+      hets->buckets[i] = NULL;
+
+   for(s=wpdb->header; s!=NULL; NEXT(s))
    {
-      nAtoms++;
+      if(!strncmp(s->string, "HETNAM", 6) && 
+         (strlen(s->string) >= 14) &&
+         strstr(s->string, " ION"))
+      {
+         h = FindHetEntry(hets, s->string+11, TRUE);
+         h->flags |= HET_ION;
+      }
    }
-   return(nAtoms);
+
+   hets->modres = blGetModresWholePDB(wpdb);
+
+   return(hets);
 }
 
 
-BOOL IsNonPeptideHet(WHOLEPDB *wpdb, PDBRESIDUE *res)
+/************************************************************************/
+/*>void FreeHetTable(HETTABLE *hets)
+   ---------------------------------
+*//**
+   \param[in]   hets   HET group table to free
+
+-  17.10.26 Original   By: agent
+*/
+void FreeHetTable(HETTABLE *hets)
 {
-   PDB *p;
-   int hasBackbone = 0,
-       nAtoms      = 0;
-   BOOL isAllHet   = TRUE;
-   STRINGLIST *s;
-   
-   
-   /* Step through atoms in this residue                                */
-   for(p=res->start; p!=res->stop; NEXT(p))
+   HETENTRY *h, *next;
+   int      i;
+
+   for(i=0; i<HETHASHSIZE; i++)
    {
-      if(!strncmp(p->record_type, "HETATM", 6))
-      {
-         if(!strncmp(p->atnam, "N   ", 4) ||
-            !strncmp(p->atnam, "CA  ", 4) ||
-            !strncmp(p->atnam, "C   ", 4) ||
-            !strncmp(p->atnam, "O   ", 4) ||
-            !strncmp(p->atnam, "P   ", 4) ||
-            !strncmp(p->atnam, "OP1 ", 4) ||
-            !strncmp(p->atnam, "OP2 ", 4))
-            hasBackbone++;
-      }
-      else
+      for(h=hets->buckets[i]; h!=NULL; h=next)
       {
-         isAllHet = FALSE;
+         next = h->next;
+         free(h);
       }
-      nAtoms++;
    }
-   if((hasBackbone >= 3) || (!isAllHet) || (nAtoms < MINHETATOMS))
+   if(hets->modres != NULL)
+      FREELIST(hets->modres, MODRES);
+   free(hets);
+}
+
+
+/************************************************************************/
+/*>int HetClass(HETTABLE *hets, char *resnam)
+   ------------------------------------------
+*//**
+   \param[in]   hets     HET group table
+   \param[in]   resnam   Residue name
+   \return               HET_xxx flags for the residue (0 for a ligand
+                         or a group not in the header)
+
+-  17.10.26 Original   By: agent
+*/
+int HetClass(HETTABLE *hets, char *resnam)
+{
+   HETENTRY *h = FindHetEntry(hets, resnam, FALSE);
+   return((h == NULL) ? 0 : h->flags);
+}
+
+
+/************************************************************************/
+BOOL IsNonPeptideHet(HETTABLE *hets, PDBRESIDUE *res)
+{
+   RESINFO *info = RESCLASS(res);
+   
+   if((info->flags & RES_BACKBONE) || !(info->flags & RES_ALLHET) ||
+      (info->nAtoms < MINHETATOMS))
       return(FALSE);
    
    /* Check it isn't just an ion                                        */
-   for(s=wpdb->header; s!=NULL; NEXT(s))
-   {
-      /* Find HETNAM records in the header                              */
-      if(!strncmp(s->string, "HETNAM", 6))
-      {
-         char hetnam[8], *chp;
-
-         /* Grab this HETNAM record residue name                        */
-         strncpy(hetnam, s->string+11, 3);
-         hetnam[4] = '\0';
-         KILLLEADSPACES(chp, hetnam);
-
-         /* If it matches the residue in question                       */
-         if(!strncmp(chp, res->start->resnam, 3))
-         {
-            /* If the record contains the word ' ION' it's an ion       */
-            if(strstr(s->string, " ION"))
-               return(FALSE);
-         }
-      }
-   }
+   if(HetClass(hets, res->start->resnam) & HET_ION)
+      return(FALSE);
 
    return(TRUE);
    
@@ -2120,48 +8833,117 @@ BOOL IsNonPeptideHet(WHOLEPDB *wpdb, PDBRESIDUE *res)
 
 BOOL IsStandardResidue(PDBRESIDUE *res)
 {
+   return((RESCLASS(res)->flags & RES_STANDARD) ? TRUE : FALSE);
+}
+
+
+/************************************************************************/
+/*>void ClassifyResidues(PDBSTRUCT *pdbs, ARENA *arena)
+   ----------------------------------------------------
+*//**
+   \param[in,out] pdbs    PDB structure
+   \param[in]     arena   Arena for the classes
+
+   Makes one pass over the atoms of every residue and stores a RESINFO
+   in its extras field. A residue is standard (part of the chain 
+   sequence) if it has an ATOM record, or if it has at least three
+   HETATM backbone atoms and isn't all HETATM records. Record, atom and
+   residue names are compared as packed integers.
+
+-  17.10.26 Original   By: agent
+*/
+void ClassifyResidues(PDBSTRUCT *pdbs, ARENA *arena)
+{
+   PDBCHAIN   *c;
+   PDBRESIDUE *r;
    PDB        *p;
-   int        hasBackbone = 0;
-   BOOL       isAllHet    = TRUE;
-   
-   /* Step through atoms in this residue                                */
-   for(p=res->start; p!=res->stop; NEXT(p))
+   RESINFO    *info;
+   int        nBackbone;
+
+   for(c=pdbs->chains; c!=NULL; NEXT(c))
    {
-      /* As soon as we find an ATOM record it's standard                */
-      if(!strncmp(p->record_type, "ATOM  ", 6))
-         return(TRUE);
-      
-      if(!strncmp(p->record_type, "HETATM", 6))
+      for(r=c->residues; r!=NULL; NEXT(r))
       {
-         if(!strncmp(p->atnam, "N   ", 4) ||
-            !strncmp(p->atnam, "CA  ", 4) ||
-            !strncmp(p->atnam, "C   ", 4) ||
-            !strncmp(p->atnam, "O   ", 4) ||
-            !strncmp(p->atnam, "P   ", 4) ||
-            !strncmp(p->atnam, "OP1 ", 4) ||
-            !strncmp(p->atnam, "OP2 ", 4))
-            hasBackbone++;
-      }
-      else
-      {
-         isAllHet = FALSE;
+         info = (RESINFO *)ArenaAlloc(arena, sizeof(RESINFO));
+         info->flags = RES_ALLHET;
+         info->aa    = blThrone(r->resnam);
+         nBackbone   = 0;
+         
+         for(p=r->start; p!=r->stop; NEXT(p))
+         {
+            info->nAtoms++;
+            if((info->CA == NULL) &&
+               (PACKSTR4(p->atnam) == PACKNAME4('C','A',' ',' ')))
+               info->CA = p;
+            
+            switch(PACKSTR4(p->record_type))
+            {
+            case PACKNAME4('A','T','O','M'):
+               info->flags |= RES_HASATOM;
+               info->flags &= ~RES_ALLHET;
+               break;
+            case PACKNAME4('H','E','T','A'):
+               switch(PACKSTR4(p->atnam))
+               {
+               case PACKNAME4('N',' ',' ',' '):
+               case PACKNAME4('C','A',' ',' '):
+               case PACKNAME4('C',' ',' ',' '):
+               case PACKNAME4('O',' ',' ',' '):
+               case PACKNAME4('P',' ',' ',' '):
+               case PACKNAME4('O','P','1',' '):
+               case PACKNAME4('O','P','2',' '):
+                  nBackbone++;
+                  break;
+               }
+               break;
+            default:
+               info->flags &= ~RES_ALLHET;
+               break;
+            }
+         }
+
+         if(nBackbone >= 3)
+            info->flags |= RES_BACKBONE;
+         if((info->flags & RES_HASATOM) ||
+            ((info->flags & RES_BACKBONE) && !(info->flags & RES_ALLHET)))
+            info->flags |= RES_STANDARD;
+
+         switch(PACKSTR3(r->resnam))
+         {
+         case PACKNAME3(' ',' ','U'):
+         case PACKNAME3(' ',' ','A'):
+         case PACKNAME3(' ',' ','C'):
+         case PACKNAME3(' ',' ','G'):
+         case PACKNAME3(' ','D','T'):
+         case PACKNAME3(' ','D','A'):
+         case PACKNAME3(' ','D','C'):
+         case PACKNAME3(' ','D','G'):
+            info->flags |= RES_NUCLEOTIDE;
+            break;
+         case PACKNAME3('H','O','H'):
+         case PACKNAME3('O','H','2'):
+         case PACKNAME3('O','H','H'):
+         case PACKNAME3('D','O','D'):
+         case PACKNAME3('O','D','2'):
+         case PACKNAME3('O','D','D'):
+         case PACKNAME3('W','A','T'):
+            info->flags |= RES_WATER;
+            break;
+         }
+         
+         r->extras = (APTR)info;
       }
    }
-
-   if((hasBackbone <= 2) || (isAllHet))
-      return(FALSE);
-   
-   return(TRUE);
 }
 
 
 
-PDB *RelabelAntibodyChain(DOMAIN *domain, BOOL *lowerCaseLight,
+/* 17.10.26 Only chooses the label - the atoms are no longer copied
+            By: agent
+*/
+void RelabelAntibodyChain(DOMAIN *domain, BOOL *lowerCaseLight,
                           BOOL *lowerCaseHeavy, char *remark950)
 {
-   PDB *p, *q;
-   PDB *pdb = NULL;
-
    remark950[0] = '\0';
    
    if(domain)
@@ -2189,40 +8971,19 @@ PDB *RelabelAntibodyChain(DOMAIN *domain, BOOL *lowerCaseLight,
       sprintf(remark950, "REMARK 950 CHAIN %c     %c%6s\n",
               domain->chainType, chainLabel,
               domain->startRes->chain);
-
-      for(p=domain->startRes; p!=domain->stopRes; NEXT(p))
-      {
-         if(pdb==NULL)
-         {
-            INIT(pdb, PDB);
-            q=pdb;
-         }
-         else
-         {
-            ALLOCNEXT(q, PDB);
-         }
-         if(q==NULL)
-         {
-            FREELIST(pdb, PDB);
-            return(NULL);
-         }
-         
-         blCopyPDB(q, p);
-         q->chain[0] = chainLabel;
-         q->chain[1] = '\0';
-      }
    }
-   return(pdb);
 }
 
    
-PDB *RelabelAntigenChains(DOMAIN *domain, char *remark950)
+/* 17.10.26 Only chooses the labels - the atoms are no longer copied.
+            The whole label is kept in newAgChainLabels   By: agent
+*/
+void RelabelAntigenChains(DOMAIN *domain, char *remark950)
 {
-   PDB *p, *q;
-   PDB *pdb = NULL;
    int i;
-   static char sAntigenChains[MAXANTIGEN][MAXCHAINLABEL];
-   static int  sNumAntigenChains = 0;
+   static char (*sAntigenChains)[MAXCHAINLABEL] = NULL;
+   static int  sNumAntigenChains = 0,
+               sMaxAntigenChains = 0;
    static char sAntigenLabel     = 'a';
    
    remark950[0] = '\0';
@@ -2251,47 +9012,61 @@ PDB *RelabelAntigenChains(DOMAIN *domain, char *remark950)
          strcpy(chainLabel, label);
       }
 
-      strcpy(sAntigenChains[sNumAntigenChains], chainLabel);
-      if(++sNumAntigenChains >= MAXANTIGEN)
+      if(sNumAntigenChains == sMaxAntigenChains)
       {
-         fprintf(stderr, "Error: Too many antigen chains - \
-Increase MAXANTIGEN\n");
-         exit(1);
+         sMaxAntigenChains += MAXANTIGEN;
+         if((sAntigenChains = (char (*)[MAXCHAINLABEL])
+             realloc(sAntigenChains, 
+                     sMaxAntigenChains * MAXCHAINLABEL))==NULL)
+         {
+            fprintf(stderr, "Error: No memory for antigen chains\n");
+            exit(1);
+         }
       }
+      strcpy(sAntigenChains[sNumAntigenChains++], chainLabel);
 
       
       sprintf(record, "REMARK 950 CHAIN A%6s%6s\n",
               chainLabel, chain->start->chain);
       strcat(remark950, record);
-      domain->newAgChainLabels[i][0] = chainLabel[0];
-      domain->newAgChainLabels[i][1] = '\0';
+      strcpy(domain->newAgChainLabels[i], chainLabel);
+   }
+}
 
-      for(p=chain->start; p!=chain->stop; NEXT(p))
-      {
-         if(pdb==NULL)
-         {
-            INIT(pdb, PDB);
-            q=pdb;
-         }
-         else
-         {
-            ALLOCNEXT(q, PDB);
-         }
-         if(q==NULL)
-         {
-            FREELIST(pdb, PDB);
-            return(NULL);
-         }
-         
-         blCopyPDB(q, p);
-         strcpy(q->chain, chainLabel);
-      }
+
+/************************************************************************/
+/*>void WriteRelabelledAtoms(FILE *fp, PDB *start, PDB *stop, 
+                             char *label)
+   ----------------------------------------------------------
+*//**
+   \param[in]     fp      Output file
+   \param[in,out] start   First atom to write
+   \param[in]     stop    Atom after the last one
+   \param[in]     label   Chain label to write
+
+   Writes the atoms with a different chain label. Each atom's label is
+   swapped in just for blWritePDBRecord() and then put back, so the 
+   records are exactly as they would be for a relabelled copy without 
+   copying anything.
+
+-  17.10.26 Original   By: agent
+*/
+void WriteRelabelledAtoms(FILE *fp, PDB *start, PDB *stop, char *label)
+{
+   PDB  *p;
+   char chain[blMAXCHAINLABEL];
+
+   for(p=start; p!=stop; NEXT(p))
+   {
+      strcpy(chain, p->chain);
+      strcpy(p->chain, label);
+      blWritePDBRecord(fp, p);
+      strcpy(p->chain, chain);
    }
-   return(pdb);
 }
 
 
-BOOL inAntigenArray(char antigenChains[MAXANTIGEN][MAXCHAINLABEL],
+BOOL inAntigenArray(char (*antigenChains)[MAXCHAINLABEL],
                     int numAntigenChains, char *chainLabel)
 {
    int i;
@@ -2305,81 +9080,166 @@ BOOL inAntigenArray(char antigenChains[MAXANTIGEN][MAXCHAINLABEL],
 
 
    
-void WriteSeqres(FILE *fp, WHOLEPDB *wpdb, DOMAIN *domain)
+/* 17.10.26 Uses the header index, and relabels the chains of the MODRES
+            records, which are now only written for the chains in the 
+            file   By: agent
+*/
+void WriteSeqres(FILE *fp, HEADERINDEX *headers, DOMAIN *domain)
 {
-   STRINGLIST *s;
-   int        i;
-   char       buffer[MAXBUFF];
+   DOMAIN *pd = domain->pairedDomain;
+   int    i,
+          pass;
+   BOOL   modres;
 
-   /* Print any MODRES records                                          */
-   /************** TODO: need to fix the chain name          ************/
-   for(s=wpdb->header; s!=NULL; NEXT(s))
+   /* Print MODRES records and then SEQRES records for this domain's 
+      chain, the partner domain's chain and the antigen chains
+   */
+   for(pass=0; pass<2; pass++)
    {
-      if(!strncmp(s->string, "MODRES", 6))
-      {
-         fprintf(fp, "%s", s->string);
-      }
+      modres = (pass == 0);
+      WriteChainHeaders(fp, headers, domain->startRes->chain[0],
+                        domain->newAbChainLabel[0], modres);
+      if(pd != NULL)
+         WriteChainHeaders(fp, headers, pd->startRes->chain[0],
+                           pd->newAbChainLabel[0], modres);
+      for(i=0; i<domain->nAntigenChains; i++)
+         WriteChainHeaders(fp, headers, 
+                           domain->antigenChains[i]->chain[0],
+                           domain->newAgChainLabels[i][0], modres);
    }
-   
-   /* Print SEQRES for this domain's chain                              */
-   for(s=wpdb->header; s!=NULL; NEXT(s))
+}
+
+
+/************************************************************************/
+/*>HEADERINDEX *BuildHeaderIndex(WHOLEPDB *wpdb, ARENA *arena)
+   -----------------------------------------------------------
+*//**
+   \param[in]   wpdb    The entry
+   \param[in]   arena   Arena for the index
+   \return              SEQRES and MODRES records by chain label
+
+   Groups the SEQRES and MODRES records by chain label in one pass over 
+   the header, keeping them in order
+
+-  17.10.26 Original   By: agent
+*/
+HEADERINDEX *BuildHeaderIndex(WHOLEPDB *wpdb, ARENA *arena)
+{
+   HEADERINDEX *headers;
+   HEADERCHAIN *hc;
+   STRINGLIST  *s;
+   int         pass,
+               i;
+
+   headers = (HEADERINDEX *)ArenaAlloc(arena, sizeof(HEADERINDEX));
+
+   /* Count the records for each chain and then store them              */
+   for(pass=0; pass<2; pass++)
    {
-      if(!strncmp(s->string, "SEQRES", 6))
+      for(s=wpdb->header; s!=NULL; NEXT(s))
       {
-         if(s->string[11] == domain->startRes->chain[0])
+         if(!strncmp(s->string, "SEQRES", 6) &&
+            (strlen(s->string) > SEQRESCHAINCOL))
+         {
+            hc = &(headers->chains[(UBYTE)s->string[SEQRESCHAINCOL]]);
+            if(pass)
+               hc->seqres[hc->nSeqres] = s;
+            hc->nSeqres++;
+         }
+         else if(!strncmp(s->string, "MODRES", 6) &&
+                 (strlen(s->string) > MODRESCHAINCOL))
          {
-            strcpy(buffer, s->string);
-            buffer[11] = domain->newAbChainLabel[0];
-            fprintf(fp, "%s", buffer);
+            hc = &(headers->chains[(UBYTE)s->string[MODRESCHAINCOL]]);
+            if(pass)
+               hc->modres[hc->nModres] = s;
+            hc->nModres++;
          }
       }
-   }
 
-   /* Print SEQRES for the partner domain's chain                       */
-   for(s=wpdb->header; s!=NULL; NEXT(s))
-   {
-      if(!strncmp(s->string, "SEQRES", 6))
+      for(i=0; (pass==0) && (i<256); i++)
       {
-         if(domain->pairedDomain != NULL)
-         {
-            if(s->string[11] == domain->pairedDomain->startRes->chain[0])
-            {
-               strcpy(buffer, s->string);
-               buffer[11] = domain->pairedDomain->newAbChainLabel[0];
-               fprintf(fp, "%s", buffer);
-            }
-         }
+         hc = &(headers->chains[i]);
+         hc->seqres  = (STRINGLIST **)ArenaAlloc(arena, (hc->nSeqres+1) *
+                                                 sizeof(STRINGLIST *));
+         hc->modres  = (STRINGLIST **)ArenaAlloc(arena, (hc->nModres+1) *
+                                                 sizeof(STRINGLIST *));
+         hc->nSeqres = hc->nModres = 0;
       }
    }
    
-   /* Print SEQRES for the antigen chains                               */
-   for(i=0; i<domain->nAntigenChains; i++)
-   {
-      PDBCHAIN *chain = domain->antigenChains[i];
+   return(headers);
+}
 
-      for(s=wpdb->header; s!=NULL; NEXT(s))
-      {
-         if(!strncmp(s->string, "SEQRES", 6))
-         {
-            if(s->string[11] == chain->chain[0])
-            {
-               strcpy(buffer, s->string);
-               buffer[11] = domain->newAgChainLabels[i][0];
-               fprintf(fp, "%s", buffer);
-            }
-         }
-      }
+
+/************************************************************************/
+/*>void WriteChainHeaders(FILE *fp, HEADERINDEX *headers, char chain,
+                          char label, BOOL modres)
+   ------------------------------------------------------------------
+*//**
+   \param[in]   fp        Output file
+   \param[in]   headers   Header index
+   \param[in]   chain     Original chain label
+   \param[in]   label     New chain label
+   \param[in]   modres    Write the MODRES (rather than SEQRES) records
+
+   Writes the SEQRES or MODRES records of a chain with its new label
+
+-  17.10.26 Original   By: agent
+*/
+void WriteChainHeaders(FILE *fp, HEADERINDEX *headers, char chain,
+                       char label, BOOL modres)
+{
+   HEADERCHAIN *hc = &(headers->chains[(UBYTE)chain]);
+
+   if(modres)
+      WriteRelabelledLines(fp, hc->modres, hc->nModres, MODRESCHAINCOL,
+                           label);
+   else
+      WriteRelabelledLines(fp, hc->seqres, hc->nSeqres, SEQRESCHAINCOL,
+                           label);
+}
+
+
+/************************************************************************/
+/*>void WriteRelabelledLines(FILE *fp, STRINGLIST **lines, int nLines,
+                             int column, char label)
+   -------------------------------------------------------------------
+*//**
+   \param[in]   fp       Output file
+   \param[in]   lines    Header records
+   \param[in]   nLines   Number of records
+   \param[in]   column   Column of the chain label (from 0)
+   \param[in]   label    New chain label
+
+   Writes header records with a different chain label. The records are
+   written around the label rather than copied.
+
+-  17.10.26 Original   By: agent
+*/
+void WriteRelabelledLines(FILE *fp, STRINGLIST **lines, int nLines,
+                          int column, char label)
+{
+   int i;
+
+   for(i=0; i<nLines; i++)
+   {
+      fwrite(lines[i]->string, 1, column, fp);
+      fputc(label, fp);
+      fputs(lines[i]->string + column + 1, fp);
    }
 }
 
 
-/* Note that we don't actually use the output from this!                */
-char *blFixSequenceWholePDB(WHOLEPDB *wpdb, char **outChains,
+/* Note that we don't actually use the output from this!
+   17.10.26 Takes the MODRES records from the HET group table rather than
+            reading them again   By: agent
+*/
+char *blFixSequenceWholePDB(WHOLEPDB *wpdb, MODRES *modres,
+                            char **outChains,
                             BOOL ignoreSeqresForMissingChains,
                             BOOL upper, BOOL quiet, char *label)
 {
    PDB    *pdb;
-   MODRES *modres         = NULL;
    char   *seqresSequence = NULL,
           *atomSequence   = NULL,
           *fixedSequence  = NULL,
@@ -2398,8 +9258,7 @@ char *blFixSequenceWholePDB(WHOLEPDB *wpdb, char **outChains,
       return(NULL);
    }
    
-   /* Read MODRES and SEQRES records                                    */
-   modres         = blGetModresWholePDB(wpdb);
+   /* Read SEQRES records                                               */
    seqresSequence = blGetSeqresAsStringWholePDB(wpdb,
                                                 seqresChains,
                                                 modres, TRUE);
@@ -2458,9 +9317,6 @@ char *blFixSequenceWholePDB(WHOLEPDB *wpdb, char **outChains,
    if(atomChains!=NULL)
       blFreeArray2D(atomChains, nAtomChains, blMAXCHAINLABEL);
 
-   if(modres!=NULL)
-      FREELIST(modres, MODRES);
-
    FREE(seqresSequence);
    FREE(atomSequence);
    
@@ -2478,52 +9334,211 @@ int FindLastAlignmentPosition(char *refAln)
    return(pos);
 }
 
-BOOL DomainSequenceMatchesChainSequence(DOMAIN *domain, PDBCHAIN *chain)
+/************************************************************************/
+/*>SEQCHECKS *CreateSeqChecks(PDBSTRUCT *pdbs, ARENA *arena)
+   ----------------------------------------------------------
+*//**
+   \param[in]   pdbs    The entry
+   \param[in]   arena   Arena for the checks
+   \return              Empty set of crystal packing checks
+
+-  17.10.26 Original   By: agent
+*/
+SEQCHECKS *CreateSeqChecks(PDBSTRUCT *pdbs, ARENA *arena)
+{
+   SEQCHECKS *checks;
+   PDBCHAIN  *chain;
+
+   checks          = (SEQCHECKS *)ArenaAlloc(arena, sizeof(SEQCHECKS));
+   checks->arena   = arena;
+   checks->matches = NULL;
+   checks->nChains = 0;
+   for(chain=pdbs->chains; chain!=NULL; NEXT(chain))
+      checks->nChains++;
+
+   checks->chainSeqs  = (char **)ArenaAlloc(arena, (checks->nChains+1) *
+                                            sizeof(char *));
+   return(checks);
+}
+
+
+/************************************************************************/
+/*>char *GetCheckChainSeq(SEQCHECKS *checks, PDBCHAIN *chain, 
+                          int chainNum)
+   ----------------------------------------------------------
+*//**
+   \param[in,out] checks     Crystal packing checks for the entry
+   \param[in]     chain      A chain
+   \param[in]     chainNum   Position of the chain in the entry
+   \return                   Sequence of the chain
+
+   The sequence of each chain is assembled the first time it is needed.
+   If an earlier chain has the same sequence, that copy is returned 
+   instead so that sequences can be compared by their pointers.
+
+-  17.10.26 Original   By: agent
+*/
+char *GetCheckChainSeq(SEQCHECKS *checks, PDBCHAIN *chain, int chainNum)
 {
-   if(domain != NULL)
-   {
-      PDBRESIDUE *r;
-      char       chainSeq[MAXSEQ+1],
-                 alignChainSeq[MAXSEQ+1],
-                 alignDomSeq[MAXSEQ+1];
-      int        nRes     = 0,
-                 alignLen;
-      REAL       percId;
-      
+   PDBRESIDUE *r;
+   char       *seq;
+   int        nRes = 0,
+              i;
 
-      /* Assemble the chain sequence                                    */
+   if(checks->chainSeqs[chainNum] == NULL)
+   {
+      for(r=chain->residues; r!=NULL; NEXT(r))
+         nRes++;
+      seq = (char *)ArenaAlloc(checks->arena, nRes+1);
+      nRes = 0;
       for(r=chain->residues; r!=NULL; NEXT(r))
+         seq[nRes++] = RESCLASS(r)->aa;
+      seq[nRes] = '\0';
+
+      for(i=0; i<checks->nChains; i++)
       {
-         chainSeq[nRes++] = blThrone(r->resnam);
+         if((checks->chainSeqs[i] != NULL) &&
+            !strcmp(checks->chainSeqs[i], seq))
+         {
+            checks->chainSeqs[chainNum] = checks->chainSeqs[i];
+            break;
+         }
       }
-      chainSeq[nRes] = '\0';
 
-      /* Align the sequences                                            */
-      blAffinealign(chainSeq, strlen(chainSeq),
-                    domain->domSeq, strlen(domain->domSeq),
-                    FALSE,          /* verbose                  */
-                    TRUE,           /* identity                 */
-                    2,              /* penalty                  */
-                    0,              /* extension                */
-                    alignChainSeq,
-                    alignDomSeq,
-                    &alignLen);
-      /* Score the matched residues                                     */
-      percId = ScoreAlignedResidues(alignChainSeq, alignDomSeq,
-                                    alignLen, MINSEQLEN);
+      if(checks->chainSeqs[chainNum] == NULL)
+         checks->chainSeqs[chainNum] = seq;
+   }
+
+   return(checks->chainSeqs[chainNum]);
+}
+
+
+/************************************************************************/
+/*>BOOL PrefilterSeqMatch(char *seq1, char *seq2, BOOL *match)
+   -----------------------------------------------------------
+*//**
+   \param[in]   seq1    A sequence
+   \param[in]   seq2    Another sequence
+   \param[out]  match   Do the sequences match?
+   \return              Was the match settled without an alignment?
+
+   Cheap tests that give the same answer as aligning the sequences and
+   scoring them with ScoreAlignedResidues():
+   - A sequence shorter than MINSEQLEN can't give enough aligned pairs
+   - If one sequence is contained in the other, the best alignment 
+     pairs all of the shorter one with identical residues
+
+   Other pairs still need the alignment. Gaps don't count against the
+   identity, so neither k-mer counts nor ungapped diagonals bound it,
+   and chains of domain length almost always have enough residues in
+   common to pass a composition bound.
+
+-  17.10.26 Original   By: agent
+*/
+BOOL PrefilterSeqMatch(char *seq1, char *seq2, BOOL *match)
+{
+   int len1 = strlen(seq1),
+       len2 = strlen(seq2);
+
+   *match = FALSE;
+   if((len1 < MINSEQLEN) || (len2 < MINSEQLEN))
+      return(TRUE);
+
+   if(((len1 <= len2) && (strstr(seq2, seq1) != NULL)) ||
+      ((len2 <  len1) && (strstr(seq1, seq2) != NULL)))
+   {
+      *match = TRUE;
+      return(TRUE);
+   }
+
+   return(FALSE);
+}
+
+
+/************************************************************************/
+/*>BOOL DomainSequenceMatchesChainSequence(DOMAIN *domain, PDBCHAIN *chain,
+                                           int chainNum, SEQCHECKS *checks)
+   ------------------------------------------------------------------------
+*//**
+   \param[in]     domain     A domain (or NULL)
+   \param[in]     chain      A chain
+   \param[in]     chainNum   Position of the chain in the entry
+   \param[in,out] checks     Crystal packing checks for the entry
+   \return                   Does the chain have the same sequence as
+                             the domain?
+
+   The result for each pair of domain and chain sequences is remembered,
+   so domains and chains with the same sequences are only checked once.
+   Short sequences and sequences contained in one another are settled 
+   by PrefilterSeqMatch(); the others are aligned.
+
+-  17.10.26 Memoised and prefiltered   By: agent
+*/
+BOOL DomainSequenceMatchesChainSequence(DOMAIN *domain, PDBCHAIN *chain,
+                                        int chainNum, SEQCHECKS *checks)
+{
+   if(domain != NULL)
+   {
+      SEQMATCH *m;
+      char     *chainSeq,
+               *alignChainSeq,
+               *alignDomSeq;
+      int      alignLen;
+      REAL     percId;
+      BOOL     match;
+
+      chainSeq = GetCheckChainSeq(checks, chain, chainNum);
+      for(m=checks->matches; m!=NULL; NEXT(m))
+      {
+         if((m->chainSeq == chainSeq) && !strcmp(m->domSeq, domain->domSeq))
+            return(m->match);
+      }
+
+      if(!PrefilterSeqMatch(chainSeq, domain->domSeq, &match))
+      {
+         alignLen      = strlen(chainSeq) + strlen(domain->domSeq) + 1;
+         if(((alignChainSeq = (char *)malloc(alignLen))==NULL) ||
+            ((alignDomSeq   = (char *)malloc(alignLen))==NULL))
+         {
+            fprintf(stderr,"Error (%s): No memory for sequence \
+alignment\n", PROGNAME);
+            exit(1);
+         }
+
+         /* Align the sequences                                         */
+         blAffinealign(chainSeq, strlen(chainSeq),
+                       domain->domSeq, strlen(domain->domSeq),
+                       FALSE,          /* verbose                  */
+                       TRUE,           /* identity                 */
+                       2,              /* penalty                  */
+                       0,              /* extension                */
+                       alignChainSeq,
+                       alignDomSeq,
+                       &alignLen);
+         /* Score the matched residues                                  */
+         percId = ScoreAlignedResidues(alignChainSeq, alignDomSeq,
+                                       alignLen, MINSEQLEN);
 
 #ifdef DEBUG
-      printf("\nChain %s <=> Domain %d (chain %s)\n",
-             chain->chain, domain->domainNumber, domain->chain->chain);
-      printf("DOM: %s\n",   alignDomSeq);
-      printf("CHN: %s\n",   alignChainSeq);
-      printf("SCO: %f\n\n", percId);
+         printf("\nChain %s <=> Domain %d (chain %s)\n",
+                chain->chain, domain->domainNumber, domain->chain->chain);
+         printf("DOM: %s\n",   alignDomSeq);
+         printf("CHN: %s\n",   alignChainSeq);
+         printf("SCO: %f\n\n", percId);
 #endif
-      
-      if(percId >= SAMESEQ_CUTOFF)
-      {
-         return(TRUE);
+         match = (percId >= SAMESEQ_CUTOFF);
+         free(alignChainSeq);
+         free(alignDomSeq);
       }
+
+      m           = (SEQMATCH *)ArenaAlloc(checks->arena, sizeof(SEQMATCH));
+      m->domSeq   = domain->domSeq;
+      m->chainSeq = chainSeq;
+      m->match    = match;
+      m->next     = checks->matches;
+      checks->matches = m;
+
+      return(match);
    }
    
    return(FALSE);
@@ -1,4 +1,5 @@
 #ifndef __ABSPLIT_H__
 #  define ABSEQFILE "/share/absplit/data/templates.faa"
+#  define ABIDXFILE "/share/absplit/data/templates.idx"
 #  define __ABSPLIT_H__ 1
 #endif
@@ -0,0 +1,68 @@
+#!/bin/bash
+# Checks that the native alignment engines give the same results as
+# blAffinealign() from BiopLib (-e bioplib) and that the batched engine
+# gives the same results as the scalar one. Each engine aligns the
+# sequences in engines_queries.faa against engines_templates.faa (-x) and
+# splits each of the PDB files in this directory. The output must be
+# identical for all the engines. engines_queries.faa includes a query of
+# over 2500 residues and engines_templates.faa includes templates of
+# exactly BATCHMAXLEN (255) residues and of one more.
+#
+# Usage: checkengines.sh [absplit]
+# Engines that the CPU does not support fall back to the best one that
+# it does.
+
+absplit=${1:-${HOME}/git/absplit/bin/absplit}
+tdir=`dirname $0`
+tdir=`cd $tdir; pwd`
+work=`mktemp -d`
+status=0
+
+function runengine
+{
+    engine=$1
+    edir=$work/$engine
+    mkdir -p $edir
+
+    $absplit -e $engine -x $tdir/engines_templates.faa \
+             $tdir/engines_queries.faa > $edir/engines.out 2>&1
+
+    for file in $tdir/*.pdb $tdir/*.ent
+    do
+        stem=`basename $file`
+        for shortlist in 0 40
+        do
+            mkdir -p $edir/$stem.$shortlist
+            (cd $edir/$stem.$shortlist; \
+             $absplit -v -k $shortlist -e $engine $file \
+                      > stdout.txt 2> stderr.txt)
+        done
+    done
+}
+
+function compareengine
+{
+    reference=$1
+    engine=$2
+    if diff -r $work/$reference $work/$engine > $work/$engine.diff
+    then
+        echo "$engine: OK"
+    else
+        echo "$engine: DIFFERS from $reference"
+        cat $work/$engine.diff
+        status=1
+    fi
+}
+
+for engine in bioplib scalar sse4 avx2 batch
+do
+    runengine $engine
+done
+
+compareengine bioplib scalar
+compareengine bioplib sse4
+compareengine bioplib avx2
+compareengine scalar  batch
+
+rm -rf $work
+exit $status